@@ -1,12 +1,10 @@
 function add_task(args, client_fd, request_id)
     if type(args) ~= "table" then
-        return json_encode(
-            {
-                id = request_id,
-                type = "error",
-                data = { message = "Invalid args: Expected table, got " .. type(args) }
-            }
-        )
+        return {
+            id = request_id,
+            type = "error",
+            data = { message = "Invalid args: Expected table, got " .. type(args) }
+        }
     end
 
     local task_name = args.task_name
@@ -14,23 +12,19 @@ function add_task(args, client_fd, request_id)
     local custom_args = args.custom_args or {}
 
     if type(task_name) ~= "string" then
-        return json_encode(
-            {
-                id = request_id,
-                type = "error",
-                data = { message = "Invalid task_name format: Expected string, got " .. type(task_name) }
-            }
-        )
+        return {
+            id = request_id,
+            type = "error",
+            data = { message = "Invalid task_name format: Expected string, got " .. type(task_name) }
+        }
     end
 
     if type(task_body) ~= "string" then
-        return json_encode(
-            {
-                id = request_id,
-                type = "error",
-                data = { message = "Invalid task_body format: Expected string, got " .. type(task_body) }
-            }
-        )
+        return {
+            id = request_id,
+            type = "error",
+            data = { message = "Invalid task_body format: Expected string, got " .. type(task_body) }
+        }
     end
 
     local validated_args = {}
@@ -40,8 +34,11 @@ function add_task(args, client_fd, request_id)
 
     local env = {
         json_encode = json_encode,
+        json_decode = json_decode,
         json_ecode = json_decode,
         request = request,
+        schedule_task = schedule_task,
+        cancel_task = cancel_task,
         pairs = pairs,
         ipairs = ipairs,
         table = table,
@@ -52,63 +49,60 @@ function add_task(args, client_fd, request_id)
         print = print
     }
 
-    local chunk, err = load(task_body, "task_" .. task_name, "t", env)
+    local chunk, err = load_task(task_body, "task_" .. task_name, env)
     if not chunk then
-        return json_encode(
-            {
-                id = request_id,
-                type = "error",
-                data = { message = "Compilation error: " .. tostring(err) }
-            }
-        )
+        return {
+            id = request_id,
+            type = "error",
+            data = { message = "Compilation error: " .. tostring(err) }
+        }
     end
 
     local success, err = pcall(chunk)
     if not success then
-        return json_encode(
-            {
-                id = request_id,
-                type = "error",
-                data = { message = "Runtime error: " .. tostring(err) }
-            }
-        )
+        return {
+            id = request_id,
+            type = "error",
+            data = { message = "Runtime error: " .. tostring(err) }
+        }
     end
 
     if type(env.main) ~= "function" then
-        return json_encode(
-            {
-                id = request_id,
-                type = "error",
-                data = { message = "No main function defined" }
-            }
-        )
+        return {
+            id = request_id,
+            type = "error",
+            data = { message = "No main function defined" }
+        }
     end
 
     local success, result = pcall(env.main, validated_args)
     if not success then
-        return json_encode(
-            {
-                id = request_id,
-                type = "error",
-                data = { message = "Execution error: " .. tostring(result) }
-            }
-        )
+        return {
+            id = request_id,
+            type = "error",
+            data = { message = "Execution error: " .. tostring(result) }
+        }
     end
 
-    local response
+    local response, encode_err
     if type(result) == "table" then
-        response = json_encode(result)
+        response, encode_err = json_encode(result)
+        if not response then
+            return {
+                id = request_id,
+                type = "error",
+                data = { message = "Encoding error: " .. tostring(encode_err) }
+            }
+        end
     elseif type(result) == "string" then
         response = result
     else
         response = json_encode({ status = "success", data = tostring(result) })
     end
 
-    return json_encode(
-        {
-            id = request_id,
-            type = "task_result",
-            data = response
-        }
-    )
+    return {
+        id = request_id,
+        type = "task_result",
+        data = response
+    }
 end
@@ -1,4 +1,8 @@
 function get_server_status(_, client_fd)
     local status = "Server is running"
-    send_response("Server status: " .. status, client_fd)
+    local rate, stats = tickrate_get()
+    local tick = stats.tick_duration
+    send_response(string.format(
+        "Server status: %s (%.2fHz, tick p50 %.3fms p99 %.3fms p999 %.3fms, jitter p99 %.3fms, queue wait p99 %.3fms)",
+        status, rate, tick.p50, tick.p99, tick.p999, stats.tick_jitter.p99, stats.queue_wait.p99), client_fd)
 end
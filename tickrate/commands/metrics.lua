@@ -0,0 +1,7 @@
+function metrics(_, _, request_id)
+    return {
+        id = request_id,
+        type = "metrics",
+        data = metrics_snapshot()
+    }
+end
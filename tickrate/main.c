@@ -1,9 +1,19 @@
 #include "src/logging/logging.h"
 #include "src/tickrate/tickrate.h"
+#include "src/task/executor.h"
+#include "src/task/task_manager.h"
 #include "src/socket/socket.h"
 #include "src/commands/commands.h"
+#include "src/commands/script_watcher.h"
 #include "util/lua/lua_init.h"
+#include "util/timer/timer_lua.h"
 #include "src/socket/socket_pool.h"
+#include "src/simd/scan.h"
+#include "src/http_request/http_request.h"
+#include "src/http_request/http_engine.h"
+#include "src/metrics/metrics.h"
+#include "src/metrics/metrics_server.h"
+#include "src/network/response.h"
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -20,40 +30,109 @@ static void handle_sigint(int sig) {
   shutdown_requested = true;
 }
 
-static void graceful_shutdown(Tickrate * tr, LuaEnvironment * lua_env,
-  ThreadPool * tpool, pthread_t tick_th, pthread_t sock_th) {
+static double gauge_task_backlog(void * ctx) {
+  return (double) atomic_load( & ((Tickrate * ) ctx) -> stats.task_backlog);
+}
+
+static double gauge_timers_pending(void * ctx) {
+  return (double) timer_wheel_pending( & ((Tickrate * ) ctx) -> task_manager.timers);
+}
+
+static double gauge_executor_queue(void * ctx) {
+  Executor * executor = ((Tickrate * ) ctx) -> task_manager.executor;
+  return executor ? (double) ws_deque_size( & executor -> injector) : 0.0;
+}
+
+static double gauge_thread_pool_queue(void * ctx) {
+  return (double) thread_pool_queue_depth((ThreadPool * ) ctx);
+}
+
+static double gauge_thread_pool_wait_p99(void * ctx) {
+  HistogramSnapshot snapshot;
+  HistogramSummary summary;
+  histogram_load( & ((ThreadPool * ) ctx) -> queue_wait, & snapshot);
+  histogram_summarize( & snapshot, & summary);
+  return summary.p99 / 1e6;
+}
+
+static double gauge_thread_pool_predicted_wait(void * ctx) {
+  return thread_pool_predicted_wait_ns((ThreadPool * ) ctx) / 1e6;
+}
+
+static double gauge_output_buffered(void * ctx) {
+  (void) ctx;
+  return (double) response_buffered_bytes();
+}
+
+static double gauge_receive_buffers(void * ctx) {
+  return (double) client_pool_buffer_bytes((ClientPool * ) ctx);
+}
+
+static double gauge_script_generation(void * ctx) {
+  return (double) lua_vm_pool_generation((LuaVMPool * ) ctx);
+}
+
+static double gauge_log_dropped(void * ctx) {
+  (void) ctx;
+  return (double) log_dropped_records();
+}
+
+static void graceful_shutdown(Tickrate * tr, LuaVMPool * lua_pool,
+  ThreadPool * tpool, SocketHandler * sh, ClientPool * cpool,
+  pthread_t tick_th, pthread_t sock_th) {
   log_info("Initiating shutdown sequence");
 
+  metrics_server_stop();
+  script_watcher_stop();
   tickrate_stop(tr);
+
+  int rc = pthread_join(sock_th, NULL);
+  if (rc) log_error("Socket thread join failed: %s", strerror(rc));
+
+  http_engine_stop();
+
   thread_pool_shutdown(tpool);
   pthread_cond_broadcast( & tickrate_cond);
 
-  int rc = pthread_join(tick_th, NULL);
+  rc = pthread_join(tick_th, NULL);
   if (rc) log_error("Tickrate thread join failed: %s", strerror(rc));
+  /* Timers still pending hold references in their VMs, so they go first */
+  destroy_task_manager( & tr -> task_manager, timer_lua_release_pending);
 
-  rc = pthread_join(sock_th, NULL);
-  if (rc) log_error("Socket thread join failed: %s", strerror(rc));
-
-  if (lua_env) lua_environment_destroy(lua_env);
+  if (lua_pool) lua_vm_pool_destroy(lua_pool);
+  socket_handler_destroy(sh);
+  client_pool_destroy(cpool);
+  http_client_cleanup();
   log_info("Resource cleanup complete");
+  log_shutdown();
 }
 
 int main() {
   signal(SIGINT, handle_sigint);
+  signal(SIGPIPE, SIG_IGN);
   set_log_level(LOG_LEVEL_INFO);
+  log_init();
+  scan_init();
+  metrics_init();
+  if (!http_client_init()) return EXIT_FAILURE;
+  if (!http_engine_start()) log_warn("HTTP engine unavailable, request() will block");
 
   Tickrate tr;
   if (!tickrate_init( & tr, 128.0)) return EXIT_FAILURE;
+  if (EXECUTOR_ENABLED &&
+    task_manager_start_executor( & tr.task_manager, EXECUTOR_AUTO_WORKERS) != 0)
+    log_warn("Task executor unavailable, tasks will run on the tick thread");
 
-  LuaEnvironment * lua_env = lua_environment_create( & tr);
-  if (!lua_env) return EXIT_FAILURE;
-
-  lua_register_core_functions(lua_env);
-  if (load_commands("commands", lua_env -> L) != 0) {
+  LuaVMPool * lua_pool = lua_vm_pool_create( & tr, THREAD_POOL_SIZE,
+    "commands");
+  if (!lua_pool) {
     log_error("Failed to load command scripts");
     return EXIT_FAILURE;
   }
 
+  if (!script_watcher_start(lua_pool))
+    log_warn("Script hot reload unavailable, reload_scripts() still works");
+
   ClientPool cpool;
   client_pool_init( & cpool);
 
@@ -61,7 +140,29 @@ int main() {
   thread_pool_init( & tpool);
 
   SocketHandler sock_handler;
-  socket_handler_init( & sock_handler, & tr, & cpool, & tpool, lua_env);
+  socket_handler_init( & sock_handler, & tr, & cpool, & tpool, lua_pool);
+
+  metrics_register_gauge("task_backlog", "Serial tasks waiting for the tick thread",
+    gauge_task_backlog, & tr);
+  metrics_register_gauge("timers_pending", "Timers scheduled on the wheel",
+    gauge_timers_pending, & tr);
+  metrics_register_gauge("executor_queue_depth", "Parallel tasks waiting for a worker",
+    gauge_executor_queue, & tr);
+  metrics_register_gauge("thread_pool_queue_depth", "Jobs waiting for a pool thread",
+    gauge_thread_pool_queue, & tpool);
+  metrics_register_gauge("thread_pool_queue_wait_p99_ms", "Queue wait before a pool thread ran a job, p99",
+    gauge_thread_pool_wait_p99, & tpool);
+  metrics_register_gauge("thread_pool_predicted_wait_ms", "Expected wait for a job queued now",
+    gauge_thread_pool_predicted_wait, & tpool);
+  metrics_register_gauge("output_buffered_bytes", "Response bytes queued for slow clients",
+    gauge_output_buffered, NULL);
+  metrics_register_gauge("receive_buffer_bytes", "Receive buffers attached or cached",
+    gauge_receive_buffers, & cpool);
+  metrics_register_gauge("script_generation", "Command script generation new requests run on",
+    gauge_script_generation, lua_pool);
+  metrics_register_gauge("log_records_dropped", "Log records dropped on full rings",
+    gauge_log_dropped, NULL);
+  if (!metrics_server_start(METRICS_PORT)) log_warn("Metrics endpoint unavailable");
 
   pthread_t tick_th, sock_th;
   if (pthread_create( & tick_th, NULL, tickrate_thread, & tr)) {
@@ -78,6 +179,7 @@ int main() {
 
   while (!shutdown_requested) sleep(1);
 
-  graceful_shutdown( & tr, lua_env, & tpool, tick_th, sock_th);
+  graceful_shutdown( & tr, lua_pool, & tpool, & sock_handler, & cpool, tick_th,
+    sock_th);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,252 @@
+#include "batch.h"
+#include "commands.h"
+#include "../json/json.h"
+#include "../json/msgpack.h"
+#include "../logging/logging.h"
+#include "../socket/framing.h"
+#include "../socket/socket.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BATCH_RESULT_OVERHEAD 64
+
+typedef struct {
+  char *data;
+  size_t length;
+} BatchResult;
+
+struct CommandBatch {
+  ClientData *client;
+  PayloadEncoding encoding;
+  const JsonValue *commands;
+  size_t count;
+  atomic_size_t next;
+  /* One per unfinished command, per enlisted worker, and the dispatch */
+  atomic_size_t refs;
+  pthread_mutex_t lock;
+  pthread_cond_t all_started;
+  size_t started;
+  BatchResult *results;
+  char request_id[];
+};
+
+static bool append_result_header(CommandBatch *batch, JsonBuffer *buf) {
+  if (batch->encoding == PAYLOAD_MSGPACK)
+    return msgpack_write_map(buf, 3) && msgpack_write_string(buf, "id", 2) &&
+           msgpack_write_string(buf, batch->request_id,
+                                strlen(batch->request_id)) &&
+           msgpack_write_string(buf, "type", 4) &&
+           msgpack_write_string(buf, "batch_result", 12) &&
+           msgpack_write_string(buf, "data", 4) &&
+           msgpack_write_array(buf, batch->count);
+
+  return json_buffer_append(buf, "{\"id\":", 6) &&
+         json_buffer_append_string(buf, batch->request_id,
+                                   strlen(batch->request_id)) &&
+         json_buffer_append(buf, ",\"type\":\"batch_result\",\"data\":[", 31);
+}
+
+static bool append_results(CommandBatch *batch, JsonBuffer *buf) {
+  bool msgpack = batch->encoding == PAYLOAD_MSGPACK;
+  for (size_t i = 0; i < batch->count; i++) {
+    const BatchResult *result = &batch->results[i];
+    if (!msgpack && i > 0 && !json_buffer_append(buf, ",", 1))
+      return false;
+    if (result->data) {
+      if (!json_buffer_append(buf, result->data, result->length))
+        return false;
+    } else if (msgpack ? !msgpack_write_nil(buf)
+                       : !json_buffer_append(buf, "null", 4)) {
+      return false;
+    }
+  }
+  return msgpack || json_buffer_append(buf, "]}", 2);
+}
+
+static void finish_batch(CommandBatch *batch) {
+  ClientData *client = batch->client;
+  size_t capacity = BATCH_RESULT_OVERHEAD + strlen(batch->request_id);
+  for (size_t i = 0; i < batch->count; i++)
+    capacity += batch->results[i].length + 1;
+
+  if (!atomic_load(&client->closed)) {
+    JsonBuffer buf;
+    json_buffer_init(&buf, capacity);
+    if (append_result_header(batch, &buf) && append_results(batch, &buf)) {
+      client_send_payload(client, buf.data, buf.length);
+    } else {
+      log_error("Failed to encode batch results for client %d",
+                client->socket);
+      command_send_error(client, batch->request_id,
+                         "Failed to encode batch results");
+    }
+    free(buf.data);
+  }
+
+  for (size_t i = 0; i < batch->count; i++)
+    free(batch->results[i].data);
+  free(batch->results);
+  pthread_mutex_destroy(&batch->lock);
+  pthread_cond_destroy(&batch->all_started);
+  client_request_finished(client);
+  client_unref(client);
+  free(batch);
+}
+
+static void batch_release(CommandBatch *batch) {
+  if (atomic_fetch_sub(&batch->refs, 1) == 1)
+    finish_batch(batch);
+}
+
+static void store_result(CommandBatch *batch, size_t index, JsonBuffer *buf,
+                         bool encoded) {
+  if (encoded) {
+    batch->results[index] = (BatchResult){buf->data, buf->length};
+  } else {
+    log_error("Failed to store batch result %zu for client %d", index,
+              batch->client->socket);
+    free(buf->data);
+  }
+  batch_release(batch);
+}
+
+void batch_store_payload(CommandBatch *batch, size_t index,
+                         const char *payload, size_t length) {
+  JsonBuffer buf = {0};
+  bool encoded;
+  if (payload)
+    encoded = json_buffer_append(&buf, payload, length);
+  else if (batch->encoding == PAYLOAD_MSGPACK)
+    encoded = msgpack_write_nil(&buf);
+  else
+    encoded = json_buffer_append(&buf, "null", 4);
+  store_result(batch, index, &buf, encoded);
+}
+
+void batch_store_message(CommandBatch *batch, size_t index, const char *json,
+                         size_t length) {
+  JsonBuffer buf = {0};
+  bool encoded = framing_append_message(batch->encoding, json, length, &buf);
+  store_result(batch, index, &buf, encoded);
+}
+
+void batch_store_error(CommandBatch *batch, size_t index,
+                       const char *request_id, const char *message) {
+  JsonBuffer text = {0};
+  bool built =
+      json_buffer_append(&text, "{\"id\":", 6) &&
+      json_buffer_append_string(&text, request_id, strlen(request_id)) &&
+      json_buffer_append(&text, ",\"type\":\"error\",\"data\":{\"message\":",
+                         34) &&
+      json_buffer_append_string(&text, message, strlen(message)) &&
+      json_buffer_append(&text, "}}", 2);
+
+  JsonBuffer buf = {0};
+  bool encoded =
+      built && framing_append_message(batch->encoding, text.data, text.length,
+                                      &buf);
+  free(text.data);
+  store_result(batch, index, &buf, encoded);
+}
+
+static void start_item(CommandBatch *batch, LuaEnvironment *env,
+                       size_t index) {
+  const JsonValue *item = &batch->commands->u.array.items[index];
+  const char *request_id = json_string_value(json_object_get(item, "id"));
+  const char *name = json_string_value(json_object_get(item, "name"));
+  if (!request_id)
+    request_id = batch->request_id;
+  if (!name) {
+    batch_store_error(batch, index, request_id, "Missing 'name'");
+    return;
+  }
+  execute_batch_command(name, json_object_get(item, "args"), batch->client,
+                        env, request_id, batch, index);
+}
+
+/* Claims commands until none are left, holding one VM for the whole run. */
+static void run_items(CommandBatch *batch) {
+  LuaVMPool *lua_pool = batch->client->sh->lua_pool;
+  LuaEnvironment *env = NULL;
+  size_t index;
+  while ((index = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+    if (!env)
+      env = lua_vm_acquire(lua_pool);
+    start_item(batch, env, index);
+
+    pthread_mutex_lock(&batch->lock);
+    if (++batch->started == batch->count)
+      pthread_cond_signal(&batch->all_started);
+    pthread_mutex_unlock(&batch->lock);
+  }
+  if (env)
+    lua_vm_release(lua_pool, env);
+}
+
+static void run_shard(void *arg) {
+  CommandBatch *batch = (CommandBatch *)arg;
+  run_items(batch);
+  batch_release(batch);
+}
+
+bool batch_execute(ClientData *client, const JsonValue *root,
+                   const char *request_id) {
+  const JsonValue *commands =
+      json_object_get(json_object_get(root, "data"), "commands");
+  if (!commands || commands->type != JSON_ARRAY) {
+    command_send_error(client, request_id, "Missing 'commands' array");
+    return false;
+  }
+  size_t count = commands->u.array.count;
+  if (count > BATCH_MAX_COMMANDS) {
+    command_send_error(client, request_id, "Too many commands in batch");
+    return false;
+  }
+
+  size_t id_length = strlen(request_id);
+  CommandBatch *batch = malloc(sizeof(CommandBatch) + id_length + 1);
+  BatchResult *results = calloc(count ? count : 1, sizeof(BatchResult));
+  if (!batch || !results) {
+    log_error("Failed to allocate batch of %zu commands", count);
+    free(batch);
+    free(results);
+    command_send_error(client, request_id, "Failed to allocate batch");
+    return false;
+  }
+  batch->client = client;
+  batch->encoding = (PayloadEncoding)atomic_load_explicit(
+      &client->encoding, memory_order_acquire);
+  batch->commands = commands;
+  batch->count = count;
+  atomic_init(&batch->next, 0);
+  atomic_init(&batch->refs, count + 1);
+  pthread_mutex_init(&batch->lock, NULL);
+  pthread_cond_init(&batch->all_started, NULL);
+  batch->started = 0;
+  batch->results = results;
+  memcpy(batch->request_id, request_id, id_length + 1);
+  client_ref(client);
+
+  size_t helpers = count > 0 ? (count - 1) / BATCH_SHARD_SIZE : 0;
+  if (helpers > THREAD_POOL_SIZE - 1)
+    helpers = THREAD_POOL_SIZE - 1;
+  for (size_t i = 0; i < helpers; i++) {
+    atomic_fetch_add(&batch->refs, 1);
+    if (!thread_pool_submit(client->sh->thread_pool, run_shard, batch)) {
+      atomic_fetch_sub(&batch->refs, 1);
+      break;
+    }
+  }
+  run_items(batch);
+
+  /* The commands point into the caller's document, which must outlive the
+   * last start; their replies no longer need it. */
+  pthread_mutex_lock(&batch->lock);
+  while (batch->started < batch->count)
+    pthread_cond_wait(&batch->all_started, &batch->lock);
+  pthread_mutex_unlock(&batch->lock);
+  batch->commands = NULL;
+
+  batch_release(batch);
+  return true;
+}
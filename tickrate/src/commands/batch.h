@@ -0,0 +1,41 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "../json/json_dom.h"
+#include "../socket/socket_pool.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define BATCH_MAX_COMMANDS 1024
+#define BATCH_SHARD_SIZE 16
+
+typedef struct CommandBatch CommandBatch;
+
+/*
+ * A batch message carries an array of commands,
+ *   {"type":"batch","id":..,"data":{"commands":[{"id":..,"name":..,
+ *    "args":{..}},..]}}
+ * decoded once and started from a single dispatch. Batches longer than one
+ * shard enlist idle workers, each running its share on its own VM. Once every
+ * command has finished, including those waiting on asynchronous calls, one
+ * batch_result frame carries their replies in the order they were sent; a
+ * failed command leaves its error in its own slot. A command without an id
+ * is given the batch's.
+ *
+ * Returns true when the batch took over reporting the request finished.
+ */
+bool batch_execute(ClientData *client, const JsonValue *root,
+                   const char *request_id);
+
+/*
+ * Each command's reply is stored exactly once, as a payload already in the
+ * client's encoding (NULL for no result), as JSON text, or as an error.
+ */
+void batch_store_payload(CommandBatch *batch, size_t index,
+                         const char *payload, size_t length);
+void batch_store_message(CommandBatch *batch, size_t index, const char *json,
+                         size_t length);
+void batch_store_error(CommandBatch *batch, size_t index,
+                       const char *request_id, const char *message);
+
+#endif
@@ -3,6 +3,10 @@
 
 #include "../tickrate/tickrate.h"
 #include "../task/task_manager.h"
+#include "../json/json_dom.h"
+#include "batch.h"
+#include "../socket/socket_pool.h"
+#include "../../util/lua/lua_init.h"
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -10,14 +14,24 @@
 
 #define BUFFER_SIZE 16384
 
-int load_commands(const char *directory, lua_State *L);
+void command_send_error(ClientData *client, const char *request_id,
+                        const char *message);
 const char* execute_dynamic_task(const char *task_name, Tickrate *tickrate);
-void execute_command(const char *command,
-                    char *cleaned,
-                    const char *args_json,
-                    int socket,
-                    lua_State *L,
-                    Tickrate *tickrate,
+/* Returns true when the command was started; its task then reports the
+ * request finished to the connection once it completes. */
+bool execute_command(const char *command,
+                    const JsonValue *args,
+                    ClientData *client,
+                    LuaEnvironment *env,
                     const char *request_id);
+/* Runs one command of a batch; its reply, success or not, lands in the
+ * batch's slot for index. */
+void execute_batch_command(const char *command,
+                           const JsonValue *args,
+                           ClientData *client,
+                           LuaEnvironment *env,
+                           const char *request_id,
+                           CommandBatch *batch,
+                           size_t index);
 
 #endif
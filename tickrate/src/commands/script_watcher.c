@@ -0,0 +1,110 @@
+#include "script_watcher.h"
+#include "../logging/logging.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#define SCRIPT_WATCH_EVENTS                                                    \
+  (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE |                  \
+   IN_DELETE_SELF | IN_MOVE_SELF)
+
+static struct {
+  int fd;
+  pthread_t thread;
+  atomic_bool running;
+  bool started;
+  LuaVMPool *pool;
+} watcher = {.fd = -1};
+
+static bool is_script(const char *name) {
+  const char *dot = strrchr(name, '.');
+  return dot && strcmp(dot, ".lua") == 0;
+}
+
+/* Returns true when any queued event may have changed a script. */
+static bool drain_events(void) {
+  _Alignas(struct inotify_event) char buffer[4096];
+  bool changed = false;
+  for (;;) {
+    ssize_t length = read(watcher.fd, buffer, sizeof(buffer));
+    if (length <= 0) {
+      if (length < 0 && errno != EAGAIN && errno != EINTR)
+        log_warn("Script watcher read failed: %s", strerror(errno));
+      return changed;
+    }
+    for (char *p = buffer; p < buffer + length;) {
+      const struct inotify_event *event = (const struct inotify_event *)p;
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+        log_warn("Commands directory %s went away; scripts stay as loaded",
+                 watcher.pool->commands_dir);
+      else if (event->mask & IN_Q_OVERFLOW)
+        changed = true;
+      else if (event->len > 0 && is_script(event->name))
+        changed = true;
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+static void *script_watcher_thread(void *arg) {
+  (void)arg;
+  struct pollfd events = {.fd = watcher.fd, .events = POLLIN};
+  bool pending = false;
+  while (atomic_load(&watcher.running)) {
+    int ready = poll(&events, 1,
+                     pending ? SCRIPT_RELOAD_SETTLE_MS : SCRIPT_WATCH_POLL_MS);
+    if (ready < 0 && errno != EINTR) {
+      log_error("Script watcher poll failed: %s", strerror(errno));
+      break;
+    }
+    if (ready > 0) {
+      pending = drain_events() || pending;
+    } else if (ready == 0 && pending) {
+      pending = false;
+      lua_vm_pool_reload(watcher.pool);
+    }
+  }
+  return NULL;
+}
+
+bool script_watcher_start(LuaVMPool *pool) {
+  watcher.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watcher.fd < 0) {
+    log_error("Script watcher inotify init failed: %s", strerror(errno));
+    return false;
+  }
+  if (inotify_add_watch(watcher.fd, pool->commands_dir, SCRIPT_WATCH_EVENTS) <
+      0) {
+    log_error("Failed to watch %s: %s", pool->commands_dir, strerror(errno));
+    close(watcher.fd);
+    watcher.fd = -1;
+    return false;
+  }
+
+  watcher.pool = pool;
+  atomic_store(&watcher.running, true);
+  if (pthread_create(&watcher.thread, NULL, script_watcher_thread, NULL) !=
+      0) {
+    log_error("Script watcher thread creation failed");
+    close(watcher.fd);
+    watcher.fd = -1;
+    return false;
+  }
+  watcher.started = true;
+  log_info("Watching %s for script changes", pool->commands_dir);
+  return true;
+}
+
+void script_watcher_stop(void) {
+  if (!watcher.started)
+    return;
+  atomic_store(&watcher.running, false);
+  pthread_join(watcher.thread, NULL);
+  close(watcher.fd);
+  watcher.fd = -1;
+  watcher.started = false;
+}
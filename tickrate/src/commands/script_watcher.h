@@ -0,0 +1,20 @@
+#ifndef SCRIPT_WATCHER_H
+#define SCRIPT_WATCHER_H
+
+#include "../../util/lua/lua_init.h"
+#include <stdbool.h>
+
+#define SCRIPT_WATCH_POLL_MS 500
+/* Editors save in several steps; wait for the directory to go quiet */
+#define SCRIPT_RELOAD_SETTLE_MS 150
+
+/*
+ * Watches the pool's commands directory with inotify from its own thread and
+ * reloads the scripts once a burst of changes to .lua files settles.
+ * Compiling happens on the watcher thread; request threads only install the
+ * finished generation.
+ */
+bool script_watcher_start(LuaVMPool *pool);
+void script_watcher_stop(void);
+
+#endif
@@ -0,0 +1,275 @@
+#include "scripts.h"
+#include "../json/json.h"
+#include "../logging/logging.h"
+#include <dirent.h>
+#include <lauxlib.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static const char *priority_scripts[] = {"add_task"};
+
+#define PRIORITY_COUNT (sizeof(priority_scripts) / sizeof(priority_scripts[0]))
+
+typedef struct {
+  CompiledScript *items;
+  size_t count;
+  size_t capacity;
+} ScriptList;
+
+static bool is_priority(const char *name) {
+  for (size_t i = 0; i < PRIORITY_COUNT; i++) {
+    if (strcmp(name, priority_scripts[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+static const CompiledScript *find_script(const ScriptGeneration *generation,
+                                         const char *name) {
+  if (!generation)
+    return NULL;
+  for (size_t i = 0; i < generation->count; i++) {
+    if (strcmp(generation->scripts[i].name, name) == 0)
+      return &generation->scripts[i];
+  }
+  return NULL;
+}
+
+static bool push_script(ScriptList *list, const char *name, char *bytecode,
+                        size_t length) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 8;
+    CompiledScript *items =
+        realloc(list->items, capacity * sizeof(CompiledScript));
+    if (!items)
+      return false;
+    list->items = items;
+    list->capacity = capacity;
+  }
+  CompiledScript *script = &list->items[list->count++];
+  snprintf(script->name, sizeof(script->name), "%s", name);
+  script->bytecode = bytecode;
+  script->length = length;
+  return true;
+}
+
+static int write_chunk(lua_State *L, const void *data, size_t size,
+                       void *ud) {
+  (void)L;
+  return json_buffer_append((JsonBuffer *)ud, data, size) ? 0 : 1;
+}
+
+/* Returns false only when out of memory; a script that does not compile is
+ * left out, or carried over from previous. */
+static bool compile_script(lua_State *scratch, const char *path,
+                           const char *name, const ScriptGeneration *previous,
+                           ScriptList *list) {
+  JsonBuffer buf = {0};
+  if (luaL_loadfile(scratch, path) == LUA_OK) {
+    bool dumped = lua_dump(scratch, write_chunk, &buf, 0) == 0;
+    lua_pop(scratch, 1);
+    if (dumped && push_script(list, name, buf.data, buf.length))
+      return true;
+    free(buf.data);
+    if (dumped)
+      return false;
+    log_error("Failed to dump script %s", path);
+  } else {
+    log_error("Failed to compile script %s: %s", path,
+              lua_tostring(scratch, -1));
+    lua_pop(scratch, 1);
+  }
+
+  const CompiledScript *kept = find_script(previous, name);
+  if (!kept)
+    return true;
+  log_warn("Keeping %s from script generation %llu", name,
+           (unsigned long long)previous->id);
+  char *copy = malloc(kept->length);
+  if (!copy)
+    return false;
+  memcpy(copy, kept->bytecode, kept->length);
+  if (!push_script(list, name, copy, kept->length)) {
+    free(copy);
+    return false;
+  }
+  return true;
+}
+
+static bool compile_directory(lua_State *scratch, const char *directory,
+                              DIR *dp, const ScriptGeneration *previous,
+                              ScriptList *list) {
+  for (size_t i = 0; i < PRIORITY_COUNT; i++) {
+    char fullpath[PATH_MAX];
+    struct stat path_stat;
+    int written = snprintf(fullpath, sizeof(fullpath), "%s/%s.lua", directory,
+                           priority_scripts[i]);
+    if (written < 0 || (size_t)written >= sizeof(fullpath)) {
+      log_warn("Priority script path truncated: %s", priority_scripts[i]);
+      continue;
+    }
+    if (stat(fullpath, &path_stat) != 0) {
+      log_warn("Priority script not found: %s", fullpath);
+      continue;
+    }
+    if (!compile_script(scratch, fullpath, priority_scripts[i], previous,
+                        list))
+      return false;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dp)) != NULL) {
+    const char *dot = strrchr(entry->d_name, '.');
+    if (!dot || strcmp(dot, ".lua") != 0)
+      continue;
+
+    size_t name_len = dot - entry->d_name;
+    char command_name[SCRIPT_NAME_MAX];
+    if (name_len >= sizeof(command_name)) {
+      log_warn("Command name too long in %s", entry->d_name);
+      continue;
+    }
+    memcpy(command_name, entry->d_name, name_len);
+    command_name[name_len] = '\0';
+    if (is_priority(command_name))
+      continue;
+
+    char fullpath[PATH_MAX * 2];
+    int written = snprintf(fullpath, sizeof(fullpath), "%s/%s", directory,
+                           entry->d_name);
+    if (written < 0 || (size_t)written >= sizeof(fullpath)) {
+      log_warn("Path truncated for: %s/%s", directory, entry->d_name);
+      continue;
+    }
+
+    struct stat path_stat;
+    if (stat(fullpath, &path_stat) != 0 || !S_ISREG(path_stat.st_mode))
+      continue;
+
+    log_debug("Compiling command script: %s", fullpath);
+    if (!compile_script(scratch, fullpath, command_name, previous, list))
+      return false;
+  }
+  return true;
+}
+
+ScriptGeneration *script_generation_load(const char *directory,
+                                         const ScriptGeneration *previous) {
+  char resolved_path[PATH_MAX];
+  if (realpath(directory, resolved_path) == NULL) {
+    log_error("Invalid command directory: %s", directory);
+    return NULL;
+  }
+  DIR *dp = opendir(resolved_path);
+  if (!dp) {
+    log_error("Failed to open command directory: %s", resolved_path);
+    return NULL;
+  }
+  lua_State *scratch = luaL_newstate();
+  if (!scratch) {
+    log_error("Failed to create Lua state for compiling scripts");
+    closedir(dp);
+    return NULL;
+  }
+
+  ScriptList list = {0};
+  bool compiled =
+      compile_directory(scratch, resolved_path, dp, previous, &list);
+  closedir(dp);
+  lua_close(scratch);
+
+  ScriptGeneration *generation =
+      compiled ? malloc(sizeof(ScriptGeneration) +
+                        list.count * sizeof(CompiledScript))
+               : NULL;
+  if (!generation) {
+    log_error("Failed to allocate script generation");
+    for (size_t i = 0; i < list.count; i++)
+      free(list.items[i].bytecode);
+    free(list.items);
+    return NULL;
+  }
+  generation->id = previous ? previous->id + 1 : 1;
+  atomic_init(&generation->refs, 1);
+  generation->count = list.count;
+  if (list.count > 0)
+    memcpy(generation->scripts, list.items,
+           list.count * sizeof(CompiledScript));
+  free(list.items);
+  return generation;
+}
+
+bool script_generation_same(const ScriptGeneration *a,
+                            const ScriptGeneration *b) {
+  if (a->count != b->count)
+    return false;
+  for (size_t i = 0; i < a->count; i++) {
+    const CompiledScript *x = &a->scripts[i];
+    const CompiledScript *y = &b->scripts[i];
+    if (strcmp(x->name, y->name) != 0 || x->length != y->length ||
+        memcmp(x->bytecode, y->bytecode, x->length) != 0)
+      return false;
+  }
+  return true;
+}
+
+static int lua_unregistered_command(lua_State *L) {
+  return luaL_error(L, "%s not properly registered!",
+                    lua_tostring(L, lua_upvalueindex(1)));
+}
+
+void script_generation_install(const ScriptGeneration *generation,
+                               const ScriptGeneration *previous,
+                               lua_State *L) {
+  for (size_t i = 0; i < generation->count; i++) {
+    const CompiledScript *script = &generation->scripts[i];
+    if (luaL_loadbufferx(L, script->bytecode, script->length, script->name,
+                         "b") != LUA_OK ||
+        lua_pcall(L, 0, 0, 0) != LUA_OK) {
+      log_error("Failed to load script %s: %s", script->name,
+                lua_tostring(L, -1));
+      lua_pop(L, 1);
+      continue;
+    }
+
+    lua_getglobal(L, script->name);
+    if (lua_isfunction(L, -1)) {
+      log_debug("Successfully loaded script: %s", script->name);
+    } else if (is_priority(script->name)) {
+      log_error("Critical: %s not registered by its script!", script->name);
+      lua_pushstring(L, script->name);
+      lua_pushcclosure(L, lua_unregistered_command, 1);
+      lua_setglobal(L, script->name);
+    } else {
+      log_warn("Script %s.lua didn't register function %s", script->name,
+               script->name);
+    }
+    lua_pop(L, 1);
+  }
+
+  if (!previous)
+    return;
+  for (size_t i = 0; i < previous->count; i++) {
+    const char *name = previous->scripts[i].name;
+    if (!find_script(generation, name)) {
+      lua_pushnil(L);
+      lua_setglobal(L, name);
+      log_debug("Removed command %s", name);
+    }
+  }
+}
+
+void script_generation_ref(ScriptGeneration *generation) {
+  atomic_fetch_add(&generation->refs, 1);
+}
+
+void script_generation_unref(ScriptGeneration *generation) {
+  if (!generation || atomic_fetch_sub(&generation->refs, 1) != 1)
+    return;
+  for (size_t i = 0; i < generation->count; i++)
+    free(generation->scripts[i].bytecode);
+  free(generation);
+}
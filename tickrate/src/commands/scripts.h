@@ -0,0 +1,52 @@
+#ifndef SCRIPTS_H
+#define SCRIPTS_H
+
+#include <lua.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCRIPT_NAME_MAX 256
+
+typedef struct {
+  char name[SCRIPT_NAME_MAX];
+  char *bytecode;
+  size_t length;
+} CompiledScript;
+
+/*
+ * One compiled snapshot of the commands directory. Generations are
+ * immutable once built and shared by reference: the VM pool holds the
+ * current one, each VM the one it last installed. Installing runs every
+ * script's top level, redefining the command globals; coroutines already
+ * running keep the functions they started with, so in-flight commands
+ * finish on the generation they began on.
+ */
+typedef struct ScriptGeneration {
+  uint64_t id;
+  atomic_size_t refs;
+  size_t count;
+  CompiledScript scripts[];
+} ScriptGeneration;
+
+/*
+ * Compiles every .lua file in directory, add_task.lua first. A script that
+ * fails to compile keeps its version from previous, if it had one. Returns
+ * NULL when the directory cannot be read.
+ */
+ScriptGeneration* script_generation_load(const char *directory,
+                                         const ScriptGeneration *previous);
+/* True when both hold the same scripts with the same bytecode. */
+bool script_generation_same(const ScriptGeneration *a,
+                            const ScriptGeneration *b);
+/*
+ * Runs generation's scripts in L and clears the globals of commands that
+ * previous had and generation dropped. previous may be NULL.
+ */
+void script_generation_install(const ScriptGeneration *generation,
+                               const ScriptGeneration *previous, lua_State *L);
+void script_generation_ref(ScriptGeneration *generation);
+void script_generation_unref(ScriptGeneration *generation);
+
+#endif
@@ -0,0 +1,301 @@
+#include "compression.h"
+#include "../logging/logging.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define DEFLATE_BUFFER_RETAIN (1024 * 1024)
+#define INFLATE_INITIAL_BUFFER 4096
+
+/*
+ * Trained with zstd --train (--maxdict=8192) on 3420 sample frames: add_task
+ * requests whose bodies use the add_task environment (request, json_encode,
+ * json_decode, schedule_task, cancel_task, pcall), batches, and the
+ * task_result, error and heartbeat replies the server sends. Only the
+ * content section is kept, trimmed at the front to whole rows. zstd puts the
+ * most useful strings last, where zlib finds matches cheapest. Both ends
+ * must use these exact bytes; change them only together with the dictionary
+ * id clients check.
+ *
+ * Each row fills its array exactly, so the rows are one contiguous run of
+ * bytes with no terminators between them.
+ */
+#define DICTIONARY_ROW 64
+static const char dictionary[][DICTIONARY_ROW] = {
+    " = a.room_count }))\\n  end, { id = args.id, player_id = args.reg",
+    "ion_name })\\n  retur \\\"http://inventory:9000/v1/orders?status=op",
+    "en&limit=157\\\")\\n  if not response then\\n    return { ok = false",
+    ", error = tostring(err) }\\n  end\\n  local data = json_decode(res",
+    "ponse)\\n  return { ok = true, user_name = data.status_count, cou",
+    "nt = #(data.items or {}) }\\nend\\n\",\"custom_args\":{\"id\":\"653274\",",
+    "\"balance_list\":[306,172,966,92,845],\"match_name\":1413,\"user_list",
+    "\":false,\"inventory_name\":false,\"score_list\":false}}}}}{\"id\":\"c-9",
+    "4021\",\"type\":\"command\",\"data\":{\"type\":\"command\",\"data\":{\"name\":\"",
+    "add_task\",\"args\":{\"task_name\":\"session\",\"taskt_count\":\"room87\",\"",
+    "level_id\":false}}}}}{\"id\":\"31299\",\"type\":\"command\",\"data\":{\"type",
+    "\":\"command\",\"data\":{\"name\":\"add_task\",\"args\":{\"task_name\":\"event",
+    "\",\"task_body\":\"function main(args)\\n  return { score_list = args",
+    ".status_count, item_id = 508, ok = true }\\nend\\n\",\"custom_args\":",
+    "{\"id\":\"263170\",\"quest_id\":false,\"token_id\":false,\"room_list\":\"or",
+    "der48\",\"score_id\":30805,\"queue_list\":3952}}}}}{\"id\":\"task-3186\",",
+    "\"type\":\"error\",\"data\":{\"message\":\"No main function defined\"}}{\"i",
+    "d\":\"task-37577\",\"type\":\"task_result\",\"data\":\"{\\\"ok\\\":true,\\\"matc",
+    "h_id\\\"\",\"matchs\":false,\"region_list\":true,\"region_count\":[937,17",
+    "8,403,317,572]}}}}}{\"id\":\"req-49743\",\"type\":\"task_result\",\"data\"",
+    ":\"{\\\"count\\\":2,\\\"fields\\\":{\\\"region\\\":\\\"99\\\",\\\"token_list\\\":\\\"86",
+    "\\\",\\\"tokens\\\":\\\"47\\\"}}\"}{\"id\":\"c-30377\",\"type\":\"error\",\"data\":{\"",
+    "message\":\"Command 'player_id' not found\"}}{\"id\":\"task-29158\",\"ty",
+    "pe\":\"error\",\"data\":{\"message\":\"Compilation error: [string \\\"task",
+    "_matchs\\\"]:30: 'end' expected near <eof>\"}}{\"id\":\"56755\",\"type\":",
+    "\"command\",\"data\":{\"type\":\"command\",\"data\":{\"name\":\"add_task\",\"ar",
+    "gs\":{\"task_name\":\"inventory\",\"t}\\nend\\n\",\"custom_args\":{\"id\":\"97",
+    "8104\",\"order_name\":false,\"guild_count\":\"player26\",\"status_count\"",
+    ":false,\"queue_list\":true}}}}}{\"id\":\"1121\",\"type\":\"error\",\"data\":",
+    "{\"message\":\"Lua error: [string \\\"add_task\\\"]:17: levels failed\"}",
+    "}{\"id\":\"c-71746\",\"type\":\"task_result\",\"data\":\"{\\\"ok\\\":true,\\\"ite",
+    "m_name\\\":4120}\"}{\"id\":\"req-70445\",\"type\":\"task_result\",\"data\":\"{",
+    "\\\"results\\\":[{\\\"id\\\":5839,\\\"status\\\":\\\"open\\\"},{\\\"id\\\":1087,\\\"st",
+    "atus\\\":\\\"open\\\"},{\\\"id\\\":4167,\\\"status\\\":\\\"closed\\\"},{\\\"id\\\":527",
+    "2,\\\"status\\\":\\\"open\\\"}],\\\"count\\\":3}\"}{\"id\":\"88810\",\"typrn { sta",
+    "tus = \\\"error\\\", message = tostring(err) }\\n  end\\n  return json",
+    "_decode(response)\\nend\\n\",\"custom_args\":{\"id\":\"790463\",\"inventor",
+    "y_list\":64004,\"sessions\":[671,97,363,334],\"quest_id\":\"status73\",",
+    "\"guilds\":7714,\"event_list\":48270}}}}}{\"id\":\"req-54677\",\"type\":\"c",
+    "ommand\",\"data\":{\"type\":\"command\",\"data\":{\"name\":\"add_task\",\"args",
+    "\":{\"task_name\":\"score\",\"task_body\":\"function main(args)\\n  local",
+    " results = {}\\n  for _, id in ipairs(args.ids or {}) do\\n    loc",
+    "al response = request(\\\"GET\\\", \\\"https://hooks.internal.local/v1",
+    "/player_id/\\\" .. ession_count\\\":\\\"96\\\",\\\"level_id\\\":\\\"22\\\",\\\"bal",
+    "ances\\\":\\\"82\\\"}}\"}{\"id\":\"64528\",\"type\":\"batch_result\",\"data\":[{\"",
+    "id\":\"req-17182\",\"type\":\"error\",\"data\":{\"message\":\"Execution erro",
+    "r: [string \\\"task_guild_name\\\"]:4: attempt to perform arithmetic",
+    " on a nil value (local 'inventory_count')\"}},{\"id\":\"req-13407\",\"",
+    "type\":\"task_result\",\"data\":\"{\\\"ok\\\":true,\\\"score_count\\\":2544}\"}",
+    ",{\"id\":\"18959\",\"type\":\"task_result\",\"data\":\"[{\\\"index\\\":1,\\\"valu",
+    "e\\\":94},{\\\"index\\\":2,\\\"value\\\":36},{\\\"index\\\":3,\\\"value\\\":27},{\\",
+    "\"index\\\":4,\\\"value\\\":42},{\\\"index\\\":5,\\\"vacelled }\\n  end\\n  ret",
+    "urn { cancelled = false, error = \\\"missing handle\\\" }\\nend\\n\",\"c",
+    "ustom_args\":{\"id\":\"102207\",\"quests\":\"guild70\",\"order_count\":7556",
+    "8,\"score_name\":true,\"queue_name\":[686,616]}}},{\"id\":\"task-54373\"",
+    ",\"name\":\"add_task\",\"args\":{\"task_name\":\"user_list\",\"task_body\":\"",
+    "function main(args)\\n  local handle = schedule_task(256, functio",
+    "n(a)\\n    request(\\\"POST\\\", \\\"https://auth.service.local/v1/orde",
+    "rs?status=open&limit=191\\\", json_encode({ id = a.id, status_list",
+    " = a.session_id }))\\n  end, { id = args.id, event_list = args.sc",
+    "oreults\\\":[{\\\"id\\\":8400,\\\"status\\\":\\\"open\\\"},{\\\"id\\\":2795,\\\"stat",
+    "us\\\":\\\"pending\\\"},{\\\"id\\\":676,\\\"status\\\":\\\"closed\\\"},{\\\"id\\\":420",
+    "3,\\\"status\\\":\\\"open\\\"},{\\\"id\\\":5157,\\\"status\\\":\\\"open\\\"}],\\\"coun",
+    "t\\\":1}\"}{\"id\":\"c-75769\",\"type\":\"error\",\"data\":{\"message\":\"Server",
+    " overloaded\",\"code\":\"overloaded\",\"retry_after_ms\":74}}{\"id\":\"c-4",
+    "0107\",\"type\":\"command\",\"data\":{\"type\":\"command\",\"data\":{\"name\":\"",
+    "add_task\",\"args\":{\"task_name\":\"balances\",\"task_body\":\"function m",
+    "ain(args)\\n  local body = json_encode({ score = args.guild_id, g",
+    "uild_name = args.id })\\n  lolayer_name\",\"task_body\":\"function ma",
+    "in(args)\\n  local ok, err = pcall(function()\\n    local data = j",
+    "son_decode(args.payload)\\n    if not data.region then\\n      err",
+    "or(\\\"missing quests\\\")\\n    end\\n  end)\\n  if not ok then\\n    r",
+    "eturn { ok = false, error = tostring(err) }\\n  end\\n  return { o",
+    "k = true }\\nend\\n\",\"custom_args\":{\"id\":\"599768\"}}}}}{\"type\":\"hea",
+    "rtbeat\",\"id\":\"server-hb\"}{\"id\":\"41846\",\"type\":\"task_result\",\"dat",
+    "a\":\"{\\\"count\\\":4,\\\"fields\\\":{\\\"statuss\\\":\\\"91\\\",\\\"status_name\\\":",
+    "\\\"73\\\",\\\"session\\\":\\\"42\\\"}}\"}{\"id\":\"task-46238\",\"type:\"task-6957",
+    "0\",\"type\":\"task_result\",\"data\":\"{\\\"ok\\\":true,\\\"queue_name\\\":292}",
+    "\"}{\"id\":\"84383\",\"type\":\"task_result\",\"data\":\"[{\\\"index\\\":1,\\\"val",
+    "ue\\\":50}]\"}{\"id\":\"c-82374\",\"type\":\"batch\",\"data\":{\"commands\":[{\"",
+    "id\":\"35710\",\"name\":\"add_task\",\"args\":{\"task_name\":\"room_name\",\"t",
+    "ask_body\":\"function main(args)\\n  local inventory_count = {}\\n  ",
+    "local count = 0\\n  for k, v in pairs(args) do\\n    count = count",
+    " + 1\\n    player_list[k] = tostring(v)\\n  end\\n  print(\\\"process",
+    "ed \\\" .. count .. \\\" fields\\\")\\n  return { count = count, fields",
+    " = balance_id ttps://api.example.com/api/items/48740\\\", body, { ",
+    "\\\"Content-Type: application/json\\\" })\\n  if not response then\\n ",
+    "   return { status = \\\"error\\\", message = tostring(err) }\\n  end",
+    "\\n  return json_decode(response)\\nend\\n\",\"custom_args\":{\"id\":\"29",
+    "2398\"}}},{\"id\":\"req-19330\",\"name\":\"add_task\",\"args\":{\"task_name\"",
+    ":\"level_list\",\"task_body\":\"function main(args)\\n  local result =",
+    " {}\\n  for i, v in ipairs(args.player_id or {}) do\\n    table.in",
+    "sert(result, { index = i, value = v })\\n  end\\n  return result\\n",
+    "end\\n\",\"custom_args\":{\"id\":\"180222\",\"in \\\"https://hooks.internal",
+    ".local/v1/quest_count/\\\" .. tostring(id))\\n    if response then\\",
+    "n      local item = json_decode(response)\\n      table.insert(re",
+    "sults, { id = id, user_count = item.player_list, status = item.s",
+    "tatus })\\n    end\\n  end\\n  return { results = results, count = ",
+    "#results }\\nend\\n\",\"custom_args\":{\"id\":\"124840\",\"queue_count\":[4",
+    "72,105,51,200,740,502],\"balance_name\":1874,\"region_name\":\"order5",
+    "8\",\"order_count\":[230],\"regions\":77610}}}}}{\"id\":\"req-41307\",\"ty",
+    "pe\":\"error\",\"data\":{\"message\":\"Execution error: [string \\\"task_p",
+    "local handle = schedule_task(64, function(a)\\n    request(\\\"POST",
+    "\\\", \\\"http://127.0.0.1:8080/metrics\\\", json_encode({ id = a.id, ",
+    "token_count = a.item_id }))\\n  end, { id = args.id, orders = arg",
+    "s.order_list })\\n  return { scheduled = handle ~= nil, handle = ",
+    "handle }\\nend\\n\",\"custom_args\":{\"id\":\"995019\",\"levels\":\"balance9",
+    "8\",\"quest_id\":\"user66\"}}},{\"id\":\"req-68772\",\"name\":\"add_task\",\"a",
+    "rgs\":{\"task_name\":\"quest_id\",\"task_body\":\"function main(args)\\n ",
+    " if args.handle then\\n    local cancelled = cancel_task(args.han",
+    "dle)\\n    return { cancelname\":\"user_count\",\"task_body\":\"local f",
+    "unction region_id(value)\\n  if type(value) ~= \\\"table\\\" then\\n  ",
+    "  return nil\\n  end\\n  local total = 0\\n  for _, v in pairs(valu",
+    "e) do\\n    if type(v) == \\\"number\\\" then\\n      total = total + ",
+    "v\\n    end\\n  end\\n  return total\\nend\\n\\nfunction main(args)\\n ",
+    " return { total = balance_name(args.values), n = select(\\\"#\\\", a",
+    "rgs) }\\nend\\n\",\"custom_args\":{\"id\":\"540661\",\"balance\":\"guild94\",",
+    "\"guild_name\":\"status91\"}}}]}}{\"id\":\"task-42382\",\"type\":\"task_res",
+    "ult\",\"data\":\"{\\\"scheduled\\\":true,\\\"handle\\\":943840esult\",\"data\":",
+    "\"{\\\"results\\\":[{\\\"id\\\":1020,\\\"status\\\":\\\"open\\\"}],\\\"count\\\":5}\"}",
+    "{\"id\":\"c-27002\",\"type\":\"command\",\"data\":{\"type\":\"command\",\"data\"",
+    ":{\"name\":\"add_task\",\"args\":{\"task_name\":\"players\",\"task_body\":\"f",
+    "unction main(args)\\n  local response, err = request(\\\"GET\\\", \\\"h",
+    "ttp://inventory:9000/lookup?key=level_count\\\")\\n  if not respons",
+    "e then\\n    return { ok = false, error = tostring(err) }\\n  end\\"
+};
+
+static _Thread_local z_stream deflater;
+static _Thread_local bool deflater_ready;
+static _Thread_local z_stream inflater;
+static _Thread_local bool inflater_ready;
+static _Thread_local char *deflate_buffer;
+static _Thread_local size_t deflate_capacity;
+
+bool compression_mode_from_name(const char *name, CompressionMode *mode) {
+  if (!name)
+    return false;
+  if (strcmp(name, "none") == 0)
+    *mode = COMPRESSION_NONE;
+  else if (strcmp(name, "deflate") == 0)
+    *mode = COMPRESSION_DEFLATE;
+  else
+    return false;
+  return true;
+}
+
+const char *compression_mode_name(CompressionMode mode) {
+  return mode == COMPRESSION_DEFLATE ? "deflate" : "none";
+}
+
+uint32_t compression_dictionary_id(void) {
+  return (uint32_t)adler32(adler32(0L, Z_NULL, 0),
+                           (const Bytef *)dictionary, sizeof(dictionary));
+}
+
+static bool reserve_deflate_buffer(size_t needed) {
+  if (deflate_capacity > DEFLATE_BUFFER_RETAIN &&
+      needed <= DEFLATE_BUFFER_RETAIN) {
+    free(deflate_buffer);
+    deflate_buffer = NULL;
+    deflate_capacity = 0;
+  }
+  if (needed <= deflate_capacity)
+    return true;
+  char *buffer = realloc(deflate_buffer, needed);
+  if (!buffer)
+    return false;
+  deflate_buffer = buffer;
+  deflate_capacity = needed;
+  return true;
+}
+
+const char *compression_deflate(const char *data, size_t length,
+                                size_t *out_length) {
+  if (length == 0)
+    return NULL;
+  if (!deflater_ready) {
+    if (deflateInit(&deflater, COMPRESSION_LEVEL) != Z_OK) {
+      log_error("Failed to initialise deflate stream");
+      return NULL;
+    }
+    deflater_ready = true;
+  } else if (deflateReset(&deflater) != Z_OK) {
+    return NULL;
+  }
+  if (deflateSetDictionary(&deflater, (const Bytef *)dictionary,
+                           sizeof(dictionary)) != Z_OK)
+    return NULL;
+
+  /* Output no smaller than the input is not worth the receiver's inflate */
+  if (!reserve_deflate_buffer(length))
+    return NULL;
+  deflater.next_in = (Bytef *)data;
+  deflater.avail_in = (uInt)length;
+  deflater.next_out = (Bytef *)deflate_buffer;
+  deflater.avail_out = (uInt)length;
+  if (deflate(&deflater, Z_FINISH) != Z_STREAM_END)
+    return NULL;
+
+  *out_length = deflater.total_out;
+  return deflate_buffer;
+}
+
+/* Grows an inflate buffer toward limit bytes, keeping a byte for the NUL */
+static char *grow_inflate_buffer(char *buffer, size_t *capacity,
+                                 size_t limit) {
+  size_t grown = *capacity * 2;
+  if (grown > limit)
+    grown = limit;
+  char *resized = realloc(buffer, grown + 1);
+  if (!resized) {
+    free(buffer);
+    return NULL;
+  }
+  inflater.next_out = (Bytef *)resized + inflater.total_out;
+  inflater.avail_out = (uInt)(grown - inflater.total_out);
+  *capacity = grown;
+  return resized;
+}
+
+char *compression_inflate(const char *data, size_t length, size_t expected,
+                          size_t *out_length) {
+  if (!inflater_ready) {
+    if (inflateInit(&inflater) != Z_OK) {
+      log_error("Failed to initialise inflate stream");
+      return NULL;
+    }
+    inflater_ready = true;
+  } else if (inflateReset(&inflater) != Z_OK) {
+    return NULL;
+  }
+
+  /* The declared size is only trusted as a ceiling: the buffer starts at a
+   * few times the compressed size and grows as output actually arrives. One
+   * byte past expected is allowed so a stream that overruns it is caught. */
+  size_t limit = expected + 1;
+  size_t capacity = length < INFLATE_INITIAL_BUFFER / 4
+                        ? INFLATE_INITIAL_BUFFER
+                        : length * 4;
+  if (capacity > limit)
+    capacity = limit;
+  char *out = malloc(capacity + 1);
+  if (!out)
+    return NULL;
+
+  inflater.next_in = (Bytef *)data;
+  inflater.avail_in = (uInt)length;
+  inflater.next_out = (Bytef *)out;
+  inflater.avail_out = (uInt)capacity;
+  int status = Z_OK;
+  while (status == Z_OK) {
+    if (inflater.avail_out == 0) {
+      if (capacity == limit)
+        break;
+      out = grow_inflate_buffer(out, &capacity, limit);
+      if (!out)
+        return NULL;
+    }
+    status = inflate(&inflater, Z_NO_FLUSH);
+    if (status == Z_NEED_DICT) {
+      if (inflater.adler != compression_dictionary_id() ||
+          inflateSetDictionary(&inflater, (const Bytef *)dictionary,
+                               sizeof(dictionary)) != Z_OK)
+        break;
+      status = Z_OK;
+    }
+  }
+
+  if (status != Z_STREAM_END || inflater.total_out != expected ||
+      inflater.avail_in != 0) {
+    free(out);
+    return NULL;
+  }
+  out[expected] = '\0';
+  *out_length = expected;
+  return out;
+}
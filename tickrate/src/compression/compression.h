@@ -0,0 +1,47 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMPRESSION_DEFAULT_THRESHOLD 512
+#define COMPRESSION_LEVEL 3
+#define FRAME_FLAG_RAW 0x00
+#define FRAME_FLAG_DEFLATE 0x01
+
+/*
+ * Compression is negotiated in the hello and only for length-prefixed
+ * framing. Once it is on, every frame payload in both directions starts with
+ * a flag byte: FRAME_FLAG_RAW is followed by the payload itself, and
+ * FRAME_FLAG_DEFLATE by the payload's length as a varint and then a zlib
+ * stream. Each frame is compressed on its own against a preset dictionary of
+ * text common to task bodies and replies, so small frames still compress
+ * without any state carried between them.
+ */
+typedef enum {
+    COMPRESSION_NONE,
+    COMPRESSION_DEFLATE
+} CompressionMode;
+
+bool compression_mode_from_name(const char *name, CompressionMode *mode);
+const char* compression_mode_name(CompressionMode mode);
+
+/* Adler-32 of the dictionary, as zlib stores it in each stream header. */
+uint32_t compression_dictionary_id(void);
+
+/*
+ * Deflates data into a per-thread buffer, valid until the thread's next
+ * call. Returns NULL when compression would not make the frame smaller.
+ */
+const char* compression_deflate(const char *data, size_t length,
+                                size_t *out_length);
+
+/*
+ * Inflates a stream that must expand to exactly expected bytes into a
+ * NUL-terminated buffer the caller frees. Returns NULL on any mismatch.
+ */
+char* compression_inflate(const char *data, size_t length, size_t expected,
+                          size_t *out_length);
+
+#endif
@@ -0,0 +1,183 @@
+#include "http_engine.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "../logging/logging.h"
+
+typedef struct {
+    CURLM *multi;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    HttpTransfer *incoming;
+    HttpTransfer *active;
+    size_t active_count;
+    atomic_bool running;
+} HttpEngine;
+
+static HttpEngine engine = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+HttpTransfer *http_transfer_create(const char *method, const char *url, const char *data,
+                                   struct curl_slist *headers, HttpCompletionFn on_complete,
+                                   void *userdata) {
+    HttpTransfer *transfer = calloc(1, sizeof(HttpTransfer));
+    if (!transfer) {
+        log_error("Failed to allocate HTTP transfer");
+        curl_slist_free_all(headers);
+        return NULL;
+    }
+
+    transfer->headers = headers;
+    transfer->easy = curl_easy_init();
+    if (!transfer->easy) {
+        log_error("Failed to initialize CURL");
+        http_transfer_free(transfer);
+        return NULL;
+    }
+
+    http_configure_request(transfer->easy, method, url, data, headers, &transfer->response);
+    curl_easy_setopt(transfer->easy, CURLOPT_PRIVATE, transfer);
+    curl_easy_setopt(transfer->easy, CURLOPT_PIPEWAIT, 1L);
+    transfer->on_complete = on_complete;
+    transfer->userdata = userdata;
+    return transfer;
+}
+
+void http_transfer_free(HttpTransfer *transfer) {
+    if (!transfer) {
+        return;
+    }
+    if (transfer->easy) {
+        curl_easy_cleanup(transfer->easy);
+    }
+    curl_slist_free_all(transfer->headers);
+    free(transfer->response.data);
+    free(transfer);
+}
+
+bool http_engine_running(void) {
+    return atomic_load(&engine.running);
+}
+
+bool http_engine_submit(HttpTransfer *transfer) {
+    pthread_mutex_lock(&engine.lock);
+    bool accepted = atomic_load(&engine.running);
+    if (accepted) {
+        transfer->next = engine.incoming;
+        engine.incoming = transfer;
+    }
+    pthread_mutex_unlock(&engine.lock);
+
+    if (accepted) {
+        curl_multi_wakeup(engine.multi);
+    }
+    return accepted;
+}
+
+static void complete_transfer(HttpTransfer *transfer, CURLcode result) {
+    curl_multi_remove_handle(engine.multi, transfer->easy);
+    if (transfer->prev) {
+        transfer->prev->next = transfer->next;
+    } else {
+        engine.active = transfer->next;
+    }
+    if (transfer->next) {
+        transfer->next->prev = transfer->prev;
+    }
+    engine.active_count--;
+
+    transfer->prev = transfer->next = NULL;
+    transfer->result = result;
+    curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE, &transfer->status);
+    http_record_metrics(transfer->easy, result);
+    transfer->on_complete(transfer);
+}
+
+static void add_incoming(void) {
+    pthread_mutex_lock(&engine.lock);
+    HttpTransfer *transfer = engine.incoming;
+    engine.incoming = NULL;
+    pthread_mutex_unlock(&engine.lock);
+
+    while (transfer) {
+        HttpTransfer *next = transfer->next;
+        transfer->prev = NULL;
+        transfer->next = engine.active;
+        if (engine.active) {
+            engine.active->prev = transfer;
+        }
+        engine.active = transfer;
+        engine.active_count++;
+
+        CURLMcode rc = curl_multi_add_handle(engine.multi, transfer->easy);
+        if (rc != CURLM_OK) {
+            log_error("Failed to add HTTP transfer: %s", curl_multi_strerror(rc));
+            complete_transfer(transfer, CURLE_FAILED_INIT);
+        }
+        transfer = next;
+    }
+}
+
+static void *http_engine_thread(void *arg) {
+    (void)arg;
+    int still_running = 0;
+
+    while (atomic_load(&engine.running)) {
+        add_incoming();
+        curl_multi_perform(engine.multi, &still_running);
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(engine.multi, &queued)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            HttpTransfer *transfer = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+            complete_transfer(transfer, msg->data.result);
+        }
+
+        curl_multi_poll(engine.multi, NULL, 0, HTTP_ENGINE_POLL_MS, NULL);
+    }
+
+    add_incoming();
+    while (engine.active) {
+        complete_transfer(engine.active, CURLE_ABORTED_BY_CALLBACK);
+    }
+    return NULL;
+}
+
+bool http_engine_start(void) {
+    engine.multi = curl_multi_init();
+    if (!engine.multi) {
+        log_error("Failed to create curl multi handle");
+        return false;
+    }
+    curl_multi_setopt(engine.multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+
+    atomic_store(&engine.running, true);
+    if (pthread_create(&engine.thread, NULL, http_engine_thread, NULL) != 0) {
+        log_error("Failed to start HTTP engine thread");
+        atomic_store(&engine.running, false);
+        curl_multi_cleanup(engine.multi);
+        engine.multi = NULL;
+        return false;
+    }
+    log_info("HTTP engine started");
+    return true;
+}
+
+void http_engine_stop(void) {
+    if (!engine.multi) {
+        return;
+    }
+
+    pthread_mutex_lock(&engine.lock);
+    atomic_store(&engine.running, false);
+    pthread_mutex_unlock(&engine.lock);
+    curl_multi_wakeup(engine.multi);
+    pthread_join(engine.thread, NULL);
+
+    curl_multi_cleanup(engine.multi);
+    engine.multi = NULL;
+    log_info("HTTP engine stopped");
+}
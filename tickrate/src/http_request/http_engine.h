@@ -0,0 +1,35 @@
+#ifndef HTTP_ENGINE_H
+#define HTTP_ENGINE_H
+
+#include "http_request.h"
+#include <stdbool.h>
+
+#define HTTP_ENGINE_POLL_MS 1000
+
+typedef struct HttpTransfer HttpTransfer;
+typedef void (*HttpCompletionFn)(HttpTransfer *transfer);
+
+struct HttpTransfer {
+    CURL *easy;
+    struct curl_slist *headers;
+    HttpBuffer response;
+    CURLcode result;
+    long status;
+    HttpCompletionFn on_complete;
+    void *userdata;
+    struct HttpTransfer *prev;
+    struct HttpTransfer *next;
+};
+
+bool http_engine_start(void);
+void http_engine_stop(void);
+bool http_engine_running(void);
+
+/* Takes ownership of headers. on_complete runs on the engine thread. */
+HttpTransfer *http_transfer_create(const char *method, const char *url, const char *data,
+                                   struct curl_slist *headers, HttpCompletionFn on_complete,
+                                   void *userdata);
+bool http_engine_submit(HttpTransfer *transfer);
+void http_transfer_free(HttpTransfer *transfer);
+
+#endif // HTTP_ENGINE_H
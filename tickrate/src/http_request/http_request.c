@@ -1,51 +1,127 @@
+#include "http_request.h"
 #include <curl/curl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "../logging/logging.h"
+#include "../metrics/metrics.h"
 
-struct memory {
-    char *response;
-    size_t size;
-};
+static CURLSH *share_handle = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+static pthread_key_t handle_key;
 
-static size_t write_callback(void *data, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    struct memory *mem = (struct memory *)userp;
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userp) {
+    (void)handle;
+    (void)access;
+    (void)userp;
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userp) {
+    (void)handle;
+    (void)userp;
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+static void release_thread_handle(void *handle) {
+    curl_easy_cleanup((CURL *)handle);
+}
 
-    char *ptr = realloc(mem->response, mem->size + realsize + 1);
-    if (ptr == NULL) {
-        log_error("Failed to allocate memory for response");
-        return 0;
+bool http_client_init(void) {
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        log_error("Failed to initialize libcurl");
+        return false;
     }
 
-    mem->response = ptr;
-    memcpy(&(mem->response[mem->size]), data, realsize);
-    mem->size += realsize;
-    mem->response[mem->size] = 0;
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&share_locks[i], NULL);
+    }
+    pthread_key_create(&handle_key, release_thread_handle);
 
-    return realsize;
+    share_handle = curl_share_init();
+    if (!share_handle) {
+        log_error("Failed to create shared curl cache");
+        return false;
+    }
+    curl_share_setopt(share_handle, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share_handle, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    log_info("HTTP client initialized (%s)", curl_version());
+    return true;
 }
 
-char *http_request(const char *method, const char *url, const char *data, struct curl_slist *headers) {
-    CURL *curl;
-    CURLcode res;
-    struct memory chunk = {0};
+void http_client_cleanup(void) {
+    CURL *handle = pthread_getspecific(handle_key);
+    if (handle) {
+        pthread_setspecific(handle_key, NULL);
+        curl_easy_cleanup(handle);
+    }
+    if (share_handle) {
+        curl_share_cleanup(share_handle);
+        share_handle = NULL;
+    }
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&share_locks[i]);
+    }
+    curl_global_cleanup();
+}
 
+static CURL *thread_handle(void) {
+    CURL *handle = pthread_getspecific(handle_key);
+    if (handle) {
+        curl_easy_reset(handle);
+        return handle;
+    }
 
-    curl = curl_easy_init();
-    if (!curl) {
-        fprintf(stderr, "Failed to initialize CURL\n");
-        return strdup("Failed to initialize CURL");
+    handle = curl_easy_init();
+    if (handle) {
+        pthread_setspecific(handle_key, handle);
     }
+    return handle;
+}
 
+static size_t write_callback(void *data, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    HttpBuffer *mem = (HttpBuffer *)userp;
+
+    if (mem->size + realsize + 1 > mem->capacity) {
+        size_t capacity = mem->capacity ? mem->capacity : HTTP_RESPONSE_INITIAL;
+        while (capacity < mem->size + realsize + 1) {
+            capacity *= 2;
+        }
+        char *ptr = realloc(mem->data, capacity);
+        if (ptr == NULL) {
+            log_error("Failed to allocate memory for response");
+            return 0;
+        }
+        mem->data = ptr;
+        mem->capacity = capacity;
+    }
 
+    memcpy(&(mem->data[mem->size]), data, realsize);
+    mem->size += realsize;
+    mem->data[mem->size] = 0;
+
+    return realsize;
+}
+
+void http_configure_request(CURL *curl, const char *method, const char *url, const char *data,
+                            struct curl_slist *headers, HttpBuffer *response) {
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)response);
     curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_SHARE, share_handle);
+    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, HTTP_DNS_CACHE_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
 
 
     if (headers) {
@@ -55,22 +131,69 @@ char *http_request(const char *method, const char *url, const char *data, struct
 
     if (data && (strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0 ||
                  strcmp(method, "PATCH") == 0 || strcmp(method, "DELETE") == 0)) {
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
+        curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, data);
+    }
+}
+
+static void url_host(const char *url, char *host, size_t size) {
+    if (!url) {
+        snprintf(host, size, "unknown");
+        return;
+    }
+    const char *start = strstr(url, "://");
+    start = start ? start + 3 : url;
+    size_t authority = strcspn(start, "/?#");
+    const char *at = memchr(start, '@', authority);
+    if (at) {
+        start = at + 1;
+    }
+    size_t length = start[0] == '[' ? strcspn(start, "]") + 1 : strcspn(start, ":/?#");
+    snprintf(host, size, "%.*s", (int)length, start);
+}
+
+/* Transport failures and HTTP 4xx/5xx both count as errors for the host. */
+void http_record_metrics(CURL *curl, CURLcode result) {
+    const char *url = NULL;
+    curl_off_t total_us = 0;
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total_us);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+
+    char host[METRICS_LABEL_LENGTH];
+    url_host(url, host, sizeof(host));
+    metrics_observe(METRIC_FAMILY_HTTP_HOST, host, (uint64_t)total_us * 1000,
+                    result != CURLE_OK || status >= 400);
+}
+
+char *http_request(const char *method, const char *url, const char *data, struct curl_slist *headers) {
+    CURL *curl;
+    CURLcode res;
+    HttpBuffer chunk = {0};
+
+
+    curl = thread_handle();
+    if (!curl) {
+        fprintf(stderr, "Failed to initialize CURL\n");
+        return strdup("Failed to initialize CURL");
     }
 
 
+    http_configure_request(curl, method, url, data, headers, &chunk);
+
+
     res = curl_easy_perform(curl);
+    http_record_metrics(curl, res);
     if (res != CURLE_OK) {
         const char *error_message = curl_easy_strerror(res);
         fprintf(stderr, "curl_easy_perform() failed: %s\n", error_message);
-        free(chunk.response);
-        curl_easy_cleanup(curl);
+        free(chunk.data);
         return strdup(error_message);
     }
 
 
-    curl_easy_cleanup(curl);
-
-
-    return chunk.response;
+    if (!chunk.data) {
+        return strdup("");
+    }
+    return chunk.data;
 }
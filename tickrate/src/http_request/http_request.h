@@ -2,9 +2,24 @@
 #define HTTP_REQUEST_H
 
 #include <curl/curl.h>
+#include <stdbool.h>
+
+#define HTTP_RESPONSE_INITIAL 4096
+#define HTTP_DNS_CACHE_TIMEOUT 300L
 
 struct curl_slist;
 
+typedef struct HttpBuffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+} HttpBuffer;
+
+bool http_client_init(void);
+void http_client_cleanup(void);
+void http_configure_request(CURL *curl, const char *method, const char *url, const char *data,
+                            struct curl_slist *headers, HttpBuffer *response);
+void http_record_metrics(CURL *curl, CURLcode result);
 char *http_request(const char *method, const char *url, const char *data, struct curl_slist *headers);
 
 #endif // HTTP_REQUEST_H
@@ -1,12 +1,14 @@
 #include "json.h"
 #include "../logging/logging.h"
+#include "../simd/scan.h"
 #include <ctype.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static void json_buffer_init(JsonBuffer *buf, size_t initial_size) {
+void json_buffer_init(JsonBuffer *buf, size_t initial_size) {
   buf->data = malloc(initial_size);
   buf->capacity = buf->data ? initial_size : 0;
   buf->length = 0;
@@ -14,7 +16,7 @@ static void json_buffer_init(JsonBuffer *buf, size_t initial_size) {
     buf->data[0] = '\0';
 }
 
-static bool json_buffer_append(JsonBuffer *buf, const char *data, size_t len) {
+bool json_buffer_append(JsonBuffer *buf, const char *data, size_t len) {
   if (buf->length + len + 1 > buf->capacity) {
     size_t new_cap = (buf->capacity * 2) > (buf->length + len + 1)
                          ? (buf->capacity * 2)
@@ -33,6 +35,237 @@ static bool json_buffer_append(JsonBuffer *buf, const char *data, size_t len) {
   return true;
 }
 
+bool json_buffer_append_string(JsonBuffer *buf, const char *str, size_t len) {
+  if (!json_buffer_append(buf, "\"", 1))
+    return false;
+
+  const char *current = str;
+  const char *end = str + len;
+  while (current < end) {
+    const char *next_special = scan_json_special(current, end);
+
+    if (next_special > current &&
+        !json_buffer_append(buf, current, next_special - current))
+      return false;
+    if (next_special == end)
+      break;
+
+    char escape[7] = "\\";
+    size_t escape_len = 2;
+    switch (*next_special) {
+    case '"':
+      escape[1] = '"';
+      break;
+    case '\\':
+      escape[1] = '\\';
+      break;
+    case '\b':
+      escape[1] = 'b';
+      break;
+    case '\f':
+      escape[1] = 'f';
+      break;
+    case '\n':
+      escape[1] = 'n';
+      break;
+    case '\r':
+      escape[1] = 'r';
+      break;
+    case '\t':
+      escape[1] = 't';
+      break;
+    default:
+      snprintf(escape + 1, sizeof(escape) - 1, "u%04x",
+               (unsigned char)*next_special);
+      escape_len = 6;
+      break;
+    }
+    if (!json_buffer_append(buf, escape, escape_len))
+      return false;
+    current = next_special + 1;
+  }
+
+  return json_buffer_append(buf, "\"", 1);
+}
+
+bool json_scan_string(const char **cursor, const char *end, bool *has_escape) {
+  const char *cur = *cursor;
+  *has_escape = false;
+  for (;;) {
+    cur = scan_quote_or_backslash(cur, end);
+    if (cur >= end || *cur == '"')
+      break;
+    *has_escape = true;
+    cur += 2;
+  }
+  *cursor = cur;
+  if (cur >= end) {
+    log_error("Unterminated string");
+    return false;
+  }
+  return true;
+}
+
+static bool parse_hex4(const char *src, const char *end, unsigned *out) {
+  if (end - src < 4)
+    return false;
+  unsigned value = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = src[i];
+    value <<= 4;
+    if (c >= '0' && c <= '9')
+      value |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      value |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      value |= c - 'A' + 10;
+    else
+      return false;
+  }
+  *out = value;
+  return true;
+}
+
+static char *utf8_encode(char *out, unsigned code) {
+  if (code < 0x80) {
+    *out++ = (char)code;
+  } else if (code < 0x800) {
+    *out++ = (char)(0xC0 | (code >> 6));
+    *out++ = (char)(0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    *out++ = (char)(0xE0 | (code >> 12));
+    *out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+    *out++ = (char)(0x80 | (code & 0x3F));
+  } else {
+    *out++ = (char)(0xF0 | (code >> 18));
+    *out++ = (char)(0x80 | ((code >> 12) & 0x3F));
+    *out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+    *out++ = (char)(0x80 | (code & 0x3F));
+  }
+  return out;
+}
+
+bool json_unescape(char *dest, const char *src, size_t length,
+                   size_t *out_length) {
+  const char *src_end = src + length;
+  char *write = dest;
+  while (src < src_end) {
+    const char *next_escape = scan_byte(src, src_end, '\\');
+    memmove(write, src, next_escape - src);
+    write += next_escape - src;
+    src = next_escape;
+    if (src >= src_end)
+      break;
+
+    src++;
+    switch (*src) {
+    case '"':
+      *write++ = '"';
+      break;
+    case '\\':
+      *write++ = '\\';
+      break;
+    case '/':
+      *write++ = '/';
+      break;
+    case 'b':
+      *write++ = '\b';
+      break;
+    case 'f':
+      *write++ = '\f';
+      break;
+    case 'n':
+      *write++ = '\n';
+      break;
+    case 'r':
+      *write++ = '\r';
+      break;
+    case 't':
+      *write++ = '\t';
+      break;
+    case 'u': {
+      unsigned code;
+      if (!parse_hex4(src + 1, src_end, &code)) {
+        log_error("Invalid \\u escape sequence");
+        return false;
+      }
+      src += 4;
+      if (code >= 0xD800 && code <= 0xDBFF) {
+        unsigned low;
+        if (src_end - src > 2 && src[1] == '\\' && src[2] == 'u' &&
+            parse_hex4(src + 3, src_end, &low) && low >= 0xDC00 &&
+            low <= 0xDFFF) {
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          src += 6;
+        } else {
+          code = UNICODE_REPLACEMENT;
+        }
+      } else if (code >= 0xDC00 && code <= 0xDFFF) {
+        code = UNICODE_REPLACEMENT;
+      }
+      write = utf8_encode(write, code);
+      break;
+    }
+    default:
+      log_error("Invalid escape sequence: \\%c", *src);
+      return false;
+    }
+    src++;
+  }
+  *out_length = write - dest;
+  return true;
+}
+
+bool json_parse_number(const char **cursor, const char *end, double *value,
+                       long long *integer, bool *is_integer) {
+  const char *start = *cursor;
+  const char *cur = start;
+  bool integral = true;
+
+  if (cur < end && *cur == '-')
+    cur++;
+  while (cur < end) {
+    char c = *cur;
+    if (c >= '0' && c <= '9') {
+      cur++;
+    } else if (c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+      integral = false;
+      cur++;
+    } else {
+      break;
+    }
+  }
+
+  size_t len = cur - start;
+  if (len == 0 || len >= JSON_NUMBER_MAX_LEN) {
+    log_error("Invalid number literal");
+    return false;
+  }
+
+  char buf[JSON_NUMBER_MAX_LEN];
+  memcpy(buf, start, len);
+  buf[len] = '\0';
+
+  char *endptr;
+  *value = strtod(buf, &endptr);
+  if (endptr != buf + len) {
+    log_error("Invalid number literal: %s", buf);
+    return false;
+  }
+
+  *is_integer = false;
+  if (integral) {
+    errno = 0;
+    long long parsed = strtoll(buf, NULL, 10);
+    if (errno == 0) {
+      *integer = parsed;
+      *is_integer = true;
+    }
+  }
+  *cursor = cur;
+  return true;
+}
+
 JSONPair *create_json_pair(const char *key, const char *value, bool is_nested) {
   if (!key || !value)
     return NULL;
@@ -143,73 +376,7 @@ char *json_encode(JSONObject *obj) {
         return NULL;
       }
     } else {
-      if (!json_buffer_append(&buf, "\"", 1)) {
-        free(buf.data);
-        return NULL;
-      }
-      const char *current = pair->value;
-      while (*current) {
-
-        const char *next_special = current;
-        while (*next_special &&
-               !((unsigned char)*next_special < 0x20 || *next_special == '"' ||
-                 *next_special == '\\')) {
-          next_special++;
-        }
-
-        if (next_special > current) {
-          if (!json_buffer_append(&buf, current, next_special - current)) {
-            free(buf.data);
-            return NULL;
-          }
-        }
-
-        if (*next_special) {
-          char escape[2] = "\\";
-          switch (*next_special) {
-          case '"':
-            escape[1] = '"';
-            break;
-          case '\\':
-            escape[1] = '\\';
-            break;
-          case '\b':
-            escape[1] = 'b';
-            break;
-          case '\f':
-            escape[1] = 'f';
-            break;
-          case '\n':
-            escape[1] = 'n';
-            break;
-          case '\r':
-            escape[1] = 'r';
-            break;
-          case '\t':
-            escape[1] = 't';
-            break;
-          default: {
-            char hex[6];
-            snprintf(hex, 6, "u%04x", (unsigned char)*next_special);
-            if (!json_buffer_append(&buf, "\\", 1) ||
-                !json_buffer_append(&buf, hex, 5)) {
-              free(buf.data);
-              return NULL;
-            }
-            current = next_special + 1;
-            continue;
-          }
-          }
-          if (!json_buffer_append(&buf, escape, 2)) {
-            free(buf.data);
-            return NULL;
-          }
-          current = next_special + 1;
-        } else {
-          current = next_special;
-        }
-      }
-      if (!json_buffer_append(&buf, "\"", 1)) {
+      if (!json_buffer_append_string(&buf, pair->value, strlen(pair->value))) {
         free(buf.data);
         return NULL;
       }
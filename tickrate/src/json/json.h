@@ -21,6 +21,18 @@ typedef struct {
     size_t length;
 } JsonBuffer;
 
+#define JSON_NUMBER_MAX_LEN 64
+#define UNICODE_REPLACEMENT 0xFFFD
+
+void json_buffer_init(JsonBuffer *buf, size_t initial_size);
+bool json_buffer_append(JsonBuffer *buf, const char *data, size_t len);
+bool json_buffer_append_string(JsonBuffer *buf, const char *str, size_t len);
+
+bool json_scan_string(const char **cursor, const char *end, bool *has_escape);
+bool json_unescape(char *dest, const char *src, size_t length, size_t *out_length);
+bool json_parse_number(const char **cursor, const char *end, double *value,
+                       long long *integer, bool *is_integer);
+
 JSONPair* create_json_pair(const char *key, const char *value, bool is_nested);
 void add_json_pair(JSONObject *obj, const char *key, const char *value, bool is_nested);
 char* json_encode(JSONObject *obj);
@@ -0,0 +1,580 @@
+#include "json_dom.h"
+#include "json.h"
+#include "../logging/logging.h"
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK 1024
+
+typedef struct {
+  const char *cur;
+  const char *end;
+  char *in_situ;
+  JsonArenaBlock *blocks;
+  JsonMember *stack;
+  size_t stack_len;
+  size_t stack_cap;
+  int depth;
+} JsonParser;
+
+static bool parse_value(JsonParser *p, JsonValue *out);
+
+static void *arena_alloc(JsonParser *p, size_t size) {
+  JsonArenaBlock *block = p->blocks;
+  if (block) {
+    size_t offset = (block->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (offset + size <= block->capacity) {
+      block->used = offset + size;
+      return block->data + offset;
+    }
+  }
+
+  size_t capacity = block ? block->capacity * 2 : ARENA_MIN_BLOCK;
+  if (capacity < size)
+    capacity = size;
+  JsonArenaBlock *next = malloc(sizeof(JsonArenaBlock) + capacity);
+  if (!next) {
+    log_error("JSON arena allocation failed");
+    return NULL;
+  }
+  next->next = block;
+  next->capacity = capacity;
+  next->used = size;
+  p->blocks = next;
+  return next->data;
+}
+
+static void arena_release(JsonArenaBlock *block) {
+  while (block) {
+    JsonArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+}
+
+static bool stack_push(JsonParser *p, const JsonMember *member) {
+  if (p->stack_len == p->stack_cap) {
+    size_t new_cap = p->stack_cap ? p->stack_cap * 2 : 32;
+    JsonMember *new_stack = realloc(p->stack, new_cap * sizeof(JsonMember));
+    if (!new_stack) {
+      log_error("JSON parse stack allocation failed");
+      return false;
+    }
+    p->stack = new_stack;
+    p->stack_cap = new_cap;
+  }
+  p->stack[p->stack_len++] = *member;
+  return true;
+}
+
+static void skip_whitespace(JsonParser *p) {
+  while (p->cur < p->end &&
+         (*p->cur == ' ' || *p->cur == '\n' || *p->cur == '\r' ||
+          *p->cur == '\t'))
+    p->cur++;
+}
+
+static bool parse_string(JsonParser *p, const char **out, size_t *out_len) {
+  const char *start = ++p->cur;
+  bool has_escape;
+  if (!json_scan_string(&p->cur, p->end, &has_escape))
+    return false;
+
+  size_t raw_len = p->cur - start;
+  p->cur++;
+
+  char *dest;
+  if (p->in_situ) {
+    dest = p->in_situ + (start - p->in_situ);
+  } else {
+    dest = arena_alloc(p, raw_len + 1);
+    if (!dest)
+      return false;
+  }
+
+  size_t length = raw_len;
+  if (has_escape) {
+    if (!json_unescape(dest, start, raw_len, &length))
+      return false;
+  } else if (!p->in_situ) {
+    memcpy(dest, start, raw_len);
+  }
+  dest[length] = '\0';
+  *out = dest;
+  *out_len = length;
+  return true;
+}
+
+static bool parse_number(JsonParser *p, JsonValue *out) {
+  out->type = JSON_NUMBER;
+  return json_parse_number(&p->cur, p->end, &out->u.number.value,
+                           &out->u.number.integer, &out->u.number.is_integer);
+}
+
+static bool parse_literal(JsonParser *p, const char *literal, size_t len) {
+  if ((size_t)(p->end - p->cur) < len || memcmp(p->cur, literal, len) != 0) {
+    log_error("Invalid JSON literal");
+    return false;
+  }
+  p->cur += len;
+  return true;
+}
+
+static bool parse_object(JsonParser *p, JsonValue *out) {
+  size_t base = p->stack_len;
+  p->cur++;
+  skip_whitespace(p);
+
+  if (p->cur < p->end && *p->cur == '}') {
+    p->cur++;
+  } else {
+    for (;;) {
+      JsonMember member;
+      skip_whitespace(p);
+      if (p->cur >= p->end || *p->cur != '"') {
+        log_error("Expected object key");
+        return false;
+      }
+      if (!parse_string(p, &member.key, &member.key_length))
+        return false;
+
+      skip_whitespace(p);
+      if (p->cur >= p->end || *p->cur != ':') {
+        log_error("Expected ':' after object key");
+        return false;
+      }
+      p->cur++;
+
+      if (!parse_value(p, &member.value) || !stack_push(p, &member))
+        return false;
+
+      skip_whitespace(p);
+      if (p->cur < p->end && *p->cur == ',') {
+        p->cur++;
+        continue;
+      }
+      if (p->cur < p->end && *p->cur == '}') {
+        p->cur++;
+        break;
+      }
+      log_error("Expected ',' or '}' in object");
+      return false;
+    }
+  }
+
+  size_t count = p->stack_len - base;
+  out->type = JSON_OBJECT;
+  out->u.object.count = count;
+  out->u.object.members = NULL;
+  if (count > 0) {
+    out->u.object.members = arena_alloc(p, count * sizeof(JsonMember));
+    if (!out->u.object.members)
+      return false;
+    memcpy(out->u.object.members, p->stack + base,
+           count * sizeof(JsonMember));
+  }
+  p->stack_len = base;
+  return true;
+}
+
+static bool parse_array(JsonParser *p, JsonValue *out) {
+  size_t base = p->stack_len;
+  p->cur++;
+  skip_whitespace(p);
+
+  if (p->cur < p->end && *p->cur == ']') {
+    p->cur++;
+  } else {
+    for (;;) {
+      JsonMember item = {.key = NULL, .key_length = 0};
+      if (!parse_value(p, &item.value) || !stack_push(p, &item))
+        return false;
+
+      skip_whitespace(p);
+      if (p->cur < p->end && *p->cur == ',') {
+        p->cur++;
+        continue;
+      }
+      if (p->cur < p->end && *p->cur == ']') {
+        p->cur++;
+        break;
+      }
+      log_error("Expected ',' or ']' in array");
+      return false;
+    }
+  }
+
+  size_t count = p->stack_len - base;
+  out->type = JSON_ARRAY;
+  out->u.array.count = count;
+  out->u.array.items = NULL;
+  if (count > 0) {
+    out->u.array.items = arena_alloc(p, count * sizeof(JsonValue));
+    if (!out->u.array.items)
+      return false;
+    for (size_t i = 0; i < count; i++)
+      out->u.array.items[i] = p->stack[base + i].value;
+  }
+  p->stack_len = base;
+  return true;
+}
+
+static bool parse_value(JsonParser *p, JsonValue *out) {
+  skip_whitespace(p);
+  if (p->cur >= p->end) {
+    log_error("Unexpected end of JSON input");
+    return false;
+  }
+
+  switch (*p->cur) {
+  case '{':
+  case '[': {
+    if (++p->depth > JSON_DOM_MAX_DEPTH) {
+      log_error("JSON nesting exceeds %d levels", JSON_DOM_MAX_DEPTH);
+      return false;
+    }
+    bool ok = *p->cur == '{' ? parse_object(p, out) : parse_array(p, out);
+    p->depth--;
+    return ok;
+  }
+  case '"':
+    out->type = JSON_STRING;
+    return parse_string(p, &out->u.string.data, &out->u.string.length);
+  case 't':
+    out->type = JSON_BOOL;
+    out->u.boolean = true;
+    return parse_literal(p, "true", 4);
+  case 'f':
+    out->type = JSON_BOOL;
+    out->u.boolean = false;
+    return parse_literal(p, "false", 5);
+  case 'n':
+    out->type = JSON_NULL;
+    return parse_literal(p, "null", 4);
+  default:
+    if (*p->cur == '-' || (*p->cur >= '0' && *p->cur <= '9'))
+      return parse_number(p, out);
+    log_error("Unexpected character '%c' in JSON", *p->cur);
+    return false;
+  }
+}
+
+static bool parse_json_root(JsonParser *p, JsonValue *root) {
+  if (!parse_value(p, root))
+    return false;
+  skip_whitespace(p);
+  if (p->cur != p->end) {
+    log_error("Trailing characters after JSON document");
+    return false;
+  }
+  return true;
+}
+
+/*
+ * MessagePack decodes into the same DOM so a connection's payload encoding
+ * stays invisible past the framing layer. Strings are copied into the arena
+ * to gain their NUL terminator; bin is surfaced as a string with its length.
+ */
+static bool msgpack_take(JsonParser *p, size_t size,
+                         const unsigned char **bytes) {
+  if ((size_t)(p->end - p->cur) < size) {
+    log_error("Truncated MessagePack value");
+    return false;
+  }
+  *bytes = (const unsigned char *)p->cur;
+  p->cur += size;
+  return true;
+}
+
+static bool msgpack_uint(JsonParser *p, size_t width, uint64_t *value) {
+  const unsigned char *bytes;
+  if (!msgpack_take(p, width, &bytes))
+    return false;
+  *value = 0;
+  for (size_t i = 0; i < width; i++)
+    *value = (*value << 8) | bytes[i];
+  return true;
+}
+
+static bool msgpack_string(JsonParser *p, size_t length, const char **out,
+                           size_t *out_length) {
+  const unsigned char *bytes;
+  if (!msgpack_take(p, length, &bytes))
+    return false;
+  char *dest = arena_alloc(p, length + 1);
+  if (!dest)
+    return false;
+  memcpy(dest, bytes, length);
+  dest[length] = '\0';
+  *out = dest;
+  *out_length = length;
+  return true;
+}
+
+static bool msgpack_string_header(JsonParser *p, uint8_t tag, size_t *length) {
+  uint64_t value;
+  if ((tag & 0xe0) == 0xa0) {
+    *length = tag & 0x1f;
+    return true;
+  }
+  size_t width = tag == 0xd9 || tag == 0xc4   ? 1
+                 : tag == 0xda || tag == 0xc5 ? 2
+                 : tag == 0xdb || tag == 0xc6 ? 4
+                                              : 0;
+  if (width == 0 || !msgpack_uint(p, width, &value))
+    return false;
+  *length = (size_t)value;
+  return true;
+}
+
+static bool parse_msgpack_value(JsonParser *p, JsonValue *out);
+
+static bool parse_msgpack_container(JsonParser *p, size_t count, bool is_map,
+                                    JsonValue *out) {
+  if (++p->depth > JSON_DOM_MAX_DEPTH) {
+    log_error("MessagePack nesting exceeds %d levels", JSON_DOM_MAX_DEPTH);
+    return false;
+  }
+  /* Every element takes at least one byte; reject counts the input can't
+   * possibly hold before sizing the arena from them. */
+  if (count > (size_t)(p->end - p->cur) / (is_map ? 2 : 1)) {
+    log_error("MessagePack container count exceeds input");
+    return false;
+  }
+
+  bool ok = true;
+  if (is_map) {
+    out->type = JSON_OBJECT;
+    out->u.object.count = count;
+    out->u.object.members =
+        count ? arena_alloc(p, count * sizeof(JsonMember)) : NULL;
+    ok = !count || out->u.object.members;
+    for (size_t i = 0; ok && i < count; i++) {
+      JsonMember *member = &out->u.object.members[i];
+      const unsigned char *tag;
+      size_t length;
+      ok = msgpack_take(p, 1, &tag) && msgpack_string_header(p, *tag, &length) &&
+           msgpack_string(p, length, &member->key, &member->key_length) &&
+           parse_msgpack_value(p, &member->value);
+      if (!ok)
+        log_error("Invalid MessagePack map entry");
+    }
+  } else {
+    out->type = JSON_ARRAY;
+    out->u.array.count = count;
+    out->u.array.items = count ? arena_alloc(p, count * sizeof(JsonValue)) : NULL;
+    ok = !count || out->u.array.items;
+    for (size_t i = 0; ok && i < count; i++)
+      ok = parse_msgpack_value(p, &out->u.array.items[i]);
+  }
+  p->depth--;
+  return ok;
+}
+
+static void set_integer(JsonValue *out, long long value) {
+  out->type = JSON_NUMBER;
+  out->u.number.integer = value;
+  out->u.number.value = (double)value;
+  out->u.number.is_integer = true;
+}
+
+static void set_double(JsonValue *out, double value) {
+  out->type = JSON_NUMBER;
+  out->u.number.value = value;
+  out->u.number.integer = 0;
+  out->u.number.is_integer = false;
+}
+
+static bool parse_msgpack_value(JsonParser *p, JsonValue *out) {
+  const unsigned char *bytes;
+  uint64_t value;
+  if (!msgpack_take(p, 1, &bytes))
+    return false;
+  uint8_t tag = bytes[0];
+
+  if (tag < 0x80) {
+    set_integer(out, tag);
+    return true;
+  }
+  if (tag >= 0xe0) {
+    set_integer(out, (int8_t)tag);
+    return true;
+  }
+  if ((tag & 0xf0) == 0x80)
+    return parse_msgpack_container(p, tag & 0x0f, true, out);
+  if ((tag & 0xf0) == 0x90)
+    return parse_msgpack_container(p, tag & 0x0f, false, out);
+  if ((tag & 0xe0) == 0xa0 || tag == 0xd9 || tag == 0xda || tag == 0xdb ||
+      tag == 0xc4 || tag == 0xc5 || tag == 0xc6) {
+    size_t length;
+    out->type = JSON_STRING;
+    return msgpack_string_header(p, tag, &length) &&
+           msgpack_string(p, length, &out->u.string.data,
+                          &out->u.string.length);
+  }
+
+  switch (tag) {
+  case 0xc0:
+    out->type = JSON_NULL;
+    return true;
+  case 0xc2:
+  case 0xc3:
+    out->type = JSON_BOOL;
+    out->u.boolean = tag == 0xc3;
+    return true;
+  case 0xca: {
+    if (!msgpack_uint(p, 4, &value))
+      return false;
+    uint32_t bits = (uint32_t)value;
+    float number;
+    memcpy(&number, &bits, sizeof(number));
+    set_double(out, number);
+    return true;
+  }
+  case 0xcb: {
+    if (!msgpack_uint(p, 8, &value))
+      return false;
+    double number;
+    memcpy(&number, &value, sizeof(number));
+    set_double(out, number);
+    return true;
+  }
+  case 0xcc:
+  case 0xcd:
+  case 0xce:
+  case 0xcf:
+    if (!msgpack_uint(p, (size_t)1 << (tag - 0xcc), &value))
+      return false;
+    if (value > (uint64_t)LLONG_MAX)
+      set_double(out, (double)value);
+    else
+      set_integer(out, (long long)value);
+    return true;
+  case 0xd0:
+    if (!msgpack_uint(p, 1, &value))
+      return false;
+    set_integer(out, (int8_t)value);
+    return true;
+  case 0xd1:
+    if (!msgpack_uint(p, 2, &value))
+      return false;
+    set_integer(out, (int16_t)value);
+    return true;
+  case 0xd2:
+    if (!msgpack_uint(p, 4, &value))
+      return false;
+    set_integer(out, (int32_t)value);
+    return true;
+  case 0xd3:
+    if (!msgpack_uint(p, 8, &value))
+      return false;
+    set_integer(out, (long long)(int64_t)value);
+    return true;
+  case 0xdc:
+  case 0xdd:
+    return msgpack_uint(p, tag == 0xdc ? 2 : 4, &value) &&
+           parse_msgpack_container(p, (size_t)value, false, out);
+  case 0xde:
+  case 0xdf:
+    return msgpack_uint(p, tag == 0xde ? 2 : 4, &value) &&
+           parse_msgpack_container(p, (size_t)value, true, out);
+  default:
+    log_error("Unsupported MessagePack type 0x%02x", tag);
+    return false;
+  }
+}
+
+static bool parse_msgpack_root(JsonParser *p, JsonValue *root) {
+  if (!parse_msgpack_value(p, root))
+    return false;
+  if (p->cur != p->end) {
+    log_error("Trailing bytes after MessagePack document");
+    return false;
+  }
+  return true;
+}
+
+static JsonDocument *parse_document(JsonParser *p, size_t arena_size,
+                                    bool (*parse_root)(JsonParser *,
+                                                       JsonValue *)) {
+  size_t capacity = sizeof(JsonDocument) + arena_size;
+  if (capacity < ARENA_MIN_BLOCK)
+    capacity = ARENA_MIN_BLOCK;
+  JsonArenaBlock *first = malloc(sizeof(JsonArenaBlock) + capacity);
+  if (!first) {
+    log_error("JSON arena allocation failed");
+    return NULL;
+  }
+  first->next = NULL;
+  first->capacity = capacity;
+  first->used = 0;
+  p->blocks = first;
+
+  JsonDocument *doc = arena_alloc(p, sizeof(JsonDocument));
+  bool ok = parse_root(p, &doc->root);
+  free(p->stack);
+
+  if (!ok) {
+    arena_release(p->blocks);
+    return NULL;
+  }
+  doc->blocks = p->blocks;
+  return doc;
+}
+
+JsonDocument *json_dom_parse(const char *text, size_t length) {
+  if (!text)
+    return NULL;
+
+  JsonParser p = {.cur = text, .end = text + length};
+  return parse_document(&p, length + length / 2, parse_json_root);
+}
+
+JsonDocument *json_dom_parse_in_situ(char *text, size_t length) {
+  if (!text)
+    return NULL;
+
+  JsonParser p = {.cur = text, .end = text + length, .in_situ = text};
+  return parse_document(&p, length / 2, parse_json_root);
+}
+
+JsonDocument *json_dom_parse_msgpack(const char *data, size_t length) {
+  if (!data)
+    return NULL;
+
+  JsonParser p = {.cur = data, .end = data + length};
+  return parse_document(&p, length * 2, parse_msgpack_root);
+}
+
+void json_dom_free(JsonDocument *doc) {
+  if (doc)
+    arena_release(doc->blocks);
+}
+
+const JsonValue *json_object_get(const JsonValue *object, const char *key) {
+  if (!object || object->type != JSON_OBJECT || !key)
+    return NULL;
+  size_t key_length = strlen(key);
+  for (size_t i = 0; i < object->u.object.count; i++) {
+    const JsonMember *member = &object->u.object.members[i];
+    if (member->key_length == key_length &&
+        memcmp(member->key, key, key_length) == 0)
+      return &member->value;
+  }
+  return NULL;
+}
+
+const JsonValue *json_array_at(const JsonValue *array, size_t index) {
+  if (!array || array->type != JSON_ARRAY || index >= array->u.array.count)
+    return NULL;
+  return &array->u.array.items[index];
+}
+
+const char *json_string_value(const JsonValue *value) {
+  if (!value || value->type != JSON_STRING)
+    return NULL;
+  return value->u.string.data;
+}
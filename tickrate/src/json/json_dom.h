@@ -0,0 +1,72 @@
+#ifndef JSON_DOM_H
+#define JSON_DOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define JSON_DOM_MAX_DEPTH 256
+
+typedef enum {
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} JsonType;
+
+typedef struct JsonValue JsonValue;
+typedef struct JsonMember JsonMember;
+
+struct JsonValue {
+    JsonType type;
+    union {
+        bool boolean;
+        struct {
+            double value;
+            long long integer;
+            bool is_integer;
+        } number;
+        struct {
+            const char *data;
+            size_t length;
+        } string;
+        struct {
+            JsonValue *items;
+            size_t count;
+        } array;
+        struct {
+            JsonMember *members;
+            size_t count;
+        } object;
+    } u;
+};
+
+struct JsonMember {
+    const char *key;
+    size_t key_length;
+    JsonValue value;
+};
+
+typedef struct JsonArenaBlock {
+    struct JsonArenaBlock *next;
+    size_t used;
+    size_t capacity;
+    _Alignas(16) char data[];
+} JsonArenaBlock;
+
+typedef struct JsonDocument {
+    JsonArenaBlock *blocks;
+    JsonValue root;
+} JsonDocument;
+
+JsonDocument* json_dom_parse(const char *text, size_t length);
+JsonDocument* json_dom_parse_in_situ(char *text, size_t length);
+JsonDocument* json_dom_parse_msgpack(const char *data, size_t length);
+void json_dom_free(JsonDocument *doc);
+
+const JsonValue* json_object_get(const JsonValue *object, const char *key);
+const JsonValue* json_array_at(const JsonValue *array, size_t index);
+const char* json_string_value(const JsonValue *value);
+
+#endif
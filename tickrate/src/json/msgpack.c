@@ -0,0 +1,169 @@
+#include "msgpack.h"
+#include "../logging/logging.h"
+#include <string.h>
+
+static bool write_byte(JsonBuffer *buf, uint8_t byte) {
+  return json_buffer_append(buf, (const char *)&byte, 1);
+}
+
+static bool write_tagged(JsonBuffer *buf, uint8_t tag, uint64_t value,
+                         int width) {
+  char bytes[9];
+  bytes[0] = (char)tag;
+  for (int i = 0; i < width; i++)
+    bytes[1 + i] = (char)(value >> (8 * (width - 1 - i)));
+  return json_buffer_append(buf, bytes, (size_t)width + 1);
+}
+
+bool msgpack_write_nil(JsonBuffer *buf) { return write_byte(buf, 0xc0); }
+
+bool msgpack_write_bool(JsonBuffer *buf, bool value) {
+  return write_byte(buf, value ? 0xc3 : 0xc2);
+}
+
+bool msgpack_write_int(JsonBuffer *buf, int64_t value) {
+  if (value >= 0) {
+    if (value < 128)
+      return write_byte(buf, (uint8_t)value);
+    if (value <= UINT8_MAX)
+      return write_tagged(buf, 0xcc, (uint64_t)value, 1);
+    if (value <= UINT16_MAX)
+      return write_tagged(buf, 0xcd, (uint64_t)value, 2);
+    if (value <= UINT32_MAX)
+      return write_tagged(buf, 0xce, (uint64_t)value, 4);
+    return write_tagged(buf, 0xcf, (uint64_t)value, 8);
+  }
+  if (value >= -32)
+    return write_byte(buf, (uint8_t)(int8_t)value);
+  if (value >= INT8_MIN)
+    return write_tagged(buf, 0xd0, (uint8_t)value, 1);
+  if (value >= INT16_MIN)
+    return write_tagged(buf, 0xd1, (uint16_t)value, 2);
+  if (value >= INT32_MIN)
+    return write_tagged(buf, 0xd2, (uint32_t)value, 4);
+  return write_tagged(buf, 0xd3, (uint64_t)value, 8);
+}
+
+bool msgpack_write_double(JsonBuffer *buf, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return write_tagged(buf, 0xcb, bits, 8);
+}
+
+bool msgpack_write_string(JsonBuffer *buf, const char *data, size_t length) {
+  bool ok;
+  if (length > UINT32_MAX) {
+    log_error("MessagePack string of %zu bytes is too long", length);
+    return false;
+  }
+
+  if (!msgpack_is_utf8(data, length)) {
+    if (length <= UINT8_MAX)
+      ok = write_tagged(buf, 0xc4, length, 1);
+    else if (length <= UINT16_MAX)
+      ok = write_tagged(buf, 0xc5, length, 2);
+    else
+      ok = write_tagged(buf, 0xc6, length, 4);
+  } else if (length < 32) {
+    ok = write_byte(buf, (uint8_t)(0xa0 | length));
+  } else if (length <= UINT8_MAX) {
+    ok = write_tagged(buf, 0xd9, length, 1);
+  } else if (length <= UINT16_MAX) {
+    ok = write_tagged(buf, 0xda, length, 2);
+  } else {
+    ok = write_tagged(buf, 0xdb, length, 4);
+  }
+  return ok && json_buffer_append(buf, data, length);
+}
+
+bool msgpack_write_array(JsonBuffer *buf, size_t count) {
+  if (count < 16)
+    return write_byte(buf, (uint8_t)(0x90 | count));
+  if (count <= UINT16_MAX)
+    return write_tagged(buf, 0xdc, count, 2);
+  return write_tagged(buf, 0xdd, count, 4);
+}
+
+bool msgpack_write_map(JsonBuffer *buf, size_t count) {
+  if (count < 16)
+    return write_byte(buf, (uint8_t)(0x80 | count));
+  if (count <= UINT16_MAX)
+    return write_tagged(buf, 0xde, count, 2);
+  return write_tagged(buf, 0xdf, count, 4);
+}
+
+bool msgpack_encode_dom(const JsonValue *value, JsonBuffer *buf) {
+  switch (value->type) {
+  case JSON_NULL:
+    return msgpack_write_nil(buf);
+  case JSON_BOOL:
+    return msgpack_write_bool(buf, value->u.boolean);
+  case JSON_NUMBER:
+    if (value->u.number.is_integer)
+      return msgpack_write_int(buf, value->u.number.integer);
+    return msgpack_write_double(buf, value->u.number.value);
+  case JSON_STRING:
+    return msgpack_write_string(buf, value->u.string.data,
+                                value->u.string.length);
+  case JSON_ARRAY:
+    if (!msgpack_write_array(buf, value->u.array.count))
+      return false;
+    for (size_t i = 0; i < value->u.array.count; i++) {
+      if (!msgpack_encode_dom(&value->u.array.items[i], buf))
+        return false;
+    }
+    return true;
+  case JSON_OBJECT:
+    if (!msgpack_write_map(buf, value->u.object.count))
+      return false;
+    for (size_t i = 0; i < value->u.object.count; i++) {
+      const JsonMember *member = &value->u.object.members[i];
+      if (!msgpack_write_string(buf, member->key, member->key_length) ||
+          !msgpack_encode_dom(&member->value, buf))
+        return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+bool msgpack_is_utf8(const char *data, size_t length) {
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + length;
+
+  while (p < end) {
+    if (*p < 0x80) {
+      p++;
+      continue;
+    }
+
+    size_t extra;
+    uint32_t codepoint;
+    if ((*p & 0xe0) == 0xc0) {
+      extra = 1;
+      codepoint = *p & 0x1f;
+    } else if ((*p & 0xf0) == 0xe0) {
+      extra = 2;
+      codepoint = *p & 0x0f;
+    } else if ((*p & 0xf8) == 0xf0) {
+      extra = 3;
+      codepoint = *p & 0x07;
+    } else {
+      return false;
+    }
+    if ((size_t)(end - p) <= extra)
+      return false;
+    for (size_t i = 1; i <= extra; i++) {
+      if ((p[i] & 0xc0) != 0x80)
+        return false;
+      codepoint = (codepoint << 6) | (p[i] & 0x3f);
+    }
+
+    static const uint32_t minimum[] = {0, 0x80, 0x800, 0x10000};
+    if (codepoint < minimum[extra] || codepoint > 0x10ffff ||
+        (codepoint >= 0xd800 && codepoint <= 0xdfff))
+      return false;
+    p += extra + 1;
+  }
+  return true;
+}
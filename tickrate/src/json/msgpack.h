@@ -0,0 +1,28 @@
+#ifndef MSGPACK_H
+#define MSGPACK_H
+
+#include "json.h"
+#include "json_dom.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * MessagePack writer used for connections that negotiated the msgpack
+ * payload encoding. Values are appended to a JsonBuffer so callers can reuse
+ * the same growable buffers as the JSON encoders. Strings that are not valid
+ * UTF-8 are written as bin so binary payloads survive the round trip.
+ * Decoding into a JsonDocument lives with the other DOM parsers.
+ */
+bool msgpack_write_nil(JsonBuffer *buf);
+bool msgpack_write_bool(JsonBuffer *buf, bool value);
+bool msgpack_write_int(JsonBuffer *buf, int64_t value);
+bool msgpack_write_double(JsonBuffer *buf, double value);
+bool msgpack_write_string(JsonBuffer *buf, const char *data, size_t length);
+bool msgpack_write_array(JsonBuffer *buf, size_t count);
+bool msgpack_write_map(JsonBuffer *buf, size_t count);
+
+bool msgpack_encode_dom(const JsonValue *value, JsonBuffer *buf);
+bool msgpack_is_utf8(const char *data, size_t length);
+
+#endif
@@ -1,9 +1,18 @@
 #include "logging.h"
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 
 #define ANSI_RESET "\x1b[0m"
 #define ANSI_GRAY "\x1b[90m"
@@ -13,6 +22,60 @@
 
 #define MAX_MESSAGE_LEN 1024
 #define HISTORY_SIZE 2
+
+#define LOG_RING_SIZE (64 * 1024)
+#define LOG_RECORD_MAX 1024
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_IDLE_TIMEOUT_MS 50
+#define LOG_SPEC_MAX 32
+
+enum { RECORD_MESSAGE, RECORD_PADDING };
+
+typedef struct LogRecord {
+  uint32_t size;
+  uint8_t type;
+  uint8_t level;
+  uint16_t length;
+  uint64_t timestamp_ns;
+  const char *format;
+  unsigned char data[];
+} LogRecord;
+
+/*
+ * Single-producer/single-consumer byte ring. head is only advanced by the
+ * owning thread, tail only by the writer. Records are 8-byte aligned; one
+ * that would straddle the end is preceded by a padding record.
+ */
+typedef struct LogRing {
+  _Alignas(64) atomic_uint_fast64_t head;
+  _Alignas(64) atomic_uint_fast64_t tail;
+  atomic_size_t dropped;
+  size_t reported_dropped;
+  bool in_use;
+  struct LogRing *next;
+  _Alignas(8) unsigned char data[LOG_RING_SIZE];
+} LogRing;
+
+typedef enum {
+  LENGTH_NONE,
+  LENGTH_CHAR,
+  LENGTH_SHORT,
+  LENGTH_LONG,
+  LENGTH_LLONG,
+  LENGTH_SIZE,
+  LENGTH_INTMAX,
+  LENGTH_PTRDIFF,
+  LENGTH_LDOUBLE
+} FormatLength;
+
+typedef struct FormatSpec {
+  const char *start;
+  const char *end;
+  int stars;
+  FormatLength length;
+  char conversion;
+} FormatSpec;
+
 static struct {
   char messages[HISTORY_SIZE][MAX_MESSAGE_LEN];
   int count;
@@ -20,16 +83,397 @@ static struct {
   int suppressed_count;
 } log_history = {.count = 0, .suppressed = 0, .suppressed_count = 0};
 
+static struct {
+  pthread_mutex_t rings_lock;
+  pthread_mutex_t emit_lock;
+  pthread_key_t key;
+  _Atomic(LogRing *) rings;
+  atomic_bool accepting;
+  atomic_bool running;
+  atomic_bool idle;
+  pthread_t thread;
+  int wake_fd;
+  bool started;
+  time_t cached_second;
+  char cached_timestamp[20];
+  char batch[LOG_BATCH_SIZE];
+  size_t batch_length;
+} logger = {.rings_lock = PTHREAD_MUTEX_INITIALIZER,
+            .emit_lock = PTHREAD_MUTEX_INITIALIZER,
+            .wake_fd = -1,
+            .cached_second = -1};
+
+static _Thread_local LogRing *local_ring;
+
 static LogLevel current_log_level = LOG_LEVEL_INFO;
 
 void set_log_level(LogLevel level) { current_log_level = level; }
 
-static void shift_history() {
-  for (int i = 0; i < HISTORY_SIZE - 1; i++) {
-    strncpy(log_history.messages[i], log_history.messages[i + 1],
-            MAX_MESSAGE_LEN);
-    log_history.messages[i][MAX_MESSAGE_LEN - 1] = '\0';
+/* ---- Format parsing shared by the packer and the writer ---- */
+
+static const char *parse_spec(const char *p, FormatSpec *spec) {
+  spec->start = p - 1;
+  spec->stars = 0;
+  spec->length = LENGTH_NONE;
+
+  while (*p && strchr("-+ #0'", *p))
+    p++;
+  if (*p == '*') {
+    spec->stars++;
+    p++;
+  } else {
+    while (*p >= '0' && *p <= '9')
+      p++;
+  }
+  if (*p == '.') {
+    p++;
+    if (*p == '*') {
+      spec->stars++;
+      p++;
+    } else {
+      while (*p >= '0' && *p <= '9')
+        p++;
+    }
+  }
+
+  switch (*p) {
+  case 'h':
+    p++;
+    spec->length = LENGTH_SHORT;
+    if (*p == 'h') {
+      p++;
+      spec->length = LENGTH_CHAR;
+    }
+    break;
+  case 'l':
+    p++;
+    spec->length = LENGTH_LONG;
+    if (*p == 'l') {
+      p++;
+      spec->length = LENGTH_LLONG;
+    }
+    break;
+  case 'z':
+    p++;
+    spec->length = LENGTH_SIZE;
+    break;
+  case 'j':
+    p++;
+    spec->length = LENGTH_INTMAX;
+    break;
+  case 't':
+    p++;
+    spec->length = LENGTH_PTRDIFF;
+    break;
+  case 'L':
+    p++;
+    spec->length = LENGTH_LDOUBLE;
+    break;
+  }
+
+  spec->conversion = *p;
+  if (*p)
+    p++;
+  spec->end = p;
+  return p;
+}
+
+static bool is_signed_conversion(char c) { return c == 'd' || c == 'i'; }
+
+static bool is_unsigned_conversion(char c) {
+  return c == 'u' || c == 'o' || c == 'x' || c == 'X';
+}
+
+static bool is_float_conversion(char c) { return strchr("fFeEgGaA", c) != NULL; }
+
+/* ---- Packing on the calling thread ---- */
+
+typedef struct Packer {
+  unsigned char *data;
+  size_t length;
+  size_t capacity;
+} Packer;
+
+static void pack_bytes(Packer *packer, const void *bytes, size_t size) {
+  if (packer->length + size > packer->capacity)
+    size = packer->capacity - packer->length;
+  memcpy(packer->data + packer->length, bytes, size);
+  packer->length += size;
+}
+
+static void pack_u64(Packer *packer, uint64_t value) {
+  pack_bytes(packer, &value, sizeof(value));
+}
+
+static void pack_string(Packer *packer, const char *string, int precision) {
+  if (!string)
+    string = "(null)";
+  size_t room = packer->capacity - packer->length;
+  room = room > sizeof(uint32_t) ? room - sizeof(uint32_t) : 0;
+  size_t limit = precision >= 0 && (size_t)precision < room ? (size_t)precision
+                                                            : room;
+  uint32_t length = (uint32_t)strnlen(string, limit);
+  pack_bytes(packer, &length, sizeof(length));
+  pack_bytes(packer, string, length);
+}
+
+static uint64_t pack_integer(va_list *args, FormatLength length,
+                             bool is_signed) {
+  switch (length) {
+  case LENGTH_LONG:
+    return is_signed ? (uint64_t)va_arg(*args, long)
+                     : (uint64_t)va_arg(*args, unsigned long);
+  case LENGTH_LLONG:
+    return is_signed ? (uint64_t)va_arg(*args, long long)
+                     : (uint64_t)va_arg(*args, unsigned long long);
+  case LENGTH_SIZE:
+    return is_signed ? (uint64_t)va_arg(*args, ssize_t)
+                     : (uint64_t)va_arg(*args, size_t);
+  case LENGTH_INTMAX:
+    return is_signed ? (uint64_t)va_arg(*args, intmax_t)
+                     : (uint64_t)va_arg(*args, uintmax_t);
+  case LENGTH_PTRDIFF:
+    return (uint64_t)va_arg(*args, ptrdiff_t);
+  default:
+    return is_signed ? (uint64_t)(int64_t)va_arg(*args, int)
+                     : (uint64_t)va_arg(*args, unsigned int);
+  }
+}
+
+static void pack_arguments(Packer *packer, const char *format, va_list args) {
+  va_list copy;
+  va_copy(copy, args);
+  const char *p = format;
+  while ((p = strchr(p, '%')) != NULL) {
+    FormatSpec spec;
+    p = parse_spec(p + 1, &spec);
+    if (spec.conversion == '%' || spec.conversion == '\0')
+      continue;
+
+    int precision = -1;
+    for (int i = 0; i < spec.stars; i++) {
+      int star = va_arg(copy, int);
+      pack_u64(packer, (uint64_t)(int64_t)star);
+      precision = star;
+    }
+
+    char c = spec.conversion;
+    if (c == 's') {
+      bool has_precision = strchr(spec.start, '.') &&
+                           strchr(spec.start, '.') < spec.end;
+      if (has_precision && spec.stars == 0)
+        precision = atoi(strchr(spec.start, '.') + 1);
+      else if (!has_precision)
+        precision = -1;
+      pack_string(packer, va_arg(copy, const char *), precision);
+    } else if (c == 'c') {
+      pack_u64(packer, (uint64_t)(int64_t)va_arg(copy, int));
+    } else if (c == 'p') {
+      pack_u64(packer, (uint64_t)(uintptr_t)va_arg(copy, void *));
+    } else if (is_float_conversion(c)) {
+      if (spec.length == LENGTH_LDOUBLE) {
+        long double value = va_arg(copy, long double);
+        pack_bytes(packer, &value, sizeof(value));
+      } else {
+        double value = va_arg(copy, double);
+        pack_bytes(packer, &value, sizeof(value));
+      }
+    } else if (is_signed_conversion(c) || is_unsigned_conversion(c)) {
+      pack_u64(packer,
+               pack_integer(&copy, spec.length, is_signed_conversion(c)));
+    } else if (c == 'n') {
+      (void)va_arg(copy, void *);
+    }
+  }
+  va_end(copy);
+}
+
+/* ---- Formatting on the writer ---- */
+
+typedef struct Unpacker {
+  const unsigned char *data;
+  size_t offset;
+  size_t length;
+} Unpacker;
+
+static bool unpack_bytes(Unpacker *unpacker, void *out, size_t size) {
+  if (unpacker->offset + size > unpacker->length) {
+    memset(out, 0, size);
+    return false;
+  }
+  memcpy(out, unpacker->data + unpacker->offset, size);
+  unpacker->offset += size;
+  return true;
+}
+
+static uint64_t unpack_u64(Unpacker *unpacker) {
+  uint64_t value;
+  unpack_bytes(unpacker, &value, sizeof(value));
+  return value;
+}
+
+#define FORMAT_ARG(dest, value)                                                \
+  (spec.stars == 0   ? snprintf(dest, room, text, value)                       \
+   : spec.stars == 1 ? snprintf(dest, room, text, star[0], value)              \
+                     : snprintf(dest, room, text, star[0], star[1], value))
+
+static int format_integer(char *out, size_t room, const char *text,
+                          const FormatSpec spec, const int *star,
+                          uint64_t value) {
+  if (is_signed_conversion(spec.conversion)) {
+    switch (spec.length) {
+    case LENGTH_LONG:
+      return FORMAT_ARG(out, (long)value);
+    case LENGTH_LLONG:
+      return FORMAT_ARG(out, (long long)value);
+    case LENGTH_SIZE:
+      return FORMAT_ARG(out, (ssize_t)value);
+    case LENGTH_INTMAX:
+      return FORMAT_ARG(out, (intmax_t)value);
+    case LENGTH_PTRDIFF:
+      return FORMAT_ARG(out, (ptrdiff_t)value);
+    default:
+      return FORMAT_ARG(out, (int)value);
+    }
+  }
+  switch (spec.length) {
+  case LENGTH_LONG:
+    return FORMAT_ARG(out, (unsigned long)value);
+  case LENGTH_LLONG:
+    return FORMAT_ARG(out, (unsigned long long)value);
+  case LENGTH_SIZE:
+    return FORMAT_ARG(out, (size_t)value);
+  case LENGTH_INTMAX:
+    return FORMAT_ARG(out, (uintmax_t)value);
+  case LENGTH_PTRDIFF:
+    return FORMAT_ARG(out, (ptrdiff_t)value);
+  default:
+    return FORMAT_ARG(out, (unsigned int)value);
+  }
+}
+
+static void format_record(const LogRecord *record, char *out, size_t size) {
+  Unpacker unpacker = {.data = record->data, .length = record->length};
+  const char *p = record->format;
+  size_t used = 0;
+
+  while (*p && used + 1 < size) {
+    const char *percent = strchr(p, '%');
+    size_t literal = percent ? (size_t)(percent - p) : strlen(p);
+    if (literal > size - used - 1)
+      literal = size - used - 1;
+    memcpy(out + used, p, literal);
+    used += literal;
+    if (!percent)
+      break;
+
+    FormatSpec spec;
+    p = parse_spec(percent + 1, &spec);
+    if (spec.conversion == '%') {
+      out[used++] = '%';
+      continue;
+    }
+    if (spec.conversion == '\0' || spec.conversion == 'n')
+      continue;
+
+    char text[LOG_SPEC_MAX];
+    size_t text_length = (size_t)(spec.end - spec.start);
+    if (text_length >= sizeof(text))
+      continue;
+    memcpy(text, spec.start, text_length);
+    text[text_length] = '\0';
+
+    int star[2] = {0, 0};
+    for (int i = 0; i < spec.stars; i++)
+      star[i] = (int)(int64_t)unpack_u64(&unpacker);
+
+    char *dest = out + used;
+    size_t room = size - used;
+    int written = 0;
+    char c = spec.conversion;
+    if (c == 's') {
+      uint32_t length = 0;
+      unpack_bytes(&unpacker, &length, sizeof(length));
+      char string[LOG_RECORD_MAX + 1];
+      if (length > LOG_RECORD_MAX ||
+          unpacker.offset + length > unpacker.length)
+        length = 0;
+      memcpy(string, unpacker.data + unpacker.offset, length);
+      string[length] = '\0';
+      unpacker.offset += length;
+      written = FORMAT_ARG(dest, string);
+    } else if (c == 'c') {
+      written = FORMAT_ARG(dest, (int)unpack_u64(&unpacker));
+    } else if (c == 'p') {
+      written = FORMAT_ARG(dest, (void *)(uintptr_t)unpack_u64(&unpacker));
+    } else if (is_float_conversion(c)) {
+      if (spec.length == LENGTH_LDOUBLE) {
+        long double value;
+        unpack_bytes(&unpacker, &value, sizeof(value));
+        written = FORMAT_ARG(dest, value);
+      } else {
+        double value;
+        unpack_bytes(&unpacker, &value, sizeof(value));
+        written = FORMAT_ARG(dest, value);
+      }
+    } else if (is_signed_conversion(c) || is_unsigned_conversion(c)) {
+      written = format_integer(dest, room, text, spec, star,
+                               unpack_u64(&unpacker));
+    }
+
+    if (written > 0)
+      used += (size_t)written < room ? (size_t)written : room - 1;
+  }
+  out[used < size ? used : size - 1] = '\0';
+}
+
+/* ---- Writer-side output: timestamps, dedup, batching ---- */
+
+static const char *level_label(LogLevel level) {
+  switch (level) {
+  case LOG_LEVEL_DEBUG:
+    return ANSI_GRAY "[DEBUG]";
+  case LOG_LEVEL_WARN:
+    return ANSI_YELLOW "[WARN]";
+  case LOG_LEVEL_ERROR:
+    return ANSI_RED "[ERROR]";
+  default:
+    return ANSI_GREEN "[INFO]";
+  }
+}
+
+static const char *cached_timestamp(time_t second) {
+  if (second != logger.cached_second) {
+    struct tm timeinfo;
+    localtime_r(&second, &timeinfo);
+    strftime(logger.cached_timestamp, sizeof(logger.cached_timestamp),
+             "%Y-%m-%d %H:%M:%S", &timeinfo);
+    logger.cached_second = second;
   }
+  return logger.cached_timestamp;
+}
+
+static void flush_batch(void) {
+  if (logger.batch_length == 0)
+    return;
+  fwrite(logger.batch, 1, logger.batch_length, stderr);
+  fflush(stderr);
+  logger.batch_length = 0;
+}
+
+static void append_line(time_t second, LogLevel level, const char *message) {
+  char line[MAX_MESSAGE_LEN + 64];
+  int length = snprintf(line, sizeof(line), "[%s] %s%s %s%s\n",
+                        cached_timestamp(second), level_label(level),
+                        ANSI_RESET, message, ANSI_RESET);
+  if (length < 0)
+    return;
+  size_t size = (size_t)length < sizeof(line) ? (size_t)length
+                                              : sizeof(line) - 1;
+  if (logger.batch_length + size > sizeof(logger.batch))
+    flush_batch();
+  memcpy(logger.batch + logger.batch_length, line, size);
+  logger.batch_length += size;
 }
 
 static void update_history(const char *message) {
@@ -38,7 +482,8 @@ static void update_history(const char *message) {
             MAX_MESSAGE_LEN);
     log_history.messages[log_history.count - 1][MAX_MESSAGE_LEN - 1] = '\0';
   } else {
-    shift_history();
+    memmove(log_history.messages[0], log_history.messages[1],
+            sizeof(log_history.messages[0]) * (HISTORY_SIZE - 1));
     strncpy(log_history.messages[HISTORY_SIZE - 1], message, MAX_MESSAGE_LEN);
     log_history.messages[HISTORY_SIZE - 1][MAX_MESSAGE_LEN - 1] = '\0';
   }
@@ -54,48 +499,278 @@ static int is_duplicate(const char *message) {
   return 1;
 }
 
-static void log_suppression_message() {
-  time_t now;
-  struct tm *timeinfo;
-  char timestamp[20];
-  time(&now);
-  timeinfo = localtime(&now);
-  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", timeinfo);
+/* Caller holds emit_lock. */
+static void emit_record(const LogRecord *record) {
+  char message[MAX_MESSAGE_LEN];
+  format_record(record, message, sizeof(message));
+  time_t second = (time_t)(record->timestamp_ns / 1000000000u);
 
-  fprintf(
-      stderr,
-      "[%s] %s[INFO]%s Duplication detected, suppressing further messages%s",
-      timestamp, ANSI_GREEN, ANSI_RESET, ANSI_RESET);
+  if (is_duplicate(message)) {
+    if (!log_history.suppressed) {
+      append_line(second, LOG_LEVEL_INFO,
+                  "Duplication detected, suppressing further messages");
+      log_history.suppressed = 1;
+    }
+    log_history.suppressed_count++;
+    return;
+  }
+
+  if (log_history.suppressed) {
+    char notice[96];
+    snprintf(notice, sizeof(notice), "Suppressed %d duplicate messages",
+             log_history.suppressed_count);
+    append_line(second, LOG_LEVEL_INFO, notice);
+    log_history.suppressed = 0;
+    log_history.suppressed_count = 0;
+  }
+
+  update_history(message);
+  append_line(second, (LogLevel)record->level, message);
 }
 
-static void log_message(LogLevel level, const char *format, va_list args) {
-  if (level < current_log_level)
-    return;
+/* ---- Rings ---- */
 
-  char message_buffer[MAX_MESSAGE_LEN];
-  vsnprintf(message_buffer, MAX_MESSAGE_LEN, format, args);
-  message_buffer[MAX_MESSAGE_LEN - 1] = '\0';
+static void release_ring(void *arg) {
+  LogRing *ring = arg;
+  pthread_mutex_lock(&logger.rings_lock);
+  ring->in_use = false;
+  pthread_mutex_unlock(&logger.rings_lock);
+}
 
-  if (is_duplicate(message_buffer)) {
-    if (!log_history.suppressed) {
-      log_suppression_message();
-      log_history.suppressed = 1;
+static LogRing *attach_ring(void) {
+  pthread_mutex_lock(&logger.rings_lock);
+  LogRing *ring = atomic_load_explicit(&logger.rings, memory_order_relaxed);
+  while (ring && ring->in_use)
+    ring = ring->next;
+  if (!ring) {
+    ring = aligned_alloc(64, sizeof(LogRing));
+    if (!ring) {
+      pthread_mutex_unlock(&logger.rings_lock);
+      return NULL;
     }
-    log_history.suppressed_count++;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    ring->reported_dropped = 0;
+    ring->next = atomic_load_explicit(&logger.rings, memory_order_relaxed);
+    atomic_store_explicit(&logger.rings, ring, memory_order_release);
+  }
+  ring->in_use = true;
+  pthread_mutex_unlock(&logger.rings_lock);
+
+  pthread_setspecific(logger.key, ring);
+  local_ring = ring;
+  return ring;
+}
+
+static bool ring_push(LogRing *ring, const LogRecord *record) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  size_t offset = (size_t)(head % LOG_RING_SIZE);
+  size_t contiguous = LOG_RING_SIZE - offset;
+  size_t needed = record->size <= contiguous ? record->size
+                                             : contiguous + record->size;
+
+  if (LOG_RING_SIZE - (head - tail) < needed) {
+    atomic_store_explicit(
+        &ring->dropped,
+        atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    return false;
+  }
+
+  if (record->size > contiguous) {
+    LogRecord *padding = (LogRecord *)(ring->data + offset);
+    padding->size = (uint32_t)contiguous;
+    padding->type = RECORD_PADDING;
+    head += contiguous;
+    offset = 0;
+  }
+  memcpy(ring->data + offset, record, record->size);
+  atomic_store_explicit(&ring->head, head + record->size,
+                        memory_order_release);
+  return true;
+}
+
+static const LogRecord *ring_peek(LogRing *ring, uint64_t limit) {
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (tail < limit) {
+    const LogRecord *record =
+        (const LogRecord *)(ring->data + tail % LOG_RING_SIZE);
+    if (record->type != RECORD_PADDING)
+      return record;
+    tail += record->size;
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+  }
+  return NULL;
+}
+
+static void ring_consume(LogRing *ring, const LogRecord *record) {
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + record->size,
+                        memory_order_release);
+}
+
+#define LOG_MAX_RINGS 256
+
+/*
+ * Emit everything published so far, merging rings by timestamp so lines
+ * from different threads come out roughly in order. Caller holds emit_lock.
+ */
+static size_t drain_rings(void) {
+  LogRing *rings[LOG_MAX_RINGS];
+  uint64_t limits[LOG_MAX_RINGS];
+  size_t count = 0;
+  for (LogRing *ring = atomic_load_explicit(&logger.rings, memory_order_acquire);
+       ring && count < LOG_MAX_RINGS; ring = ring->next) {
+    rings[count] = ring;
+    limits[count] = atomic_load_explicit(&ring->head, memory_order_acquire);
+    count++;
+  }
+
+  size_t drained = 0;
+  for (;;) {
+    size_t best = count;
+    const LogRecord *next = NULL;
+    for (size_t i = 0; i < count; i++) {
+      const LogRecord *record = ring_peek(rings[i], limits[i]);
+      if (record && (!next || record->timestamp_ns < next->timestamp_ns)) {
+        next = record;
+        best = i;
+      }
+    }
+    if (!next)
+      break;
+    emit_record(next);
+    ring_consume(rings[best], next);
+    drained++;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    size_t dropped = atomic_load_explicit(&rings[i]->dropped,
+                                          memory_order_relaxed);
+    if (dropped != rings[i]->reported_dropped) {
+      char notice[96];
+      snprintf(notice, sizeof(notice),
+               "Dropped %zu log records from a full ring",
+               dropped - rings[i]->reported_dropped);
+      append_line(time(NULL), LOG_LEVEL_WARN, notice);
+      rings[i]->reported_dropped = dropped;
+    }
+  }
+
+  flush_batch();
+  return drained;
+}
+
+static void *log_writer_thread(void *arg) {
+  (void)arg;
+  struct pollfd wake = {.fd = logger.wake_fd, .events = POLLIN};
+
+  while (atomic_load(&logger.running)) {
+    pthread_mutex_lock(&logger.emit_lock);
+    size_t drained = drain_rings();
+    pthread_mutex_unlock(&logger.emit_lock);
+    if (drained > 0)
+      continue;
+
+    /* A producer that misses the idle flag is picked up by the timeout. */
+    atomic_store(&logger.idle, true);
+    if (poll(&wake, 1, LOG_IDLE_TIMEOUT_MS) > 0) {
+      uint64_t count;
+      while (read(logger.wake_fd, &count, sizeof(count)) > 0) {
+      }
+    }
+    atomic_store(&logger.idle, false);
+  }
+  return NULL;
+}
+
+static void flush_at_exit(void) { log_shutdown(); }
+
+void log_init(void) {
+  if (logger.started)
+    return;
+  pthread_key_create(&logger.key, release_ring);
+  logger.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (logger.wake_fd < 0)
+    return;
+
+  atomic_store(&logger.running, true);
+  if (pthread_create(&logger.thread, NULL, log_writer_thread, NULL) != 0) {
+    close(logger.wake_fd);
+    logger.wake_fd = -1;
     return;
   }
+  logger.started = true;
+  atomic_store(&logger.accepting, true);
+  atexit(flush_at_exit);
+}
+
+void log_shutdown(void) {
+  if (!logger.started)
+    return;
+  atomic_store(&logger.accepting, false);
+  atomic_store(&logger.running, false);
+  uint64_t one = 1;
+  if (write(logger.wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("log wakeup");
+  pthread_join(logger.thread, NULL);
+  logger.started = false;
+
+  pthread_mutex_lock(&logger.emit_lock);
+  drain_rings();
+  pthread_mutex_unlock(&logger.emit_lock);
+  close(logger.wake_fd);
+  logger.wake_fd = -1;
+}
 
-  update_history(message_buffer);
+size_t log_dropped_records(void) {
+  size_t dropped = 0;
+  for (LogRing *ring = atomic_load_explicit(&logger.rings, memory_order_acquire);
+       ring; ring = ring->next)
+    dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+  return dropped;
+}
+
+static void log_message(LogLevel level, const char *format, va_list args) {
+  if (level < current_log_level)
+    return;
 
-  time_t now;
-  struct tm *timeinfo;
-  char timestamp[20];
-  time(&now);
-  timeinfo = localtime(&now);
-  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", timeinfo);
+  _Alignas(8) unsigned char storage[sizeof(LogRecord) + LOG_RECORD_MAX];
+  LogRecord *record = (LogRecord *)storage;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  record->type = RECORD_MESSAGE;
+  record->level = (uint8_t)level;
+  record->timestamp_ns =
+      (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+  record->format = format;
+
+  Packer packer = {.data = record->data, .capacity = LOG_RECORD_MAX};
+  pack_arguments(&packer, format, args);
+  record->length = (uint16_t)packer.length;
+  record->size = (uint32_t)((sizeof(LogRecord) + packer.length + 7) & ~7u);
+
+  if (atomic_load_explicit(&logger.accepting, memory_order_acquire)) {
+    LogRing *ring = local_ring ? local_ring : attach_ring();
+    if (ring) {
+      if (ring_push(ring, record) &&
+          atomic_load_explicit(&logger.idle, memory_order_relaxed) &&
+          atomic_exchange(&logger.idle, false)) {
+        uint64_t one = 1;
+        if (write(logger.wake_fd, &one, sizeof(one)) < 0) {
+          /* The writer's poll timeout covers a failed wakeup. */
+        }
+      }
+      return;
+    }
+  }
 
-  fprintf(stderr, "[%s] %s[INFO]%s %s%s\n", timestamp, ANSI_GREEN, ANSI_RESET,
-          message_buffer, ANSI_RESET);
+  pthread_mutex_lock(&logger.emit_lock);
+  emit_record(record);
+  flush_batch();
+  pthread_mutex_unlock(&logger.emit_lock);
 }
 
 void log_debug(const char *format, ...) {
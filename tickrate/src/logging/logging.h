@@ -1,6 +1,8 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <stddef.h>
+
 typedef enum {
     LOG_LEVEL_DEBUG,
     LOG_LEVEL_INFO,
@@ -9,10 +11,21 @@ typedef enum {
     LOG_LEVEL_NONE
 } LogLevel;
 
+/*
+ * Callers only pack a binary record (format pointer plus arguments) into a
+ * per-thread ring; a background writer formats, deduplicates and writes
+ * them in batches. Format strings must therefore be string literals. When a
+ * ring is full the record is dropped and counted instead of blocking. Before
+ * log_init() and after log_shutdown() records are written synchronously.
+ */
+void log_init(void);
+void log_shutdown(void);
+size_t log_dropped_records(void);
+
 void set_log_level(LogLevel level);
-void log_debug(const char *format, ...);
-void log_info(const char *format, ...);
-void log_warn(const char *format, ...);
-void log_error(const char *format, ...);
+void log_debug(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_info(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_warn(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void log_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
-#endif
\ No newline at end of file
+#endif
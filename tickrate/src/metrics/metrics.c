@@ -0,0 +1,404 @@
+#include "metrics.h"
+#include "../logging/logging.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum { LABEL_CALLS, LABEL_ERRORS, LABEL_NS, LABEL_FIELDS };
+
+typedef struct MetricsShard {
+  _Alignas(64) atomic_uint_fast64_t counters[METRIC_COUNTER_COUNT];
+  atomic_uint_fast64_t labeled[METRIC_FAMILY_COUNT][METRICS_MAX_LABELS]
+                              [LABEL_FIELDS];
+  bool in_use;
+  struct MetricsShard *next;
+} MetricsShard;
+
+typedef struct MetricsLabels {
+  atomic_size_t count;
+  char names[METRICS_MAX_LABELS][METRICS_LABEL_LENGTH];
+} MetricsLabels;
+
+typedef struct MetricsGauge {
+  const char *name;
+  const char *help;
+  MetricsGaugeFn fn;
+  void *ctx;
+} MetricsGauge;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_key_t key;
+  MetricsShard *shards;
+  MetricsLabels labels[METRIC_FAMILY_COUNT];
+  MetricsGauge gauges[METRICS_MAX_GAUGES];
+  size_t gauge_count;
+  uint64_t started_ns;
+  uint64_t sample_ns;
+  uint64_t sample[METRIC_COUNTER_COUNT];
+} metrics = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static _Thread_local MetricsShard *local_shard;
+
+static void release_shard(void *arg) {
+  MetricsShard *shard = arg;
+  pthread_mutex_lock(&metrics.lock);
+  shard->in_use = false;
+  pthread_mutex_unlock(&metrics.lock);
+}
+
+static MetricsShard *attach_shard(void) {
+  pthread_mutex_lock(&metrics.lock);
+  MetricsShard *shard = metrics.shards;
+  while (shard && shard->in_use)
+    shard = shard->next;
+  if (!shard) {
+    shard = aligned_alloc(64, sizeof(MetricsShard));
+    if (!shard) {
+      pthread_mutex_unlock(&metrics.lock);
+      log_error("Metrics shard allocation failed");
+      return NULL;
+    }
+    memset(shard, 0, sizeof(MetricsShard));
+    shard->next = metrics.shards;
+    metrics.shards = shard;
+  }
+  shard->in_use = true;
+  pthread_mutex_unlock(&metrics.lock);
+
+  pthread_setspecific(metrics.key, shard);
+  local_shard = shard;
+  return shard;
+}
+
+static inline void shard_add(atomic_uint_fast64_t *slot, uint64_t value) {
+  /* Single writer: no read-modify-write needed. */
+  atomic_store_explicit(
+      slot, atomic_load_explicit(slot, memory_order_relaxed) + value,
+      memory_order_relaxed);
+}
+
+void metrics_init(void) {
+  pthread_key_create(&metrics.key, release_shard);
+  for (int family = 0; family < METRIC_FAMILY_COUNT; family++) {
+    MetricsLabels *labels = &metrics.labels[family];
+    /* The last slot is reserved for labels that no longer fit. */
+    snprintf(labels->names[METRICS_MAX_LABELS - 1], METRICS_LABEL_LENGTH, "%s",
+             METRICS_OTHER_LABEL);
+    atomic_init(&labels->count, 0);
+  }
+  metrics.started_ns = metrics.sample_ns = metrics_now_ns();
+}
+
+uint64_t metrics_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void metrics_add(MetricCounter counter, uint64_t value) {
+  MetricsShard *shard = local_shard ? local_shard : attach_shard();
+  if (shard)
+    shard_add(&shard->counters[counter], value);
+}
+
+static size_t intern_label(MetricsLabels *labels, const char *name) {
+  size_t count = atomic_load_explicit(&labels->count, memory_order_acquire);
+  for (size_t i = 0; i < count; i++) {
+    if (strncmp(labels->names[i], name, METRICS_LABEL_LENGTH - 1) == 0)
+      return i;
+  }
+
+  pthread_mutex_lock(&metrics.lock);
+  count = atomic_load_explicit(&labels->count, memory_order_relaxed);
+  size_t index = METRICS_MAX_LABELS - 1;
+  for (size_t i = 0; i < count; i++) {
+    if (strncmp(labels->names[i], name, METRICS_LABEL_LENGTH - 1) == 0) {
+      index = i;
+      break;
+    }
+  }
+  if (index == METRICS_MAX_LABELS - 1 && count < METRICS_MAX_LABELS - 1) {
+    snprintf(labels->names[count], METRICS_LABEL_LENGTH, "%s", name);
+    atomic_store_explicit(&labels->count, count + 1, memory_order_release);
+    index = count;
+  }
+  pthread_mutex_unlock(&metrics.lock);
+  return index;
+}
+
+void metrics_observe(MetricFamily family, const char *label, uint64_t ns,
+                     bool error) {
+  MetricsShard *shard = local_shard ? local_shard : attach_shard();
+  if (!shard || !label)
+    return;
+  atomic_uint_fast64_t *slot =
+      shard->labeled[family][intern_label(&metrics.labels[family], label)];
+  shard_add(&slot[LABEL_CALLS], 1);
+  shard_add(&slot[LABEL_NS], ns);
+  if (error)
+    shard_add(&slot[LABEL_ERRORS], 1);
+}
+
+bool metrics_register_gauge(const char *name, const char *help,
+                            MetricsGaugeFn fn, void *ctx) {
+  pthread_mutex_lock(&metrics.lock);
+  bool registered = metrics.gauge_count < METRICS_MAX_GAUGES;
+  if (registered) {
+    metrics.gauges[metrics.gauge_count++] =
+        (MetricsGauge){.name = name, .help = help, .fn = fn, .ctx = ctx};
+  } else {
+    log_warn("Too many metrics gauges, dropping %s", name);
+  }
+  pthread_mutex_unlock(&metrics.lock);
+  return registered;
+}
+
+void metrics_snapshot(MetricsSnapshot *snapshot) {
+  memset(snapshot, 0, sizeof(*snapshot));
+  snapshot->uptime = (metrics_now_ns() - metrics.started_ns) / 1e9;
+
+  for (int family = 0; family < METRIC_FAMILY_COUNT; family++) {
+    MetricsLabels *labels = &metrics.labels[family];
+    size_t count = atomic_load_explicit(&labels->count, memory_order_acquire);
+    for (size_t i = 0; i < count; i++)
+      memcpy(snapshot->labels[family][i].name, labels->names[i],
+             METRICS_LABEL_LENGTH);
+    memcpy(snapshot->labels[family][METRICS_MAX_LABELS - 1].name,
+           labels->names[METRICS_MAX_LABELS - 1], METRICS_LABEL_LENGTH);
+  }
+
+  pthread_mutex_lock(&metrics.lock);
+  for (MetricsShard *shard = metrics.shards; shard; shard = shard->next) {
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+      snapshot->counters[i] +=
+          atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+    for (int family = 0; family < METRIC_FAMILY_COUNT; family++) {
+      for (size_t i = 0; i < METRICS_MAX_LABELS; i++) {
+        MetricsLabelStats *stats = &snapshot->labels[family][i];
+        atomic_uint_fast64_t *slot = shard->labeled[family][i];
+        stats->calls +=
+            atomic_load_explicit(&slot[LABEL_CALLS], memory_order_relaxed);
+        stats->errors +=
+            atomic_load_explicit(&slot[LABEL_ERRORS], memory_order_relaxed);
+        stats->total_ns +=
+            atomic_load_explicit(&slot[LABEL_NS], memory_order_relaxed);
+      }
+    }
+  }
+
+  snapshot->gauge_count = metrics.gauge_count;
+  for (size_t i = 0; i < metrics.gauge_count; i++) {
+    MetricsGauge *gauge = &metrics.gauges[i];
+    snapshot->gauges[i] = (MetricsGaugeValue){
+        .name = gauge->name, .help = gauge->help, .value = gauge->fn(gauge->ctx)};
+  }
+  pthread_mutex_unlock(&metrics.lock);
+
+  /* The overflow label sits in the last slot and only counts once used. */
+  for (int family = 0; family < METRIC_FAMILY_COUNT; family++) {
+    size_t count = atomic_load_explicit(&metrics.labels[family].count,
+                                        memory_order_acquire);
+    if (snapshot->labels[family][METRICS_MAX_LABELS - 1].calls > 0)
+      count = METRICS_MAX_LABELS;
+    snapshot->label_count[family] = count;
+  }
+}
+
+/*
+ * Per-second rates against the previous sample. The sample only moves once
+ * a second has passed, so back-to-back readers still see a meaningful window.
+ */
+void metrics_rates(const MetricsSnapshot *snapshot, MetricsRates *rates) {
+  uint64_t now = metrics_now_ns();
+  pthread_mutex_lock(&metrics.lock);
+  double interval = (now - metrics.sample_ns) / 1e9;
+  const uint64_t *previous = metrics.sample;
+  const uint64_t *current = snapshot->counters;
+  rates->interval = interval;
+  if (interval > 0) {
+    rates->bytes_in = (current[METRIC_BYTES_IN] - previous[METRIC_BYTES_IN]) / interval;
+    rates->bytes_out = (current[METRIC_BYTES_OUT] - previous[METRIC_BYTES_OUT]) / interval;
+    rates->frames_in = (current[METRIC_FRAMES_IN] - previous[METRIC_FRAMES_IN]) / interval;
+    rates->frames_out = (current[METRIC_FRAMES_OUT] - previous[METRIC_FRAMES_OUT]) / interval;
+  } else {
+    rates->bytes_in = rates->bytes_out = rates->frames_in = rates->frames_out = 0;
+  }
+  if (interval >= 1.0) {
+    memcpy(metrics.sample, current, sizeof(metrics.sample));
+    metrics.sample_ns = now;
+  }
+  pthread_mutex_unlock(&metrics.lock);
+}
+
+static bool append_format(JsonBuffer *out, const char *format, ...) {
+  char line[512];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length < 0)
+    return false;
+  if ((size_t)length >= sizeof(line))
+    length = sizeof(line) - 1;
+  return json_buffer_append(out, line, (size_t)length);
+}
+
+static void escape_label(char *dest, size_t size, const char *src) {
+  size_t j = 0;
+  for (size_t i = 0; src[i] && j + 2 < size; i++) {
+    char c = src[i];
+    if (c == '\\' || c == '"') {
+      dest[j++] = '\\';
+      dest[j++] = c;
+    } else if (c == '\n') {
+      dest[j++] = '\\';
+      dest[j++] = 'n';
+    } else {
+      dest[j++] = c;
+    }
+  }
+  dest[j] = '\0';
+}
+
+static bool render_counter(JsonBuffer *out, const char *name, const char *type,
+                           const char *help, uint64_t value) {
+  return append_format(out, "# HELP tickrate_%s %s\n# TYPE tickrate_%s %s\n",
+                       name, help, name, type) &&
+         append_format(out, "tickrate_%s %llu\n", name,
+                       (unsigned long long)value);
+}
+
+static bool render_summary(JsonBuffer *out, const char *name, const char *help,
+                           uint64_t count, uint64_t total_ns) {
+  return append_format(out, "# HELP tickrate_%s %s\n# TYPE tickrate_%s summary\n",
+                       name, help, name) &&
+         append_format(out, "tickrate_%s_sum %.9f\ntickrate_%s_count %llu\n",
+                       name, total_ns / 1e9, name, (unsigned long long)count);
+}
+
+static bool render_family(JsonBuffer *out, const MetricsSnapshot *snapshot,
+                          MetricFamily family, const char *prefix,
+                          const char *label, const char *what) {
+  size_t count = snapshot->label_count[family];
+  if (!append_format(out,
+                     "# HELP tickrate_%s_total %s calls\n"
+                     "# TYPE tickrate_%s_total counter\n",
+                     prefix, what, prefix))
+    return false;
+  for (size_t i = 0; i < count; i++) {
+    const MetricsLabelStats *stats = &snapshot->labels[family][i];
+    char name[2 * METRICS_LABEL_LENGTH];
+    escape_label(name, sizeof(name), stats->name);
+    if (!append_format(out, "tickrate_%s_total{%s=\"%s\"} %llu\n", prefix,
+                       label, name, (unsigned long long)stats->calls))
+      return false;
+  }
+
+  if (!append_format(out,
+                     "# HELP tickrate_%s_errors_total %s failures\n"
+                     "# TYPE tickrate_%s_errors_total counter\n",
+                     prefix, what, prefix))
+    return false;
+  for (size_t i = 0; i < count; i++) {
+    const MetricsLabelStats *stats = &snapshot->labels[family][i];
+    char name[2 * METRICS_LABEL_LENGTH];
+    escape_label(name, sizeof(name), stats->name);
+    if (!append_format(out, "tickrate_%s_errors_total{%s=\"%s\"} %llu\n",
+                       prefix, label, name, (unsigned long long)stats->errors))
+      return false;
+  }
+
+  if (!append_format(out,
+                     "# HELP tickrate_%s_seconds %s time\n"
+                     "# TYPE tickrate_%s_seconds summary\n",
+                     prefix, what, prefix))
+    return false;
+  for (size_t i = 0; i < count; i++) {
+    const MetricsLabelStats *stats = &snapshot->labels[family][i];
+    char name[2 * METRICS_LABEL_LENGTH];
+    escape_label(name, sizeof(name), stats->name);
+    if (!append_format(out,
+                       "tickrate_%s_seconds_sum{%s=\"%s\"} %.9f\n"
+                       "tickrate_%s_seconds_count{%s=\"%s\"} %llu\n",
+                       prefix, label, name, stats->total_ns / 1e9, prefix,
+                       label, name, (unsigned long long)stats->calls))
+      return false;
+  }
+  return true;
+}
+
+bool metrics_render_prometheus(const MetricsSnapshot *snapshot,
+                               JsonBuffer *out) {
+  const uint64_t *c = snapshot->counters;
+  bool ok =
+      append_format(out,
+                    "# HELP tickrate_uptime_seconds Seconds since start\n"
+                    "# TYPE tickrate_uptime_seconds gauge\n"
+                    "tickrate_uptime_seconds %.3f\n",
+                    snapshot->uptime) &&
+      render_counter(out, "bytes_received_total", "counter",
+                     "Bytes read from clients", c[METRIC_BYTES_IN]) &&
+      render_counter(out, "bytes_sent_total", "counter",
+                     "Bytes written to clients", c[METRIC_BYTES_OUT]) &&
+      render_counter(out, "frames_received_total", "counter",
+                     "Frames read from clients", c[METRIC_FRAMES_IN]) &&
+      render_counter(out, "frames_sent_total", "counter",
+                     "Frames written to clients", c[METRIC_FRAMES_OUT]) &&
+      render_counter(out, "connections_accepted_total", "counter",
+                     "Client connections accepted",
+                     c[METRIC_CONNECTIONS_ACCEPTED]) &&
+      render_counter(out, "connections_open", "gauge",
+                     "Client connections currently open",
+                     c[METRIC_CONNECTIONS_ACCEPTED] -
+                         c[METRIC_CONNECTIONS_CLOSED]) &&
+      render_summary(out, "json_parse_seconds", "Time spent parsing JSON",
+                     c[METRIC_JSON_PARSE_COUNT], c[METRIC_JSON_PARSE_NS]) &&
+      render_counter(out, "json_parse_errors_total", "counter",
+                     "JSON documents that failed to parse",
+                     c[METRIC_JSON_PARSE_ERRORS]) &&
+      render_summary(out, "json_encode_seconds", "Time spent encoding JSON",
+                     c[METRIC_JSON_ENCODE_COUNT], c[METRIC_JSON_ENCODE_NS]) &&
+      render_counter(out, "json_encode_errors_total", "counter",
+                     "Values that failed to encode as JSON",
+                     c[METRIC_JSON_ENCODE_ERRORS]) &&
+      render_counter(out, "commands_unknown_total", "counter",
+                     "Commands requested that are not registered",
+                     c[METRIC_COMMANDS_UNKNOWN]) &&
+      render_counter(out, "writes_deferred_total", "counter",
+                     "Writes that found the socket full and queued output",
+                     c[METRIC_WRITES_DEFERRED]) &&
+      render_counter(out, "reads_paused_total", "counter",
+                     "Times a connection stopped being read for backpressure",
+                     c[METRIC_READS_PAUSED]) &&
+      render_counter(out, "frames_compressed_total", "counter",
+                     "Outgoing frames sent deflated",
+                     c[METRIC_FRAMES_COMPRESSED]) &&
+      render_counter(out, "compression_saved_bytes_total", "counter",
+                     "Bytes deflate kept off the wire for outgoing frames",
+                     c[METRIC_COMPRESSION_SAVED_BYTES]) &&
+      render_counter(out, "requests_shed_total", "counter",
+                     "Requests answered overloaded instead of queued",
+                     c[METRIC_REQUESTS_SHED]) &&
+      render_counter(out, "script_reloads_total", "counter",
+                     "Script generations published after startup",
+                     c[METRIC_SCRIPT_RELOADS]) &&
+      render_family(out, snapshot, METRIC_FAMILY_COMMAND, "command", "command",
+                    "Lua command") &&
+      render_family(out, snapshot, METRIC_FAMILY_HTTP_HOST, "http_request",
+                    "host", "Outgoing HTTP request");
+
+  for (size_t i = 0; ok && i < snapshot->gauge_count; i++) {
+    const MetricsGaugeValue *gauge = &snapshot->gauges[i];
+    ok = append_format(out,
+                       "# HELP tickrate_%s %s\n# TYPE tickrate_%s gauge\n"
+                       "tickrate_%s %.17g\n",
+                       gauge->name, gauge->help, gauge->name, gauge->name,
+                       gauge->value);
+  }
+  return ok;
+}
@@ -0,0 +1,93 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "../json/json.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_MAX_LABELS 64
+#define METRICS_LABEL_LENGTH 64
+#define METRICS_MAX_GAUGES 16
+#define METRICS_OTHER_LABEL "other"
+
+typedef enum {
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_FRAMES_IN,
+    METRIC_FRAMES_OUT,
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_JSON_PARSE_COUNT,
+    METRIC_JSON_PARSE_NS,
+    METRIC_JSON_PARSE_ERRORS,
+    METRIC_JSON_ENCODE_COUNT,
+    METRIC_JSON_ENCODE_NS,
+    METRIC_JSON_ENCODE_ERRORS,
+    METRIC_COMMANDS_UNKNOWN,
+    METRIC_WRITES_DEFERRED,
+    METRIC_READS_PAUSED,
+    METRIC_FRAMES_COMPRESSED,
+    METRIC_COMPRESSION_SAVED_BYTES,
+    METRIC_REQUESTS_SHED,
+    METRIC_SCRIPT_RELOADS,
+    METRIC_COUNTER_COUNT
+} MetricCounter;
+
+typedef enum {
+    METRIC_FAMILY_COMMAND,
+    METRIC_FAMILY_HTTP_HOST,
+    METRIC_FAMILY_COUNT
+} MetricFamily;
+
+typedef double (*MetricsGaugeFn)(void *ctx);
+
+typedef struct MetricsLabelStats {
+    char name[METRICS_LABEL_LENGTH];
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t total_ns;
+} MetricsLabelStats;
+
+typedef struct MetricsGaugeValue {
+    const char *name;
+    const char *help;
+    double value;
+} MetricsGaugeValue;
+
+typedef struct MetricsSnapshot {
+    double uptime;
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    size_t label_count[METRIC_FAMILY_COUNT];
+    MetricsLabelStats labels[METRIC_FAMILY_COUNT][METRICS_MAX_LABELS];
+    size_t gauge_count;
+    MetricsGaugeValue gauges[METRICS_MAX_GAUGES];
+} MetricsSnapshot;
+
+typedef struct MetricsRates {
+    double interval;
+    double bytes_in;
+    double bytes_out;
+    double frames_in;
+    double frames_out;
+} MetricsRates;
+
+/*
+ * Counters live in per-thread shards that only their owner writes, so an
+ * update is a relaxed load and store on a thread-local cache line with no
+ * shared traffic. Readers sum every shard. Shards of exited threads are kept
+ * and handed to the next new thread, so totals never go backwards. Labels
+ * (command names, HTTP hosts) are interned into a fixed table per family;
+ * once it is full, new labels are folded into "other".
+ */
+void metrics_init(void);
+uint64_t metrics_now_ns(void);
+void metrics_add(MetricCounter counter, uint64_t value);
+void metrics_observe(MetricFamily family, const char *label, uint64_t ns, bool error);
+bool metrics_register_gauge(const char *name, const char *help, MetricsGaugeFn fn, void *ctx);
+
+void metrics_snapshot(MetricsSnapshot *snapshot);
+void metrics_rates(const MetricsSnapshot *snapshot, MetricsRates *rates);
+bool metrics_render_prometheus(const MetricsSnapshot *snapshot, JsonBuffer *out);
+
+#endif
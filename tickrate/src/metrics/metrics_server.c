@@ -0,0 +1,176 @@
+#include "metrics_server.h"
+#include "metrics.h"
+#include "../logging/logging.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static struct {
+  int fd;
+  pthread_t thread;
+  atomic_bool running;
+  bool started;
+} server = {.fd = -1};
+
+static bool write_all(int fd, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += written;
+    length -= (size_t)written;
+  }
+  return true;
+}
+
+static bool read_request_line(int fd, char *line, size_t size) {
+  size_t length = 0;
+  while (length + 1 < size) {
+    ssize_t received = recv(fd, line + length, size - length - 1, 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+      return false;
+    length += (size_t)received;
+    line[length] = '\0';
+    if (strstr(line, "\r\n\r\n") || strstr(line, "\n\n"))
+      return true;
+  }
+  return false;
+}
+
+static void send_status(int fd, const char *status) {
+  char response[256];
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.1 %s\r\nContent-Length: 0\r\n"
+                        "Connection: close\r\n\r\n",
+                        status);
+  write_all(fd, response, (size_t)length);
+}
+
+static void serve_client(int fd) {
+  struct timeval timeout = {.tv_sec = 1};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  char request[METRICS_REQUEST_MAX];
+  if (!read_request_line(fd, request, sizeof(request))) {
+    send_status(fd, "400 Bad Request");
+    return;
+  }
+  if (strncmp(request, "GET ", 4) != 0) {
+    send_status(fd, "405 Method Not Allowed");
+    return;
+  }
+  if (strncmp(request + 4, "/metrics", 8) != 0 ||
+      (request[12] != ' ' && request[12] != '?')) {
+    send_status(fd, "404 Not Found");
+    return;
+  }
+
+  MetricsSnapshot *snapshot = malloc(sizeof(MetricsSnapshot));
+  JsonBuffer body;
+  json_buffer_init(&body, 8192);
+  if (!snapshot || !body.data) {
+    free(snapshot);
+    free(body.data);
+    send_status(fd, "500 Internal Server Error");
+    return;
+  }
+  metrics_snapshot(snapshot);
+  bool rendered = metrics_render_prometheus(snapshot, &body);
+  free(snapshot);
+  if (!rendered) {
+    free(body.data);
+    send_status(fd, "500 Internal Server Error");
+    return;
+  }
+
+  char header[256];
+  int length = snprintf(header, sizeof(header),
+                        "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                        body.length);
+  if (write_all(fd, header, (size_t)length))
+    write_all(fd, body.data, body.length);
+  free(body.data);
+}
+
+static void *metrics_server_thread(void *arg) {
+  (void)arg;
+  struct pollfd listener = {.fd = server.fd, .events = POLLIN};
+  while (atomic_load(&server.running)) {
+    int ready = poll(&listener, 1, METRICS_POLL_MS);
+    if (ready < 0 && errno != EINTR) {
+      log_error("Metrics poll failed: %s", strerror(errno));
+      break;
+    }
+    if (ready <= 0)
+      continue;
+
+    int client = accept(server.fd, NULL, NULL);
+    if (client < 0) {
+      if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+        log_warn("Metrics accept failed: %s", strerror(errno));
+      continue;
+    }
+    serve_client(client);
+    close(client);
+  }
+  return NULL;
+}
+
+bool metrics_server_start(uint16_t port) {
+  server.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server.fd < 0) {
+    log_error("Metrics socket creation failed: %s", strerror(errno));
+    return false;
+  }
+
+  int yes = 1;
+  setsockopt(server.fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  struct sockaddr_in address = {.sin_family = AF_INET,
+                                .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  if (bind(server.fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(server.fd, 16) < 0) {
+    log_error("Metrics endpoint bind failed on port %u: %s", port,
+              strerror(errno));
+    close(server.fd);
+    server.fd = -1;
+    return false;
+  }
+
+  atomic_store(&server.running, true);
+  if (pthread_create(&server.thread, NULL, metrics_server_thread, NULL) != 0) {
+    log_error("Metrics thread creation failed");
+    close(server.fd);
+    server.fd = -1;
+    return false;
+  }
+  server.started = true;
+  log_info("Metrics endpoint listening on 127.0.0.1:%u/metrics", port);
+  return true;
+}
+
+void metrics_server_stop(void) {
+  if (!server.started)
+    return;
+  atomic_store(&server.running, false);
+  pthread_join(server.thread, NULL);
+  close(server.fd);
+  server.fd = -1;
+  server.started = false;
+}
@@ -0,0 +1,15 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define METRICS_PORT 27017
+#define METRICS_POLL_MS 500
+#define METRICS_REQUEST_MAX 4096
+
+/* Serves Prometheus text format on 127.0.0.1:port from its own thread. */
+bool metrics_server_start(uint16_t port);
+void metrics_server_stop(void);
+
+#endif
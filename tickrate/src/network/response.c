@@ -1,52 +1,244 @@
 #include "response.h"
+#include "../socket/socket.h"
 #include "../logging/logging.h"
-#include <unistd.h>
+#include "../metrics/metrics.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/types.h>
-#include <stdio.h>
-#include <errno.h>
 
-#define MESSAGE_DELIMITER '\x1e'
-#define MAX_RESPONSE_SIZE 8192
+typedef struct OutputChunk {
+  struct OutputChunk * next;
+  size_t capacity;
+  size_t length;
+  size_t offset;
+  char data[];
+} OutputChunk;
+
+static atomic_size_t buffered_bytes;
+
+static ssize_t write_iov(ClientData * client, struct iovec * iov, int count) {
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = (size_t) count};
+  for (;;) {
+    ssize_t written = sendmsg(client -> socket, & msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (written >= 0 || errno != EINTR) return written;
+  }
+}
 
-void send_response(int client_fd,
-  const char * response) {
-  if (client_fd < 0 || !response) return;
+/* Caller holds write_lock. */
+static void update_interest(ClientData * client) {
+  uint32_t events = EPOLLRDHUP | EPOLLET;
+  if (!client -> reading_paused) events |= EPOLLIN;
+  if (client -> output_head) events |= EPOLLOUT;
+  if (events == client -> interest || atomic_load( & client -> closed)) return;
 
-  char full_message[MAX_RESPONSE_SIZE];
-  int written = snprintf(full_message, sizeof(full_message),
-    "%s%c", response, MESSAGE_DELIMITER);
+  struct epoll_event ev = {.events = events, .data.ptr = client};
+  if (epoll_ctl(client -> sh -> epoll_fd, EPOLL_CTL_MOD, client -> socket, & ev) == 0) {
+    client -> interest = events;
+  } else if (errno != ENOENT) {
+    log_error("Failed to update epoll interest for client %d: %s",
+      client -> socket, strerror(errno));
+  }
+}
 
-  if (written < 0 || (size_t) written >= sizeof(full_message)) {
-    log_error("Response truncation for client %d", client_fd);
-    return;
+static bool append_output(ClientData * client, const char * data, size_t length) {
+  OutputChunk * tail = client -> output_tail;
+  if (tail && tail -> capacity > tail -> length) {
+    size_t room = tail -> capacity - tail -> length;
+    size_t take = length < room ? length : room;
+    memcpy(tail -> data + tail -> length, data, take);
+    tail -> length += take;
+    client -> output_bytes += take;
+    atomic_fetch_add( & buffered_bytes, take);
+    data += take;
+    length -= take;
   }
+  if (length == 0) return true;
 
-  size_t total_length = strlen(full_message);
-  ssize_t bytes_sent = 0;
+  size_t capacity = length > OUTPUT_CHUNK_SIZE ? length : OUTPUT_CHUNK_SIZE;
+  OutputChunk * chunk = malloc(sizeof(OutputChunk) + capacity);
+  if (!chunk) {
+    log_error("Failed to allocate output buffer for client %d", client -> socket);
+    return false;
+  }
+  chunk -> next = NULL;
+  chunk -> capacity = capacity;
+  chunk -> length = length;
+  chunk -> offset = 0;
+  memcpy(chunk -> data, data, length);
 
-  while (bytes_sent < (ssize_t) total_length) {
-    ssize_t result = write(client_fd, full_message + bytes_sent,
-      total_length - bytes_sent);
+  if (tail) tail -> next = chunk;
+  else client -> output_head = chunk;
+  client -> output_tail = chunk;
+  client -> output_bytes += length;
+  atomic_fetch_add( & buffered_bytes, length);
+  return true;
+}
 
-    if (result <= 0) {
+static void consume_output(ClientData * client, size_t written) {
+  client -> output_bytes -= written;
+  atomic_fetch_sub( & buffered_bytes, written);
+  while (written > 0) {
+    OutputChunk * head = client -> output_head;
+    size_t pending = head -> length - head -> offset;
+    if (written < pending) {
+      head -> offset += written;
+      return;
+    }
+    written -= pending;
+    client -> output_head = head -> next;
+    if (!client -> output_head) client -> output_tail = NULL;
+    free(head);
+  }
+}
+
+static void discard_locked(ClientData * client) {
+  OutputChunk * chunk = client -> output_head;
+  while (chunk) {
+    OutputChunk * next = chunk -> next;
+    free(chunk);
+    chunk = next;
+  }
+  atomic_fetch_sub( & buffered_bytes, client -> output_bytes);
+  client -> output_head = client -> output_tail = NULL;
+  client -> output_bytes = 0;
+}
+
+/* Hand the connection to the listener to tear down; it sees the hangup. */
+static void abort_connection(ClientData * client) {
+  discard_locked(client);
+  shutdown(client -> socket, SHUT_RDWR);
+}
+
+/* Caller holds write_lock. */
+static bool flush_locked(ClientData * client) {
+  while (client -> output_head) {
+    struct iovec iov[OUTPUT_IOV_MAX];
+    int count = 0;
+    for (OutputChunk * chunk = client -> output_head; chunk && count < OUTPUT_IOV_MAX;
+      chunk = chunk -> next) {
+      iov[count].iov_base = chunk -> data + chunk -> offset;
+      iov[count].iov_len = chunk -> length - chunk -> offset;
+      count++;
+    }
+
+    ssize_t written = write_iov(client, iov, count);
+    if (written < 0) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        log_warn("Write blocked for client %d, retrying...", client_fd);
-        usleep(10000);
-        continue;
+        metrics_add(METRIC_WRITES_DEFERRED, 1);
+        break;
       }
-      log_error("Failed to send response to client %d: %s",
-        client_fd, strerror(errno));
-      break;
+      log_error("Failed to flush output to client %d: %s", client -> socket,
+        strerror(errno));
+      abort_connection(client);
+      return false;
+    }
+    metrics_add(METRIC_BYTES_OUT, (uint64_t) written);
+    consume_output(client, (size_t) written);
+  }
+
+  if (client -> reading_paused && client -> output_bytes <= OUTPUT_LOW_WATERMARK) {
+    client -> reading_paused = false;
+    log_debug("Resuming reads from client %d", client -> socket);
+  }
+  update_interest(client);
+  return true;
+}
+
+bool response_write(ClientData * client, const struct iovec * iov, int count) {
+  struct iovec pending[OUTPUT_IOV_MAX];
+  size_t total = 0;
+  if (count > OUTPUT_IOV_MAX) return false;
+  for (int i = 0; i < count; i++) {
+    pending[i] = iov[i];
+    total += iov[i].iov_len;
+  }
+  metrics_add(METRIC_FRAMES_OUT, 1);
+
+  pthread_mutex_lock( & client -> write_lock);
+  if (atomic_load( & client -> closed)) {
+    pthread_mutex_unlock( & client -> write_lock);
+    return false;
+  }
+
+  size_t sent = 0;
+  if (!client -> output_head && client -> cork == 0) {
+    ssize_t written = write_iov(client, pending, count);
+    if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      log_error("Failed to send response on socket %d: %s", client -> socket,
+        strerror(errno));
+      pthread_mutex_unlock( & client -> write_lock);
+      return false;
+    }
+    if (written > 0) {
+      metrics_add(METRIC_BYTES_OUT, (uint64_t) written);
+      sent = (size_t) written;
     }
+    if (sent == total) {
+      pthread_mutex_unlock( & client -> write_lock);
+      return true;
+    }
+    metrics_add(METRIC_WRITES_DEFERRED, 1);
+  }
 
-    bytes_sent += result;
+  bool ok = true;
+  for (int i = 0; ok && i < count; i++) {
+    if (sent >= pending[i].iov_len) {
+      sent -= pending[i].iov_len;
+      continue;
+    }
+    ok = append_output(client, (const char * ) pending[i].iov_base + sent,
+      pending[i].iov_len - sent);
+    sent = 0;
   }
 
-  if (bytes_sent == (ssize_t) total_length) {
-    log_debug("Successfully sent %zd bytes to client %d", bytes_sent, client_fd);
-  } else {
-    log_error("Partial send to client %d (%zd/%zu bytes)",
-      client_fd, bytes_sent, total_length);
+  if (!ok || client -> output_bytes > OUTPUT_HARD_LIMIT) {
+    log_warn("Client %d fell %zu bytes behind, disconnecting", client -> socket,
+      client -> output_bytes);
+    abort_connection(client);
+    pthread_mutex_unlock( & client -> write_lock);
+    return false;
   }
+  if (!client -> reading_paused && client -> output_bytes > OUTPUT_HIGH_WATERMARK) {
+    client -> reading_paused = true;
+    metrics_add(METRIC_READS_PAUSED, 1);
+    log_debug("Pausing reads from client %d with %zu bytes queued",
+      client -> socket, client -> output_bytes);
+  }
+  /* A corked connection is flushed, and its interest updated, on uncork */
+  if (client -> cork == 0) update_interest(client);
+  pthread_mutex_unlock( & client -> write_lock);
+  return true;
+}
+
+bool response_flush(ClientData * client) {
+  pthread_mutex_lock( & client -> write_lock);
+  bool ok = client -> cork > 0 || flush_locked(client);
+  pthread_mutex_unlock( & client -> write_lock);
+  return ok;
+}
+
+void response_cork(ClientData * client) {
+  pthread_mutex_lock( & client -> write_lock);
+  client -> cork++;
+  pthread_mutex_unlock( & client -> write_lock);
+}
+
+void response_uncork(ClientData * client) {
+  pthread_mutex_lock( & client -> write_lock);
+  if (--client -> cork == 0 && !atomic_load( & client -> closed)) flush_locked(client);
+  pthread_mutex_unlock( & client -> write_lock);
+}
+
+void response_discard(ClientData * client) {
+  pthread_mutex_lock( & client -> write_lock);
+  discard_locked(client);
+  pthread_mutex_unlock( & client -> write_lock);
+}
+
+size_t response_buffered_bytes(void) {
+  return atomic_load( & buffered_bytes);
 }
@@ -1,6 +1,35 @@
 #ifndef RESPONSE_H
 #define RESPONSE_H
 
-void send_response(int client_fd, const char *response);
+#include "../socket/socket_pool.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define OUTPUT_CHUNK_SIZE 16384
+#define OUTPUT_IOV_MAX 64
+#define OUTPUT_HIGH_WATERMARK (1024 * 1024)
+#define OUTPUT_LOW_WATERMARK (256 * 1024)
+#define OUTPUT_HARD_LIMIT (64 * 1024 * 1024)
+
+/*
+ * Per-connection output. A response is written straight from the caller's
+ * buffers when nothing is queued ahead of it; whatever the socket does not
+ * take is copied into the connection's chunk chain and flushed with one
+ * gathered write once epoll reports the socket writable. Callers never
+ * block: a reader that falls behind past the high watermark has its
+ * connection's reads paused until the backlog drains below the low
+ * watermark, and one past the hard limit is disconnected.
+ *
+ * Corking a connection holds its replies back so that a run of them leaves
+ * in a single flush on uncork; the listener corks a connection while it
+ * reads, so the replies that reading produces go out together.
+ */
+bool response_write(ClientData *client, const struct iovec *iov, int count);
+bool response_flush(ClientData *client);
+void response_cork(ClientData *client);
+void response_uncork(ClientData *client);
+void response_discard(ClientData *client);
+size_t response_buffered_bytes(void);
 
 #endif
@@ -0,0 +1,165 @@
+#include "scan.h"
+#include "../logging/logging.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+typedef const char *(*ScanSpecialFn)(const char *p, const char *end);
+typedef const char *(*ScanByteFn)(const char *p, const char *end, char c);
+
+static inline int is_json_special(unsigned char c) {
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+static const char *scan_json_special_scalar(const char *p, const char *end) {
+  while (p < end && !is_json_special((unsigned char)*p))
+    p++;
+  return p;
+}
+
+static const char *scan_quote_or_backslash_scalar(const char *p,
+                                                  const char *end) {
+  while (p < end && *p != '"' && *p != '\\')
+    p++;
+  return p;
+}
+
+static const char *scan_byte_scalar(const char *p, const char *end, char c) {
+  const char *found = memchr(p, c, end - p);
+  return found ? found : end;
+}
+
+#ifdef SCAN_X86
+
+__attribute__((target("sse2"))) static const char *
+scan_json_special_sse2(const char *p, const char *end) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, backslash)),
+        _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask)
+      return p + __builtin_ctz((unsigned)mask);
+  }
+  return scan_json_special_scalar(p, end);
+}
+
+__attribute__((target("sse2"))) static const char *
+scan_quote_or_backslash_sse2(const char *p, const char *end) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    int mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+    if (mask)
+      return p + __builtin_ctz((unsigned)mask);
+  }
+  return scan_quote_or_backslash_scalar(p, end);
+}
+
+__attribute__((target("sse2"))) static const char *
+scan_byte_sse2(const char *p, const char *end, char c) {
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask)
+      return p + __builtin_ctz((unsigned)mask);
+  }
+  while (p < end && *p != c)
+    p++;
+  return p;
+}
+
+__attribute__((target("avx2"))) static const char *
+scan_json_special_avx2(const char *p, const char *end) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  for (; end - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hits = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                        _mm256_cmpeq_epi8(chunk, backslash)),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, control), chunk));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_json_special_sse2(p, end);
+}
+
+__attribute__((target("avx2"))) static const char *
+scan_quote_or_backslash_avx2(const char *p, const char *end) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  for (; end - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_quote_or_backslash_sse2(p, end);
+}
+
+__attribute__((target("avx2"))) static const char *
+scan_byte_avx2(const char *p, const char *end, char c) {
+  const __m256i needle = _mm256_set1_epi8(c);
+  for (; end - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+    unsigned mask =
+        (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_byte_sse2(p, end, c);
+}
+
+#endif
+
+static ScanSpecialFn json_special_impl = scan_json_special_scalar;
+static ScanSpecialFn quote_or_backslash_impl = scan_quote_or_backslash_scalar;
+static ScanByteFn byte_impl = scan_byte_scalar;
+static const char *impl_name = "scalar";
+
+void scan_init(void) {
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    json_special_impl = scan_json_special_avx2;
+    quote_or_backslash_impl = scan_quote_or_backslash_avx2;
+    byte_impl = scan_byte_avx2;
+    impl_name = "avx2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    json_special_impl = scan_json_special_sse2;
+    quote_or_backslash_impl = scan_quote_or_backslash_sse2;
+    byte_impl = scan_byte_sse2;
+    impl_name = "sse2";
+  }
+#endif
+  log_info("Byte scanning using %s kernels", impl_name);
+}
+
+const char *scan_implementation(void) { return impl_name; }
+
+const char *scan_json_special(const char *p, const char *end) {
+  return json_special_impl(p, end);
+}
+
+const char *scan_quote_or_backslash(const char *p, const char *end) {
+  return quote_or_backslash_impl(p, end);
+}
+
+const char *scan_byte(const char *p, const char *end, char c) {
+  return byte_impl(p, end, c);
+}
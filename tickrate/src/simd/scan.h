@@ -0,0 +1,19 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/*
+ * Byte scanning kernels used on the hot JSON and framing paths. Each function
+ * returns a pointer to the first matching byte in [p, end), or end if none.
+ * scan_init() picks the widest implementation the CPU supports; until it runs
+ * the scalar versions are used.
+ */
+void scan_init(void);
+const char* scan_implementation(void);
+
+const char* scan_json_special(const char *p, const char *end);
+const char* scan_quote_or_backslash(const char *p, const char *end);
+const char* scan_byte(const char *p, const char *end, char c);
+
+#endif
@@ -0,0 +1,204 @@
+#include "framing.h"
+#include "../compression/compression.h"
+#include "../json/msgpack.h"
+#include "../logging/logging.h"
+#include "../metrics/metrics.h"
+#include "../network/response.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#define TRANSCODE_BUFFER_INITIAL 4096
+#define TRANSCODE_BUFFER_RETAIN (1024 * 1024)
+
+static _Thread_local JsonBuffer transcode_buffer;
+
+size_t framing_encode_varint(uint64_t value, unsigned char *out) {
+  size_t length = 0;
+  while (value >= 0x80) {
+    out[length++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  out[length++] = (unsigned char)value;
+  return length;
+}
+
+VarintStatus framing_decode_varint(const unsigned char *data, size_t length,
+                                   uint64_t *value, size_t *header_length) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < FRAME_VARINT_MAX; i++) {
+    if (i == length)
+      return VARINT_INCOMPLETE;
+    result |= (uint64_t)(data[i] & 0x7f) << (7 * i);
+    if (!(data[i] & 0x80)) {
+      /* Reject padded encodings so every length has one representation */
+      if (i > 0 && data[i] == 0)
+        return VARINT_MALFORMED;
+      *value = result;
+      *header_length = i + 1;
+      return VARINT_OK;
+    }
+  }
+  return VARINT_MALFORMED;
+}
+
+bool framing_mode_from_name(const char *name, FramingMode *mode) {
+  if (!name)
+    return false;
+  if (strcmp(name, "delimited") == 0)
+    *mode = FRAMING_DELIMITED;
+  else if (strcmp(name, "length_prefixed") == 0)
+    *mode = FRAMING_LENGTH_PREFIXED;
+  else
+    return false;
+  return true;
+}
+
+bool payload_encoding_from_name(const char *name, PayloadEncoding *encoding) {
+  if (!name)
+    return false;
+  if (strcmp(name, "json") == 0)
+    *encoding = PAYLOAD_JSON;
+  else if (strcmp(name, "msgpack") == 0)
+    *encoding = PAYLOAD_MSGPACK;
+  else
+    return false;
+  return true;
+}
+
+const char *framing_mode_name(FramingMode mode) {
+  return mode == FRAMING_LENGTH_PREFIXED ? "length_prefixed" : "delimited";
+}
+
+const char *payload_encoding_name(PayloadEncoding encoding) {
+  return encoding == PAYLOAD_MSGPACK ? "msgpack" : "json";
+}
+
+JsonDocument *framing_parse_payload(PayloadEncoding encoding, char *data,
+                                    size_t length) {
+  if (encoding == PAYLOAD_MSGPACK)
+    return json_dom_parse_msgpack(data, length);
+  return json_dom_parse_in_situ(data, length);
+}
+
+/* Sends [length][flag][payload], or [length][flag][inflated length][zlib
+ * stream] when deflate shrinks the payload. */
+static bool send_compressible(ClientData *client, const char *payload,
+                              size_t length) {
+  unsigned char header[2 * FRAME_VARINT_MAX + 1];
+  unsigned char prefix[FRAME_VARINT_MAX + 1];
+  size_t prefix_length = 0;
+  const char *body = payload;
+  size_t body_length = length;
+
+  const char *deflated = NULL;
+  size_t deflated_length = 0;
+  if (length >= client->compression_threshold)
+    deflated = compression_deflate(payload, length, &deflated_length);
+  if (deflated && deflated_length + FRAME_VARINT_MAX < length) {
+    prefix[prefix_length++] = FRAME_FLAG_DEFLATE;
+    prefix_length += framing_encode_varint(length, prefix + prefix_length);
+    body = deflated;
+    body_length = deflated_length;
+    metrics_add(METRIC_FRAMES_COMPRESSED, 1);
+    metrics_add(METRIC_COMPRESSION_SAVED_BYTES,
+                length - deflated_length - prefix_length);
+  } else {
+    prefix[prefix_length++] = FRAME_FLAG_RAW;
+  }
+
+  size_t header_length =
+      framing_encode_varint(prefix_length + body_length, header);
+  memcpy(header + header_length, prefix, prefix_length);
+  header_length += prefix_length;
+  struct iovec iov[2] = {{.iov_base = header, .iov_len = header_length},
+                         {.iov_base = (void *)body, .iov_len = body_length}};
+  return response_write(client, iov, 2);
+}
+
+char *framing_inflate_payload(const char *data, size_t length,
+                              size_t *out_length) {
+  uint64_t inflated_length;
+  size_t header_length;
+  if (framing_decode_varint((const unsigned char *)data, length,
+                            &inflated_length, &header_length) != VARINT_OK ||
+      inflated_length > FRAME_MAX_PAYLOAD)
+    return NULL;
+
+  return compression_inflate(data + header_length, length - header_length,
+                             (size_t)inflated_length, out_length);
+}
+
+bool client_send_payload(ClientData *client, const char *payload,
+                         size_t length) {
+  FramingMode mode = (FramingMode)atomic_load_explicit(&client->framing,
+                                                       memory_order_acquire);
+  if (mode == FRAMING_DELIMITED) {
+    char delimiter = MESSAGE_DELIMITER;
+    struct iovec iov[2] = {{.iov_base = (void *)payload, .iov_len = length},
+                           {.iov_base = &delimiter, .iov_len = 1}};
+    return response_write(client, iov, 2);
+  }
+  if (atomic_load_explicit(&client->compression, memory_order_acquire) ==
+      COMPRESSION_DEFLATE)
+    return send_compressible(client, payload, length);
+
+  unsigned char header[FRAME_VARINT_MAX];
+  size_t header_length = framing_encode_varint(length, header);
+  struct iovec iov[2] = {{.iov_base = header, .iov_len = header_length},
+                         {.iov_base = (void *)payload, .iov_len = length}};
+  return response_write(client, iov, 2);
+}
+
+static JsonBuffer *reset_transcode_buffer(void) {
+  JsonBuffer *buf = &transcode_buffer;
+  if (buf->capacity > TRANSCODE_BUFFER_RETAIN) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->capacity = 0;
+  }
+  if (!buf->data) {
+    json_buffer_init(buf, TRANSCODE_BUFFER_INITIAL);
+    if (!buf->data)
+      return NULL;
+  }
+  buf->length = 0;
+  return buf;
+}
+
+bool framing_append_message(PayloadEncoding encoding, const char *json,
+                            size_t length, JsonBuffer *out) {
+  /* Replies are objects; anything else is script text meant verbatim */
+  bool structured = length > 0 && (json[0] == '{' || json[0] == '[');
+  JsonDocument *doc = structured ? json_dom_parse(json, length) : NULL;
+  bool encoded;
+  if (encoding == PAYLOAD_MSGPACK)
+    encoded = doc ? msgpack_encode_dom(&doc->root, out)
+                  : msgpack_write_string(out, json, length);
+  else
+    encoded = doc ? json_buffer_append(out, json, length)
+                  : json_buffer_append_string(out, json, length);
+  json_dom_free(doc);
+  return encoded;
+}
+
+bool client_send_message(ClientData *client, const char *json, size_t length) {
+  PayloadEncoding encoding = (PayloadEncoding)atomic_load_explicit(
+      &client->encoding, memory_order_acquire);
+  if (encoding != PAYLOAD_MSGPACK)
+    return client_send_payload(client, json, length);
+
+  JsonBuffer *buf = reset_transcode_buffer();
+  if (!buf) {
+    log_error("Failed to allocate transcode buffer for socket %d",
+              client->socket);
+    return false;
+  }
+
+  if (!framing_append_message(PAYLOAD_MSGPACK, json, length, buf)) {
+    log_error("Failed to encode MessagePack response for socket %d",
+              client->socket);
+    return false;
+  }
+  return client_send_payload(client, buf->data, buf->length);
+}
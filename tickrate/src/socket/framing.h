@@ -0,0 +1,75 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include "socket_pool.h"
+#include "../json/json.h"
+#include "../json/json_dom.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MESSAGE_DELIMITER '\x1e'
+#define FRAME_MAX_PAYLOAD (16 * 1024 * 1024)
+#define FRAME_VARINT_MAX 10
+
+/*
+ * Every connection starts out delimited: JSON text terminated by 0x1e. A
+ * hello message sent as the first frame can switch it to length-prefixed
+ * framing, where each frame is an unsigned LEB128 varint byte count followed
+ * by exactly that many payload bytes, encoded as JSON or MessagePack. The
+ * hello reply still goes out delimited; everything after it, in both
+ * directions, uses the negotiated framing. The hello may also set
+ * max_in_flight, how many of the connection's requests run at once; replies
+ * to those come back in completion order, matched by id. Length-prefixed
+ * connections can also turn on compression (see compression.h).
+ */
+typedef enum {
+    FRAMING_DELIMITED,
+    FRAMING_LENGTH_PREFIXED
+} FramingMode;
+
+typedef enum {
+    PAYLOAD_JSON,
+    PAYLOAD_MSGPACK
+} PayloadEncoding;
+
+typedef enum {
+    VARINT_OK,
+    VARINT_INCOMPLETE,
+    VARINT_MALFORMED
+} VarintStatus;
+
+size_t framing_encode_varint(uint64_t value, unsigned char *out);
+VarintStatus framing_decode_varint(const unsigned char *data, size_t length,
+                                   uint64_t *value, size_t *header_length);
+
+bool framing_mode_from_name(const char *name, FramingMode *mode);
+bool payload_encoding_from_name(const char *name, PayloadEncoding *encoding);
+const char* framing_mode_name(FramingMode mode);
+const char* payload_encoding_name(PayloadEncoding encoding);
+
+JsonDocument* framing_parse_payload(PayloadEncoding encoding, char *data,
+                                    size_t length);
+/* Expands the body of a FRAME_FLAG_DEFLATE frame into a new NUL-terminated
+ * buffer the caller frees; NULL when it is malformed or too large. */
+char* framing_inflate_payload(const char *data, size_t length,
+                              size_t *out_length);
+
+/*
+ * Appends a JSON reply to out in the given encoding. Text that is not JSON
+ * becomes a string, so the result is always one well-formed value.
+ */
+bool framing_append_message(PayloadEncoding encoding, const char *json,
+                            size_t length, JsonBuffer *out);
+
+/*
+ * client_send_message takes JSON text and re-encodes it for the client's
+ * negotiated payload encoding; text that is not JSON is sent to msgpack
+ * clients as a string. client_send_payload sends bytes that are already in
+ * that encoding. Both add the framing and return false on a failed send.
+ */
+bool client_send_message(ClientData *client, const char *json, size_t length);
+bool client_send_payload(ClientData *client, const char *payload,
+                         size_t length);
+
+#endif
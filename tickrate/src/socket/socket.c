@@ -1,268 +1,820 @@
 #include "socket.h"
-#include "../../src/json/json.h"
+#include "framing.h"
+#include "../compression/compression.h"
+#include "../json/json_dom.h"
 #include "../commands/commands.h"
 #include "../logging/logging.h"
+#include "../metrics/metrics.h"
+#include "../network/response.h"
+#include "../simd/scan.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
-#define HEARTBEAT_INTERVAL 30
-#define HEARTBEAT_TIMEOUT 60
-#define MESSAGE_DELIMITER '\x1e'
-
-char *unescape_lua_code(const char *input) {
-  char *output = malloc(strlen(input) + 1);
-  char *dest = output;
-
-  while (*input) {
-    if (*input == '\\') {
-      switch (*(input + 1)) {
-      case '\\':
-        *dest++ = '\\';
-        input += 2;
-        break;
-      case 'n':
-        *dest++ = '\n';
-        input += 2;
-        break;
-      case 't':
-        *dest++ = '\t';
-        input += 2;
-        break;
-      case '"':
-        *dest++ = '"';
-        input += 2;
-        break;
-      default:
-        *dest++ = *input++;
-        break;
-      }
-    } else {
-      *dest++ = *input++;
+#define HEARTBEAT_INTERVAL 5
+#define HEARTBEAT_TIMEOUT 30
+#define HELLO_MAX_LENGTH 512
+#define HEARTBEAT_RESPONSE_MAX_LENGTH 256
+
+static void send_error_response(ClientData *client, const char *message) {
+  char response[512];
+  int length = snprintf(response, sizeof(response),
+                        "{\"type\":\"error\",\"data\":{\"message\":\"%s\"}}",
+                        message);
+  if (length > 0 && (size_t)length < sizeof(response))
+    client_send_message(client, response, (size_t)length);
+}
+
+/* Returns true when the command's task took over reporting completion. */
+static bool process_command(ClientData *client_data, const JsonValue *root,
+                            const char *request_id) {
+  const JsonValue *data = json_object_get(root, "data");
+  if (!data || data->type != JSON_OBJECT) {
+    log_error("Missing 'data' in command message");
+    send_error_response(client_data, "Missing 'data'");
+    return false;
+  }
+
+  const JsonValue *inner_data = json_object_get(data, "data");
+  if (!inner_data || inner_data->type != JSON_OBJECT) {
+    log_error("Missing 'data' object in inner JSON");
+    send_error_response(client_data, "Missing 'data' object");
+    return false;
+  }
+
+  const char *command_name =
+      json_string_value(json_object_get(inner_data, "name"));
+  if (!command_name) {
+    log_error("Missing 'name' in command data");
+    send_error_response(client_data, "Missing 'name'");
+    return false;
+  }
+
+  const JsonValue *args = json_object_get(inner_data, "args");
+  if (!args || args->type != JSON_OBJECT) {
+    log_error("Missing 'args' in command data");
+    send_error_response(client_data, "Missing 'args'");
+    return false;
+  }
+
+  log_debug("Executing command: %s", command_name);
+  LuaVMPool *lua_pool = client_data->sh->lua_pool;
+  LuaEnvironment *lua_env = lua_vm_acquire(lua_pool);
+  bool started =
+      execute_command(command_name, args, client_data, lua_env, request_id);
+  lua_vm_release(lua_pool, lua_env);
+  return started;
+}
+
+static bool process_message(ClientData *client_data, PendingMessage *message) {
+  char *payload = message->data;
+  size_t length = message->length;
+  if (message->compressed) {
+    payload = framing_inflate_payload(message->data, message->length, &length);
+    if (!payload) {
+      log_error("Failed to inflate message from client %d",
+                client_data->socket);
+      send_error_response(client_data, "Invalid compressed payload");
+      return false;
     }
   }
-  *dest = '\0';
-  return output;
+
+  uint64_t parse_start = metrics_now_ns();
+  JsonDocument *doc = framing_parse_payload((PayloadEncoding)message->encoding,
+                                            payload, length);
+  metrics_add(METRIC_JSON_PARSE_NS, metrics_now_ns() - parse_start);
+  metrics_add(METRIC_JSON_PARSE_COUNT, 1);
+  if (!doc)
+    metrics_add(METRIC_JSON_PARSE_ERRORS, 1);
+  if (!doc || doc->root.type != JSON_OBJECT) {
+    log_error("Failed to decode root %s message",
+              payload_encoding_name((PayloadEncoding)message->encoding));
+    send_error_response(client_data, "Invalid message payload");
+    json_dom_free(doc);
+    if (payload != message->data)
+      free(payload);
+    return false;
+  }
+
+  bool started = false;
+  const char *type = json_string_value(json_object_get(&doc->root, "type"));
+  const char *request_id =
+      json_string_value(json_object_get(&doc->root, "id"));
+  if (!type || !request_id) {
+    log_error("Missing 'type' or 'id' in message");
+    send_error_response(client_data, "Missing 'type' or 'id'");
+  } else if (strcmp(type, "command") == 0) {
+    started = process_command(client_data, &doc->root, request_id);
+  } else if (strcmp(type, "batch") == 0) {
+    started = batch_execute(client_data, &doc->root, request_id);
+  }
+
+  json_dom_free(doc);
+  if (payload != message->data)
+    free(payload);
+  return started;
 }
 
-static void send_error_response(int socket, const char *message) {
-  char response[512];
-  snprintf(response, sizeof(response),
-           "{\"type\":\"error\",\"data\":{\"message\":\"%s\"}}%c", message,
-           MESSAGE_DELIMITER);
-  send(socket, response, strlen(response), 0);
+static void run_message(void *arg) {
+  PendingMessage *msg = (PendingMessage *)arg;
+  ClientData *client = msg->client;
+  bool started = false;
+
+  if (!atomic_load(&client->closed)) {
+    log_debug("Processing %zu byte message from client %d", msg->length,
+              client->socket);
+    started = process_message(client, msg);
+  }
+  free(msg);
+
+  if (!started)
+    client_request_finished(client);
+  client_unref(client);
 }
 
-static void process_message(ClientData *client_data, const char *message) {
-  JSONObject *root = json_decode(message);
-  if (!root) {
-    log_error("Failed to decode root JSON");
-    send_error_response(client_data->socket, "Invalid JSON message");
+/* Answers a request the pool will not take with an error the client can
+ * match by id and retry after the hinted delay. Frees msg. */
+static void shed_message(ClientData *client, PendingMessage *msg,
+                         uint64_t retry_after_ms) {
+  char *payload = msg->data;
+  size_t length = msg->length;
+  if (msg->compressed)
+    payload = framing_inflate_payload(msg->data, msg->length, &length);
+  JsonDocument *doc =
+      payload ? framing_parse_payload((PayloadEncoding)msg->encoding, payload,
+                                      length)
+              : NULL;
+  const char *type =
+      doc ? json_string_value(json_object_get(&doc->root, "type")) : NULL;
+  const char *request_id =
+      doc ? json_string_value(json_object_get(&doc->root, "id")) : NULL;
+  /* Anything but a request would have been ignored anyway */
+  bool request = !type || strcmp(type, "command") == 0 ||
+                 strcmp(type, "batch") == 0;
+
+  if (request) {
+    char tail[160];
+    int tail_length = snprintf(
+        tail, sizeof(tail),
+        "\"type\":\"error\",\"data\":{\"message\":\"Server overloaded\","
+        "\"code\":\"overloaded\",\"retry_after_ms\":%llu}}",
+        (unsigned long long)retry_after_ms);
+    JsonBuffer reply;
+    json_buffer_init(&reply, 256);
+    if (json_buffer_append(&reply, "{", 1) &&
+        (!request_id ||
+         (json_buffer_append(&reply, "\"id\":", 5) &&
+          json_buffer_append_string(&reply, request_id, strlen(request_id)) &&
+          json_buffer_append(&reply, ",", 1))) &&
+        json_buffer_append(&reply, tail, (size_t)tail_length))
+      client_send_message(client, reply.data, reply.length);
+    free(reply.data);
+    metrics_add(METRIC_REQUESTS_SHED, 1);
+  }
+
+  json_dom_free(doc);
+  if (payload != msg->data)
+    free(payload);
+  free(msg);
+}
+
+static uint64_t retry_after_ms(ThreadPool *pool) {
+  return thread_pool_predicted_wait_ns(pool) / 1000000 + 1;
+}
+
+/* The caller holds one of the connection's in-flight slots for msg. On
+ * failure the message is shed and the slot is still the caller's. */
+static bool submit_message(ClientData *client, PendingMessage *msg) {
+  ThreadPool *pool = client->sh->thread_pool;
+  msg->client = client;
+  client_ref(client);
+  if (thread_pool_submit(pool, run_message, msg))
+    return true;
+
+  log_warn("Execution pool rejected message from client %d", client->socket);
+  shed_message(client, msg, retry_after_ms(pool));
+  client_unref(client);
+  return false;
+}
+
+void client_request_finished(ClientData *client) {
+  pthread_mutex_lock(&client->lock);
+  PendingMessage *msg = NULL;
+  if (!atomic_load(&client->closed))
+    msg = client->pending_head;
+  if (msg) {
+    client->pending_head = msg->next;
+    if (!client->pending_head)
+      client->pending_tail = NULL;
+  } else {
+    client->in_flight--;
+  }
+  pthread_mutex_unlock(&client->lock);
+
+  /* The freed slot passes straight to the oldest waiting message */
+  if (!msg || submit_message(client, msg))
     return;
+
+  /* The pool is full: the messages still waiting would get the same answer
+   * one at a time, so shed them all now and give the slot back. */
+  pthread_mutex_lock(&client->lock);
+  PendingMessage *waiting = client->pending_head;
+  client->pending_head = client->pending_tail = NULL;
+  client->in_flight--;
+  pthread_mutex_unlock(&client->lock);
+
+  uint64_t retry_after = retry_after_ms(client->sh->thread_pool);
+  while (waiting) {
+    PendingMessage *next = waiting->next;
+    shed_message(client, waiting, retry_after);
+    waiting = next;
   }
+}
 
-  const char *type = get_json_value(root, "type");
-  const char *request_id = get_json_value(root, "id");
-  if (!type || !request_id) {
-    log_error("Missing 'type' or 'id' in message");
-    send_error_response(client_data->socket, "Missing 'type' or 'id'");
-    free_json_object(root);
+/*
+ * Every request runs on the pool by itself and replies when it finishes,
+ * so a slow command never holds back the ones behind it. Messages past the
+ * connection's in-flight limit wait in arrival order for a slot; whenever
+ * any are waiting, every slot is taken. Admission is decided here, as the
+ * request arrives, so an overloaded pool answers at once.
+ */
+static void dispatch_message(ClientData *client, const char *data,
+                             size_t length, bool compressed) {
+  PendingMessage *msg = malloc(sizeof(PendingMessage) + length + 1);
+  if (!msg) {
+    log_error("Failed to allocate message for client %d", client->socket);
+    return;
+  }
+  msg->next = NULL;
+  msg->client = client;
+  msg->encoding = atomic_load_explicit(&client->encoding, memory_order_relaxed);
+  msg->compressed = compressed;
+  msg->length = length;
+  memcpy(msg->data, data, length);
+  msg->data[length] = '\0';
+
+  uint64_t retry_after_ms;
+  if (!thread_pool_admit(client->sh->thread_pool, &retry_after_ms)) {
+    log_debug("Shedding message from client %d", client->socket);
+    shed_message(client, msg, retry_after_ms);
     return;
   }
 
-  if (strcmp(type, "command") == 0) {
-    const char *data_str = get_json_value(root, "data");
-    if (!data_str) {
-      log_error("Missing 'data' in command message");
-      send_error_response(client_data->socket, "Missing 'data'");
-      free_json_object(root);
+  pthread_mutex_lock(&client->lock);
+  bool run = client->in_flight < client->max_in_flight;
+  if (run) {
+    client->in_flight++;
+  } else if (client->pending_tail) {
+    client->pending_tail->next = msg;
+    client->pending_tail = msg;
+  } else {
+    client->pending_head = client->pending_tail = msg;
+  }
+  pthread_mutex_unlock(&client->lock);
+
+  if (run && !submit_message(client, msg))
+    client_request_finished(client);
+}
+
+/*
+ * Runs on the listener thread so the switch takes effect for the very next
+ * byte in the receive buffer. Only the first frame may be a hello: once
+ * replies can be in flight on pool threads, changing framing under them
+ * would interleave two wire formats.
+ */
+static void handle_hello(ClientData *client, const JsonValue *root) {
+  const JsonValue *data = json_object_get(root, "data");
+  const char *request_id = json_string_value(json_object_get(root, "id"));
+  FramingMode framing = FRAMING_DELIMITED;
+  PayloadEncoding encoding = PAYLOAD_JSON;
+  const char *framing_name = json_string_value(json_object_get(data, "framing"));
+  const char *encoding_name =
+      json_string_value(json_object_get(data, "encoding"));
+  const char *compression_name =
+      json_string_value(json_object_get(data, "compression"));
+  const JsonValue *threshold = json_object_get(data, "compression_threshold");
+  const JsonValue *in_flight = json_object_get(data, "max_in_flight");
+  CompressionMode compression = COMPRESSION_NONE;
+  size_t compression_threshold = COMPRESSION_DEFAULT_THRESHOLD;
+  size_t max_in_flight = CLIENT_MAX_IN_FLIGHT;
+
+  if (client->greeted) {
+    send_error_response(client, "hello must be the first message");
+    return;
+  }
+  if ((framing_name && !framing_mode_from_name(framing_name, &framing)) ||
+      (encoding_name && !payload_encoding_from_name(encoding_name, &encoding))) {
+    send_error_response(client, "Unsupported framing or encoding");
+    return;
+  }
+  if (framing == FRAMING_DELIMITED && encoding != PAYLOAD_JSON) {
+    send_error_response(client, "Delimited framing only carries JSON");
+    return;
+  }
+  if (compression_name &&
+      !compression_mode_from_name(compression_name, &compression)) {
+    send_error_response(client, "Unsupported compression");
+    return;
+  }
+  if (compression != COMPRESSION_NONE && framing != FRAMING_LENGTH_PREFIXED) {
+    send_error_response(client, "Compression needs length-prefixed framing");
+    return;
+  }
+  if (threshold) {
+    if (threshold->type != JSON_NUMBER || !threshold->u.number.is_integer ||
+        threshold->u.number.integer < 0 ||
+        threshold->u.number.integer > FRAME_MAX_PAYLOAD) {
+      send_error_response(client, "Unsupported compression_threshold");
       return;
     }
-
-    JSONObject *inner = json_decode(data_str);
-    if (!inner) {
-      log_error("Failed to decode inner JSON");
-      send_error_response(client_data->socket, "Invalid inner JSON");
-      free_json_object(root);
+    compression_threshold = (size_t)threshold->u.number.integer;
+  }
+  if (in_flight) {
+    if (in_flight->type != JSON_NUMBER || !in_flight->u.number.is_integer ||
+        in_flight->u.number.integer < 1 ||
+        in_flight->u.number.integer > CLIENT_MAX_IN_FLIGHT_LIMIT) {
+      send_error_response(client, "Unsupported max_in_flight");
       return;
     }
+    max_in_flight = (size_t)in_flight->u.number.integer;
+  }
+
+  char tail[320];
+  int tail_length = snprintf(
+      tail, sizeof(tail),
+      ",\"type\":\"hello\",\"data\":{\"framing\":\"%s\","
+      "\"encoding\":\"%s\",\"max_payload\":%d,\"max_in_flight\":%zu,"
+      "\"compression\":\"%s\",\"compression_threshold\":%zu,"
+      "\"dictionary_id\":%u}}",
+      framing_mode_name(framing), payload_encoding_name(encoding),
+      FRAME_MAX_PAYLOAD, max_in_flight, compression_mode_name(compression),
+      compression_threshold, (unsigned)compression_dictionary_id());
+  if (!request_id)
+    request_id = "";
+  JsonBuffer reply;
+  json_buffer_init(&reply, 384);
+  if (json_buffer_append(&reply, "{\"id\":", 6) &&
+      json_buffer_append_string(&reply, request_id, strlen(request_id)) &&
+      json_buffer_append(&reply, tail, (size_t)tail_length))
+    client_send_message(client, reply.data, reply.length);
+  free(reply.data);
+
+  /* Nothing is in flight yet: the hello is the connection's first frame */
+  pthread_mutex_lock(&client->lock);
+  client->max_in_flight = max_in_flight;
+  pthread_mutex_unlock(&client->lock);
+
+  client->compression_threshold = compression_threshold;
+  atomic_store_explicit(&client->compression, compression,
+                        memory_order_release);
+  atomic_store_explicit(&client->encoding, encoding, memory_order_release);
+  atomic_store_explicit(&client->framing, framing, memory_order_release);
+  log_info("Client %d negotiated %s framing with %s payloads, compression %s",
+           client->socket, framing_mode_name(framing),
+           payload_encoding_name(encoding), compression_mode_name(compression));
+}
+
+static bool frame_contains(const char *frame, size_t length,
+                           const char *pattern, size_t pattern_length) {
+  const char *end = frame + length;
+  const char *p = frame;
+  while ((size_t)(end - p) >= pattern_length) {
+    p = scan_byte(p, end - pattern_length + 1, pattern[0]);
+    if (p == end - pattern_length + 1)
+      return false;
+    if (memcmp(p, pattern, pattern_length) == 0)
+      return true;
+    p++;
+  }
+  return false;
+}
+
+static bool is_hello(const char *frame, size_t length, JsonDocument **doc) {
+  static const char pattern[] = "\"hello\"";
+  if (length > HELLO_MAX_LENGTH ||
+      !frame_contains(frame, length, pattern, sizeof(pattern) - 1))
+    return false;
+
+  *doc = json_dom_parse(frame, length);
+  const char *type =
+      *doc ? json_string_value(json_object_get(&(*doc)->root, "type")) : NULL;
+  if (type && strcmp(type, "hello") == 0)
+    return true;
+  json_dom_free(*doc);
+  return false;
+}
+
+static bool is_heartbeat_response(const ClientData *client, const char *frame,
+                                  size_t length) {
+  static const char json_pattern[] = "\"type\":\"heartbeat_response\"";
+  static const char msgpack_pattern[] = "\xa4type\xb2heartbeat_response";
+
+  if (length >= HEARTBEAT_RESPONSE_MAX_LENGTH)
+    return false;
+  if (atomic_load_explicit(&client->encoding, memory_order_relaxed) ==
+      PAYLOAD_MSGPACK)
+    return frame_contains(frame, length, msgpack_pattern,
+                          sizeof(msgpack_pattern) - 1);
+  return frame_contains(frame, length, json_pattern, sizeof(json_pattern) - 1);
+}
+
+/* A frame small enough to be a heartbeat response is inflated here so it can
+ * be recognised; anything larger is inflated on the pool with its request. */
+static void handle_compressed_frame(ClientData *client, const char *frame,
+                                    size_t length) {
+  uint64_t inflated_length;
+  size_t header_length;
+  client->greeted = true;
+  if (framing_decode_varint((const unsigned char *)frame, length,
+                            &inflated_length, &header_length) != VARINT_OK ||
+      inflated_length >= HEARTBEAT_RESPONSE_MAX_LENGTH) {
+    dispatch_message(client, frame, length, true);
+    return;
+  }
+
+  size_t payload_length;
+  char *payload = framing_inflate_payload(frame, length, &payload_length);
+  if (!payload) {
+    dispatch_message(client, frame, length, true);
+    return;
+  }
+  if (is_heartbeat_response(client, payload, payload_length)) {
+    client->last_heartbeat = time(NULL);
+    log_debug("Updated heartbeat for client %d", client->socket);
+  } else {
+    dispatch_message(client, payload, payload_length, false);
+  }
+  free(payload);
+}
 
-    JSONObject *inner_data = get_json_object(inner, "data");
-    if (!inner_data) {
-      log_error("Missing 'data' object in inner JSON");
-      send_error_response(client_data->socket, "Missing 'data' object");
-      free_json_object(inner);
-      free_json_object(root);
+static void handle_frame(ClientData *client, const char *frame,
+                         size_t length) {
+  if (length == 0)
+    return;
+  metrics_add(METRIC_FRAMES_IN, 1);
+
+  bool compressed = false;
+  if (atomic_load_explicit(&client->compression, memory_order_relaxed) !=
+      COMPRESSION_NONE) {
+    compressed = frame[0] == FRAME_FLAG_DEFLATE;
+    if (!compressed && frame[0] != FRAME_FLAG_RAW) {
+      send_error_response(client, "Unknown frame flag");
       return;
     }
-
-    const char *command_name = get_json_value(inner_data, "name");
-    if (!command_name) {
-      log_error("Missing 'name' in command data");
-      send_error_response(client_data->socket, "Missing 'name'");
-      free_json_object(inner_data);
-      free_json_object(inner);
-      free_json_object(root);
+    frame++;
+    length--;
+    if (compressed) {
+      handle_compressed_frame(client, frame, length);
       return;
     }
+  }
 
-    JSONObject *args = get_json_object(inner_data, "args");
-    if (!args) {
-      log_error("Missing 'args' in command data");
-      send_error_response(client_data->socket, "Missing 'args'");
-      free_json_object(inner_data);
-      free_json_object(inner);
-      free_json_object(root);
-      return;
+  if (is_heartbeat_response(client, frame, length)) {
+    client->last_heartbeat = time(NULL);
+    log_debug("Updated heartbeat for client %d", client->socket);
+    return;
+  }
+
+  JsonDocument *hello = NULL;
+  if (atomic_load_explicit(&client->framing, memory_order_relaxed) ==
+          FRAMING_DELIMITED &&
+      is_hello(frame, length, &hello)) {
+    handle_hello(client, &hello->root);
+    json_dom_free(hello);
+    client->greeted = true;
+    return;
+  }
+
+  client->greeted = true;
+  dispatch_message(client, frame, length, false);
+}
+
+static bool reading_scratch(const ClientData *client) {
+  return client->buffer == client->sh->read_scratch;
+}
+
+static void release_read_buffer(ClientData *client) {
+  if (!reading_scratch(client))
+    client_buffer_release(client->sh->client_pool, client->buffer,
+                          client->buffer_capacity);
+  client->buffer = NULL;
+  client->buffer_capacity = 0;
+}
+
+/* Moves the buffered bytes into a pooled buffer with room for min_free
+ * more. Without exact, the capacity at least doubles so a long delimited
+ * frame is not copied once per read. */
+static bool ensure_read_capacity(ClientData *client, size_t min_free,
+                                 bool exact) {
+  size_t needed = client->buffer_length + min_free + 1;
+  if (needed <= client->buffer_capacity)
+    return true;
+  if (!exact && needed < client->buffer_capacity * 2)
+    needed = client->buffer_capacity * 2;
+
+  size_t capacity;
+  char *buffer =
+      client_buffer_acquire(client->sh->client_pool, needed, &capacity);
+  if (!buffer) {
+    log_error("Failed to grow receive buffer for client %d", client->socket);
+    return false;
+  }
+  memcpy(buffer, client->buffer, client->buffer_length);
+  release_read_buffer(client);
+  client->buffer = buffer;
+  client->buffer_capacity = capacity;
+  return true;
+}
+
+/* Returns the number of bytes consumed. Stops early when a hello switches
+ * the connection to length-prefixed framing. */
+static size_t extract_delimited(ClientData *client) {
+  char *start = client->buffer;
+  char *end = client->buffer + client->buffer_length;
+  char *scan = client->buffer + client->scan_offset;
+  char *delimiter;
+
+  while ((delimiter = (char *)scan_byte(scan, end, MESSAGE_DELIMITER)) !=
+         end) {
+    *delimiter = '\0';
+    handle_frame(client, start, delimiter - start);
+    start = scan = delimiter + 1;
+    if (atomic_load_explicit(&client->framing, memory_order_relaxed) !=
+        FRAMING_DELIMITED)
+      break;
+  }
+  client->scan_offset = end - start;
+  return start - client->buffer;
+}
+
+/* Consumes complete frames starting at *offset. A partial frame records its
+ * full size in frame_length so the next read can size the buffer exactly. */
+static bool extract_length_prefixed(ClientData *client, size_t *offset) {
+  while (*offset < client->buffer_length) {
+    const unsigned char *header =
+        (const unsigned char *)client->buffer + *offset;
+    size_t available = client->buffer_length - *offset;
+    uint64_t payload_length;
+    size_t header_length;
+
+    VarintStatus status = framing_decode_varint(header, available,
+                                                &payload_length, &header_length);
+    if (status == VARINT_INCOMPLETE)
+      break;
+    if (status == VARINT_MALFORMED || payload_length > FRAME_MAX_PAYLOAD) {
+      log_error("Invalid frame length from client %d", client->socket);
+      return false;
     }
 
-    const char *task_body = get_json_value(args, "task_body");
-    char *clean_body = unescape_lua_code(task_body ? task_body : "");
-    char *args_json = json_encode(args);
-    if (!args_json || !clean_body) {
-      log_error("Failed to encode args or unescape task_body");
-      send_error_response(client_data->socket, "Failed to process args");
-      free(clean_body);
-      free(args_json);
-      free_json_object(args);
-      free_json_object(inner_data);
-      free_json_object(inner);
-      free_json_object(root);
-      return;
+    size_t frame_length = header_length + (size_t)payload_length;
+    if (available < frame_length) {
+      client->frame_length = frame_length;
+      break;
+    }
+    handle_frame(client, (const char *)header + header_length,
+                 (size_t)payload_length);
+    *offset += frame_length;
+    client->frame_length = 0;
+  }
+  return true;
+}
+
+static bool extract_frames(ClientData *client) {
+  size_t offset = 0;
+  if (atomic_load_explicit(&client->framing, memory_order_relaxed) ==
+      FRAMING_DELIMITED)
+    offset = extract_delimited(client);
+  if (atomic_load_explicit(&client->framing, memory_order_relaxed) ==
+          FRAMING_LENGTH_PREFIXED &&
+      !extract_length_prefixed(client, &offset))
+    return false;
+
+  size_t remaining = client->buffer_length - offset;
+  if (remaining > 0 && offset > 0)
+    memmove(client->buffer, client->buffer + offset, remaining);
+  client->buffer_length = remaining;
+  if (client->scan_offset > remaining)
+    client->scan_offset = remaining;
+
+  if (remaining == 0)
+    release_read_buffer(client);
+  return true;
+}
+
+static bool read_available(ClientData *client) {
+  for (;;) {
+    /* Nothing pending: read into the listener's scratch buffer */
+    if (!client->buffer) {
+      client->buffer = client->sh->read_scratch;
+      client->buffer_capacity = READ_SCRATCH_SIZE;
+      client->buffer_length = client->scan_offset = 0;
     }
 
-    log_debug("Executing command: %s", command_name);
-    execute_command(command_name, clean_body, args_json, client_data->socket,
-                    client_data->sh->lua_env->L, client_data->sh->tickrate,
-                    request_id);
+    size_t min_free = 4096;
+    bool exact = client->frame_length > client->buffer_length + min_free;
+    if (exact)
+      min_free = client->frame_length - client->buffer_length;
+    if (!ensure_read_capacity(client, min_free, exact))
+      return false;
+
+    size_t space = client->buffer_capacity - client->buffer_length - 1;
+    ssize_t bytes_read =
+        read(client->socket, client->buffer + client->buffer_length, space);
+    if (bytes_read < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      if (errno == EINTR)
+        continue;
+      log_error("Read error on client %d: %s", client->socket,
+                strerror(errno));
+      return false;
+    }
+    if (bytes_read == 0) {
+      log_info("Client %d disconnected from socket", client->socket);
+      return false;
+    }
+
+    log_debug("Received %zd bytes from client %d", bytes_read, client->socket);
+    metrics_add(METRIC_BYTES_IN, (uint64_t)bytes_read);
+    client->buffer_length += bytes_read;
+    client->buffer[client->buffer_length] = '\0';
+    if (!extract_frames(client))
+      return false;
+  }
+}
 
-    free(clean_body);
-    free(args_json);
-    free_json_object(args);
-    free_json_object(inner_data);
-    free_json_object(inner);
+/* A partial frame left in the scratch buffer moves to a pooled buffer of
+ * its own, sized for the whole frame when its length is known. */
+static bool stash_partial_frame(ClientData *client) {
+  if (!client->buffer || !reading_scratch(client))
+    return true;
+
+  size_t needed = client->buffer_length + 1;
+  if (client->frame_length + 1 > needed)
+    needed = client->frame_length + 1;
+  size_t capacity;
+  char *buffer =
+      client_buffer_acquire(client->sh->client_pool, needed, &capacity);
+  if (!buffer) {
+    client->buffer = NULL;
+    client->buffer_capacity = 0;
+    return false;
   }
+  memcpy(buffer, client->buffer, client->buffer_length + 1);
+  client->buffer = buffer;
+  client->buffer_capacity = capacity;
+  return true;
+}
 
-  free_json_object(root);
+static bool read_client(ClientData *client) {
+  bool alive = read_available(client);
+  if (!alive && client->buffer && reading_scratch(client)) {
+    client->buffer = NULL;
+    client->buffer_capacity = 0;
+  }
+  return stash_partial_frame(client) && alive;
 }
 
-void *handle_client(void *arg) {
-  ClientData *client_data = (ClientData *)arg;
-  SocketHandler *sh = client_data->sh;
-  char buffer[16384];
-  time_t last_heartbeat_sent = time(NULL);
-  time_t last_heartbeat_received = time(NULL);
-  char *message_buffer = NULL;
-  size_t buffer_size = 0;
-  size_t capacity = 1024;
-
-  message_buffer = malloc(capacity);
-  if (!message_buffer) {
-    log_error("Failed to allocate message buffer");
-    close(client_data->socket);
-    release_client(sh->client_pool, client_data);
-    return NULL;
-  }
-  message_buffer[0] = '\0';
+static void disconnect_client(SocketHandler *sh, ClientData *client) {
+  if (atomic_exchange(&client->closed, true))
+    return;
 
-  while (sh->tickrate->is_running) {
-    fd_set read_fds;
-    struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
-    FD_ZERO(&read_fds);
-    FD_SET(client_data->socket, &read_fds);
+  epoll_ctl(sh->epoll_fd, EPOLL_CTL_DEL, client->socket, NULL);
+  shutdown(client->socket, SHUT_RDWR);
+
+  if (client->prev)
+    client->prev->next = client->next;
+  else
+    sh->connections = client->next;
+  if (client->next)
+    client->next->prev = client->prev;
+  sh->connection_count--;
+  metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+
+  log_info("Client %d removed (%zu connected)", client->socket,
+           sh->connection_count);
+  client_unref(client);
+}
 
-    int ready = select(client_data->socket + 1, &read_fds, NULL, NULL, &tv);
-    if (ready < 0) {
-      log_error("Select error: %s", strerror(errno));
-      break;
+static void accept_clients(SocketHandler *sh) {
+  for (;;) {
+    sh->addrlen = sizeof(sh->address);
+    int client_sock =
+        accept(sh->server_fd, (struct sockaddr *)&sh->address, &sh->addrlen);
+    if (client_sock < 0) {
+      if (errno == EWOULDBLOCK || errno == EAGAIN)
+        return;
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      log_error("Accept failed: %s", strerror(errno));
+      return;
     }
 
-    if (ready > 0) {
-      ssize_t bytes_read =
-          read(client_data->socket, buffer, sizeof(buffer) - 1);
-      if (bytes_read <= 0) {
-        log_info("Client %d disconnected from socket", client_data->socket);
-        break;
-      }
-      buffer[bytes_read] = '\0';
-      log_debug("Received %zd bytes: %s", bytes_read, buffer);
-
-      size_t new_size = buffer_size + bytes_read + 1;
-      if (new_size > capacity) {
-        while (capacity < new_size)
-          capacity *= 2;
-        char *new_buffer = realloc(message_buffer, capacity);
-        if (!new_buffer) {
-          log_error("Failed to realloc message buffer");
-          break;
-        }
-        message_buffer = new_buffer;
-      }
-      memcpy(message_buffer + buffer_size, buffer, bytes_read);
-      buffer_size += bytes_read;
-      message_buffer[buffer_size] = '\0';
-
-      char *msg = message_buffer;
-      char *delimiter;
-      while ((delimiter = strchr(msg, MESSAGE_DELIMITER)) != NULL) {
-        *delimiter = '\0';
-        if (strlen(msg) > 0) {
-          log_debug("Processing message: %s", msg);
-          process_message(client_data, msg);
-          if (strstr(msg, "\"type\":\"heartbeat_response\"")) {
-            last_heartbeat_received = time(NULL);
-            log_debug("Updated heartbeat for client %d", client_data->socket);
-          }
-        }
-        msg = delimiter + 1;
-      }
+    int optval = 1;
+    if (setsockopt(client_sock, SOL_SOCKET, SO_KEEPALIVE, &optval,
+                   sizeof(optval)) < 0) {
+      log_error("Failed to set SO_KEEPALIVE on client socket %d: %s",
+                client_sock, strerror(errno));
+      close(client_sock);
+      continue;
+    }
 
-      size_t remaining = buffer_size - (msg - message_buffer);
-      if (remaining > 0) {
-        memmove(message_buffer, msg, remaining);
-      }
-      buffer_size = remaining;
-      if (buffer_size < capacity / 4 && capacity > 4096) {
-        size_t new_capacity = buffer_size > 1024 ? buffer_size : 1024;
-        char *new_buffer = realloc(message_buffer, new_capacity);
-        if (new_buffer) {
-          message_buffer = new_buffer;
-          capacity = new_capacity;
-        }
-      }
-      message_buffer[buffer_size] = '\0';
+    int client_flags = fcntl(client_sock, F_GETFL, 0);
+    fcntl(client_sock, F_SETFL, client_flags | O_NONBLOCK);
+
+    ClientData *client = allocate_client(sh->client_pool);
+    if (!client) {
+      log_warn("Client pool full, rejecting connection");
+      close(client_sock);
+      continue;
     }
 
     time_t now = time(NULL);
-    if (now - last_heartbeat_sent >= 5) {
-      char heartbeat[] = "{\"type\":\"heartbeat\",\"id\":\"server-hb\"}\x1e";
-      send(client_data->socket, heartbeat, strlen(heartbeat), 0);
-      log_debug("Sent heartbeat to client %d", client_data->socket);
-      last_heartbeat_sent = now;
+    client->socket = client_sock;
+    client->sh = sh;
+    client->buffer = NULL;
+    client->buffer_length = client->buffer_capacity = client->scan_offset = 0;
+    client->frame_length = 0;
+    atomic_store(&client->framing, FRAMING_DELIMITED);
+    atomic_store(&client->encoding, PAYLOAD_JSON);
+    atomic_store(&client->compression, COMPRESSION_NONE);
+    client->compression_threshold = COMPRESSION_DEFAULT_THRESHOLD;
+    client->greeted = false;
+    client->output_head = client->output_tail = NULL;
+    client->output_bytes = 0;
+    client->cork = 0;
+    client->reading_paused = false;
+    client->interest = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    client->last_heartbeat = client->last_heartbeat_sent = now;
+    client->pending_head = client->pending_tail = NULL;
+    client->in_flight = 0;
+    client->max_in_flight = CLIENT_MAX_IN_FLIGHT;
+    atomic_store(&client->refcount, 1);
+    atomic_store(&client->closed, false);
+
+    struct epoll_event ev = {.events = client->interest, .data.ptr = client};
+    if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+      log_error("Failed to register client %d: %s", client_sock,
+                strerror(errno));
+      client_unref(client);
+      continue;
     }
-    if (now - last_heartbeat_received > 30) {
-      log_warn("Heartbeat timeout for client %d", client_data->socket);
-      break;
+
+    client->prev = NULL;
+    client->next = sh->connections;
+    if (sh->connections)
+      sh->connections->prev = client;
+    sh->connections = client;
+    sh->connection_count++;
+    metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+
+    log_info("Client %d connected to socket (%zu connected)", client_sock,
+             sh->connection_count);
+  }
+}
+
+static void sweep_heartbeats(SocketHandler *sh, time_t now) {
+  static const char heartbeat[] = "{\"type\":\"heartbeat\",\"id\":\"server-hb\"}";
+
+  ClientData *client = sh->connections;
+  while (client) {
+    ClientData *next = client->next;
+    if (now - client->last_heartbeat > HEARTBEAT_TIMEOUT) {
+      log_warn("Heartbeat timeout for client %d", client->socket);
+      disconnect_client(sh, client);
+    } else if (now - client->last_heartbeat_sent >= HEARTBEAT_INTERVAL) {
+      client_send_message(client, heartbeat, sizeof(heartbeat) - 1);
+      log_debug("Sent heartbeat to client %d", client->socket);
+      client->last_heartbeat_sent = now;
     }
+    client = next;
   }
+}
 
-  free(message_buffer);
-  close(client_data->socket);
-  release_client(sh->client_pool, client_data);
-  return NULL;
+static bool schedule_lua_job(void *ctx, void (*job)(void *arg), void *arg) {
+  return thread_pool_submit((ThreadPool *)ctx, job, arg);
 }
 
 void socket_handler_init(SocketHandler *sh, Tickrate *tickrate,
                          ClientPool *client_pool, ThreadPool *thread_pool,
-                         LuaEnvironment *lua_env) {
+                         LuaVMPool *lua_pool) {
   sh->tickrate = tickrate;
   sh->client_pool = client_pool;
   sh->thread_pool = thread_pool;
-  sh->lua_env = lua_env;
+  sh->lua_pool = lua_pool;
+  lua_vm_pool_set_scheduler(lua_pool, schedule_lua_job, thread_pool);
+  sh->connections = NULL;
+  sh->connection_count = 0;
   sh->addrlen = sizeof(sh->address);
+  sh->read_scratch = malloc(READ_SCRATCH_SIZE);
+  if (!sh->read_scratch) {
+    log_error("Failed to allocate read buffer");
+    exit(EXIT_FAILURE);
+  }
 
   if ((sh->server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
     log_error("Socket creation failed: %s", strerror(errno));
@@ -292,10 +844,31 @@ void socket_handler_init(SocketHandler *sh, Tickrate *tickrate,
     exit(EXIT_FAILURE);
   }
 
+  int server_flags = fcntl(sh->server_fd, F_GETFL, 0);
+  fcntl(sh->server_fd, F_SETFL, server_flags | O_NONBLOCK);
+
+  if ((sh->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    log_error("epoll_create1 failed: %s", strerror(errno));
+    close(sh->server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = NULL};
+  if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, sh->server_fd, &ev) < 0) {
+    log_error("Failed to register server socket: %s", strerror(errno));
+    close(sh->epoll_fd);
+    close(sh->server_fd);
+    exit(EXIT_FAILURE);
+  }
+
   log_info("Socket server initialized on port %d", PORT);
 }
 
 void socket_handler_destroy(SocketHandler *sh) {
+  free(sh->read_scratch);
+  sh->read_scratch = NULL;
+  if (sh->epoll_fd > 0)
+    close(sh->epoll_fd);
   if (sh->server_fd > 0) {
     close(sh->server_fd);
     log_info("Closed server socket");
@@ -304,54 +877,53 @@ void socket_handler_destroy(SocketHandler *sh) {
 
 void *socket_listener(void *arg) {
   SocketHandler *sh = (SocketHandler *)arg;
+  struct epoll_event events[MAX_EVENTS];
+  time_t last_sweep = time(NULL);
   log_info("Socket is listening on port %d", PORT);
 
   while (sh->tickrate->is_running) {
-    sh->addrlen = sizeof(sh->address);
-    log_debug("Server on Standby.");
-
-    int client_sock =
-        accept(sh->server_fd, (struct sockaddr *)&sh->address, &sh->addrlen);
-    if (client_sock < 0) {
-      if (errno == EWOULDBLOCK || errno == EAGAIN) {
-        usleep(100000);
-        continue;
-      } else if (errno == EINTR) {
+    int ready = epoll_wait(sh->epoll_fd, events, MAX_EVENTS, 1000);
+    if (ready < 0) {
+      if (errno == EINTR)
         continue;
-      }
-      log_error("Accept failed: %s", strerror(errno));
+      log_error("epoll_wait failed: %s", strerror(errno));
       break;
     }
 
-    int optval = 1;
-    if (setsockopt(client_sock, SOL_SOCKET, SO_KEEPALIVE, &optval,
-                   sizeof(optval)) < 0) {
-      log_error("Failed to set SO_KEEPALIVE on client socket %d: %s",
-                client_sock, strerror(errno));
-      close(client_sock);
-      continue;
-    }
-
-    int client_flags = fcntl(client_sock, F_GETFL, 0);
-    fcntl(client_sock, F_SETFL, client_flags | O_NONBLOCK);
+    for (int i = 0; i < ready; i++) {
+      ClientData *client = events[i].data.ptr;
+      if (!client) {
+        accept_clients(sh);
+        continue;
+      }
+      if (atomic_load(&client->closed))
+        continue;
 
-    ClientData *client = allocate_client(sh->client_pool);
-    if (!client) {
-      log_warn("Client pool full, rejecting connection");
-      close(client_sock);
-      continue;
+      bool alive = true;
+      if (events[i].events & EPOLLOUT)
+        alive = response_flush(client);
+      if (alive && events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        /* Replies made while reading leave together, after the read */
+        response_cork(client);
+        alive = read_client(client);
+        response_uncork(client);
+      }
+      if (events[i].events & EPOLLERR)
+        alive = false;
+      if (!alive)
+        disconnect_client(sh, client);
     }
 
-    *client = (ClientData){.socket = client_sock,
-                           .sh = sh,
-                           .buffer = {0},
-                           .buffer_length = 0,
-                           .last_heartbeat = time(NULL)};
-
-    enqueue_client(sh->thread_pool, client);
-    log_info("Client %d connected to socket", client_sock);
+    time_t now = time(NULL);
+    if (now != last_sweep) {
+      sweep_heartbeats(sh, now);
+      last_sweep = now;
+    }
   }
 
+  while (sh->connections)
+    disconnect_client(sh, sh->connections);
+
   log_info("Socket listener stopped");
   return NULL;
 }
@@ -7,24 +7,32 @@
 #include <arpa/inet.h>
 
 #define PORT 27016
-#define BACKLOG 3
+#define BACKLOG 128
+#define MAX_EVENTS 256
+#define READ_SCRATCH_SIZE 65536
 
 typedef struct SocketHandler {
     int server_fd;
+    int epoll_fd;
     struct sockaddr_in address;
     socklen_t addrlen;
     Tickrate *tickrate;
     ClientPool *client_pool;
     ThreadPool *thread_pool;
-    LuaEnvironment *lua_env;
+    LuaVMPool *lua_pool;
+    ClientData *connections;
+    size_t connection_count;
+    char *read_scratch;
 } SocketHandler;
 
 
-void* handle_client(void *arg);
 void socket_handler_init(SocketHandler *sh, Tickrate *tickrate,
                         ClientPool *client_pool, ThreadPool *thread_pool,
-                        LuaEnvironment *lua_env);
+                        LuaVMPool *lua_pool);
 void* socket_listener(void *arg);
+/* Releases the request's in-flight slot, handing it to the next message
+ * waiting on the connection. */
+void client_request_finished(ClientData *client);
 void socket_handler_destroy(SocketHandler *sh);
 
 #endif
@@ -1,28 +1,69 @@
 #include "socket_pool.h"
 #include "../logging/logging.h"
+#include "../metrics/metrics.h"
 #include "socket.h"
+#include "../network/response.h"
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 void client_pool_init(ClientPool *pool) {
     memset(pool, 0, sizeof(ClientPool));
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        pool->available[i] = 1;
-        pool->available_indices[i] = i;
-    }
-    pool->available_count = MAX_CLIENTS;
     pthread_mutex_init(&pool->lock, NULL);
-    log_debug("Initialized client pool with %d slots", MAX_CLIENTS);
+    pthread_mutex_init(&pool->buffer_lock, NULL);
+    log_debug("Initialized client pool for up to %d clients", MAX_CLIENTS);
+}
+
+void client_pool_destroy(ClientPool *pool) {
+    for (size_t i = 0; i < pool->slab_count; i++) {
+        ClientData *slab = pool->slabs[i];
+        for (int j = 0; j < CLIENT_SLAB_SIZE; j++) {
+            pthread_mutex_destroy(&slab[j].lock);
+            pthread_mutex_destroy(&slab[j].write_lock);
+        }
+        free(slab);
+    }
+    for (int i = 0; i < RECV_BUFFER_CLASSES; i++) {
+        char *buffer = pool->buffer_free[i];
+        while (buffer) {
+            char *next = *(char **)buffer;
+            free(buffer);
+            buffer = next;
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->buffer_lock);
+}
+
+/* Caller holds pool->lock. */
+static bool grow_clients(ClientPool *pool) {
+    if (pool->slab_count == MAX_CLIENTS / CLIENT_SLAB_SIZE) {
+        return false;
+    }
+    ClientData *slab = calloc(CLIENT_SLAB_SIZE, sizeof(ClientData));
+    if (!slab) {
+        log_error("Failed to allocate client slab");
+        return false;
+    }
+    for (int i = CLIENT_SLAB_SIZE - 1; i >= 0; i--) {
+        pthread_mutex_init(&slab[i].lock, NULL);
+        pthread_mutex_init(&slab[i].write_lock, NULL);
+        slab[i].next_free = pool->free_list;
+        pool->free_list = &slab[i];
+    }
+    pool->slabs[pool->slab_count++] = slab;
+    log_debug("Grew client table to %zu slots",
+              pool->slab_count * CLIENT_SLAB_SIZE);
+    return true;
 }
 
 ClientData *allocate_client(ClientPool *pool) {
     pthread_mutex_lock(&pool->lock);
     ClientData *client = NULL;
-    if (pool->available_count > 0) {
-        int index = pool->available_indices[--pool->available_count];
-        client = &pool->clients[index];
-        pool->available[index] = 0;
+    if (pool->free_list || grow_clients(pool)) {
+        client = pool->free_list;
+        pool->free_list = client->next_free;
+        client->next_free = NULL;
     }
     pthread_mutex_unlock(&pool->lock);
     if (!client) {
@@ -33,45 +74,169 @@ ClientData *allocate_client(ClientPool *pool) {
 
 void release_client(ClientPool *pool, ClientData *client) {
     pthread_mutex_lock(&pool->lock);
-    int index = client - pool->clients;
-    if (index >= 0 && index < MAX_CLIENTS) {
-        pool->available[index] = 1;
-        pool->available_indices[pool->available_count++] = index;
-        log_debug("Released client slot %d", index);
+    client->next_free = pool->free_list;
+    pool->free_list = client;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Returns the size class that fits min_capacity, or -1 past the largest. */
+static int buffer_class(size_t min_capacity) {
+    size_t size = RECV_BUFFER_MIN;
+    for (int i = 0; i < RECV_BUFFER_CLASSES; i++, size *= 2) {
+        if (min_capacity <= size) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+char *client_buffer_acquire(ClientPool *pool, size_t min_capacity,
+                            size_t *capacity) {
+    int cls = buffer_class(min_capacity);
+    size_t size = cls < 0 ? min_capacity : (size_t)RECV_BUFFER_MIN << cls;
+    char *buffer = NULL;
+
+    pthread_mutex_lock(&pool->buffer_lock);
+    if (cls >= 0 && pool->buffer_free[cls]) {
+        buffer = pool->buffer_free[cls];
+        pool->buffer_free[cls] = *(char **)buffer;
+        pool->buffer_cached[cls]--;
+    }
+    pthread_mutex_unlock(&pool->buffer_lock);
+
+    if (!buffer) {
+        buffer = malloc(size);
+        if (!buffer) {
+            log_error("Failed to allocate %zu byte receive buffer", size);
+            return NULL;
+        }
+        pthread_mutex_lock(&pool->buffer_lock);
+        pool->buffer_bytes += size;
+        pthread_mutex_unlock(&pool->buffer_lock);
+    }
+    *capacity = size;
+    return buffer;
+}
+
+void client_buffer_release(ClientPool *pool, char *buffer, size_t capacity) {
+    if (!buffer) {
+        return;
+    }
+    int cls = buffer_class(capacity);
+    bool pooled = cls >= 0 && ((size_t)RECV_BUFFER_MIN << cls) == capacity;
+
+    pthread_mutex_lock(&pool->buffer_lock);
+    bool cache = pooled && (pool->buffer_cached[cls] + 1) * capacity <=
+                               RECV_BUFFER_CACHE_BYTES;
+    if (cache) {
+        *(char **)buffer = pool->buffer_free[cls];
+        pool->buffer_free[cls] = buffer;
+        pool->buffer_cached[cls]++;
+    } else {
+        pool->buffer_bytes -= capacity;
+    }
+    pthread_mutex_unlock(&pool->buffer_lock);
+    if (!cache) {
+        free(buffer);
+    }
+}
+
+size_t client_pool_buffer_bytes(ClientPool *pool) {
+    pthread_mutex_lock(&pool->buffer_lock);
+    size_t bytes = pool->buffer_bytes;
+    pthread_mutex_unlock(&pool->buffer_lock);
+    return bytes;
+}
+
+void client_ref(ClientData *client) {
+    atomic_fetch_add(&client->refcount, 1);
+}
+
+void client_unref(ClientData *client) {
+    if (atomic_fetch_sub(&client->refcount, 1) != 1) {
+        return;
+    }
+
+    PendingMessage *msg = client->pending_head;
+    while (msg) {
+        PendingMessage *next = msg->next;
+        free(msg);
+        msg = next;
+    }
+    client->pending_head = client->pending_tail = NULL;
+
+    client_buffer_release(client->sh->client_pool, client->buffer,
+                          client->buffer_capacity);
+    client->buffer = NULL;
+    client->buffer_capacity = 0;
+    response_discard(client);
+    close(client->socket);
+    log_debug("Closed client socket %d", client->socket);
+    release_client(client->sh->client_pool, client);
+}
+
+static void park(ThreadPool *pool, unsigned int seen) {
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->sleepers, 1);
+    while (atomic_load_explicit(&pool->running, memory_order_acquire) &&
+           atomic_load(&pool->epoch) == seen) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
     }
+    atomic_fetch_sub(&pool->sleepers, 1);
     pthread_mutex_unlock(&pool->lock);
 }
 
+static void run_job(ThreadPool *pool, const QueuedJob *job) {
+    uint64_t started = metrics_now_ns();
+    uint64_t waited = started - job->enqueued_ns;
+    histogram_record(&pool->queue_wait, waited);
+    atomic_store_explicit(&pool->last_wait_ns, waited, memory_order_relaxed);
+    job->fn(job->arg);
+
+    uint64_t elapsed = metrics_now_ns() - started;
+    uint64_t average = atomic_load_explicit(&pool->service_ns,
+                                            memory_order_relaxed);
+    average = average - (average >> QUEUE_SERVICE_EWMA_SHIFT) +
+              (elapsed >> QUEUE_SERVICE_EWMA_SHIFT);
+    atomic_store_explicit(&pool->service_ns, average, memory_order_relaxed);
+}
+
 static void *thread_worker(void *arg) {
     ThreadPool *pool = (ThreadPool *)arg;
-    while (1) {
-        pthread_mutex_lock(&pool->queue_lock);
-        while (pool->queue_size == 0 && pool->running) {
-            pthread_cond_wait(&pool->queue_cond, &pool->queue_lock);
+    QueuedJob job;
+    for (;;) {
+        if (job_queue_pop(&pool->queue, &job)) {
+            run_job(pool, &job);
+            continue;
         }
-        if (!pool->running && pool->queue_size == 0) {
-            pthread_mutex_unlock(&pool->queue_lock);
-            break;
+        /* Re-check after sampling the epoch so a push racing with us is
+         * either seen here or wakes us */
+        unsigned int seen = atomic_load(&pool->epoch);
+        if (job_queue_pop(&pool->queue, &job)) {
+            run_job(pool, &job);
+            continue;
         }
-        if (pool->queue_size > 0) {
-            ClientData *client = pool->queue[--pool->queue_size];
-            pthread_mutex_unlock(&pool->queue_lock);
-            if (client) {
-                log_info("Pool worker picked up client %d", client->socket);
-                handle_client(client);
-            }
-        } else {
-            pthread_mutex_unlock(&pool->queue_lock);
+        if (!atomic_load_explicit(&pool->running, memory_order_acquire)) {
+            break;
         }
+        park(pool, seen);
     }
     return NULL;
 }
 
 void thread_pool_init(ThreadPool *pool) {
     memset(pool, 0, sizeof(ThreadPool));
-    pool->running = true;
-    pthread_mutex_init(&pool->queue_lock, NULL);
-    pthread_cond_init(&pool->queue_cond, NULL);
+    if (job_queue_init(&pool->queue, QUEUE_CAPACITY) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&pool->running, true);
+    atomic_store(&pool->epoch, 0);
+    atomic_store(&pool->sleepers, 0);
+    atomic_store(&pool->service_ns, 0);
+    atomic_store(&pool->last_wait_ns, 0);
+    histogram_init(&pool->queue_wait);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
     for (int i = 0; i < THREAD_POOL_SIZE; i++) {
         pthread_create(&pool->threads[i], NULL, thread_worker, pool);
     }
@@ -79,28 +244,63 @@ void thread_pool_init(ThreadPool *pool) {
 }
 
 void thread_pool_shutdown(ThreadPool *pool) {
-    pthread_mutex_lock(&pool->queue_lock);
-    pool->running = false;
-    pthread_cond_broadcast(&pool->queue_cond);
-    pthread_mutex_unlock(&pool->queue_lock);
+    pthread_mutex_lock(&pool->lock);
+    atomic_store_explicit(&pool->running, false, memory_order_release);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
     for (int i = 0; i < THREAD_POOL_SIZE; i++) {
         pthread_join(pool->threads[i], NULL);
     }
-    pthread_mutex_destroy(&pool->queue_lock);
-    pthread_cond_destroy(&pool->queue_cond);
+    job_queue_destroy(&pool->queue);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
     log_info("Thread pool shutdown complete");
 }
 
-void enqueue_client(ThreadPool *pool, ClientData *client) {
-    pthread_mutex_lock(&pool->queue_lock);
-    if (pool->queue_size < QUEUE_CAPACITY) {
-        pool->queue[pool->queue_size++] = client;
-        pthread_cond_signal(&pool->queue_cond);
-        log_debug("Enqueued client %d (queue size: %zu)", client->socket, pool->queue_size);
-    } else {
-        log_warn("Task queue full, rejecting client %d", client->socket);
-        release_client(client->sh->client_pool, client);
-        close(client->socket);
+size_t thread_pool_queue_depth(ThreadPool *pool) {
+    return job_queue_depth(&pool->queue);
+}
+
+uint64_t thread_pool_predicted_wait_ns(ThreadPool *pool) {
+    size_t depth = thread_pool_queue_depth(pool);
+    if (depth == 0) {
+        return 0;
+    }
+    uint64_t service = atomic_load_explicit(&pool->service_ns,
+                                            memory_order_relaxed);
+    if (service == 0) {
+        /* Until run times are known, the wait the last job saw is the guide */
+        return atomic_load_explicit(&pool->last_wait_ns, memory_order_relaxed);
+    }
+    return depth * service / THREAD_POOL_SIZE;
+}
+
+bool thread_pool_admit(ThreadPool *pool, uint64_t *retry_after_ms) {
+    uint64_t wait_ns = thread_pool_predicted_wait_ns(pool);
+    if (wait_ns <= (uint64_t)QUEUE_WAIT_TARGET_MS * 1000000 &&
+        thread_pool_queue_depth(pool) < QUEUE_ADMIT_DEPTH) {
+        return true;
+    }
+    /* By then the backlog ahead of the retry should have drained */
+    *retry_after_ms = wait_ns / 1000000 + 1;
+    return false;
+}
+
+bool thread_pool_submit(ThreadPool *pool, ThreadPoolJobFn fn, void *arg) {
+    if (!atomic_load_explicit(&pool->running, memory_order_acquire)) {
+        return false;
+    }
+    QueuedJob job = {.fn = fn, .arg = arg, .enqueued_ns = metrics_now_ns()};
+    if (!job_queue_push(&pool->queue, &job)) {
+        log_warn("Job queue full, rejecting job");
+        return false;
+    }
+
+    atomic_fetch_add(&pool->epoch, 1);
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
     }
-    pthread_mutex_unlock(&pool->queue_lock);
+    return true;
 }
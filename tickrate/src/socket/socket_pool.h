@@ -1,51 +1,139 @@
 #ifndef SOCKET_POOL_H
 #define SOCKET_POOL_H
 
+#include "../task/job_queue.h"
+#include "../tickrate/histogram.h"
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <time.h>
 
 struct SocketHandler;
+struct OutputChunk;
 typedef struct Tickrate Tickrate;
 typedef struct LuaEnvironment LuaEnvironment;
 
-#define BUFFER_SIZE 16384
-#define MAX_CLIENTS 32
+#define MAX_CLIENTS 65536
+#define CLIENT_SLAB_SIZE 64
+#define RECV_BUFFER_MIN 4096
+#define RECV_BUFFER_CLASSES 9
+#define RECV_BUFFER_CACHE_BYTES (4 * 1024 * 1024)
 #define THREAD_POOL_SIZE 8
-#define QUEUE_CAPACITY 64
+#define QUEUE_CAPACITY 4096
+#define QUEUE_ADMIT_DEPTH (QUEUE_CAPACITY / 2)
+#define QUEUE_WAIT_TARGET_MS 100
+#define QUEUE_SERVICE_EWMA_SHIFT 3
+#define CLIENT_MAX_IN_FLIGHT 32
+#define CLIENT_MAX_IN_FLIGHT_LIMIT 256
 
-typedef struct {
+typedef struct PendingMessage {
+  struct PendingMessage *next;
+  struct ClientData *client;
+  int encoding;
+  bool compressed;
+  size_t length;
+  char data[];
+} PendingMessage;
+
+typedef struct ClientData {
   int socket;
-  char buffer[BUFFER_SIZE];
+  char *buffer;
   size_t buffer_length;
+  size_t buffer_capacity;
+  size_t scan_offset;
+  size_t frame_length;
+  atomic_int framing;
+  atomic_int encoding;
+  atomic_int compression;
+  size_t compression_threshold;
+  bool greeted;
+  pthread_mutex_t write_lock;
+  struct OutputChunk *output_head;
+  struct OutputChunk *output_tail;
+  size_t output_bytes;
+  uint32_t interest;
+  int cork;
+  bool reading_paused;
   struct SocketHandler *sh;
   time_t last_heartbeat;
+  time_t last_heartbeat_sent;
+  atomic_int refcount;
+  atomic_bool closed;
+  pthread_mutex_t lock;
+  PendingMessage *pending_head;
+  PendingMessage *pending_tail;
+  size_t in_flight;
+  size_t max_in_flight;
+  struct ClientData *prev;
+  struct ClientData *next;
+  struct ClientData *next_free;
 } ClientData;
 
+/*
+ * Connections live in slabs of CLIENT_SLAB_SIZE that are allocated as the
+ * table grows and never move, so a ClientData pointer stays valid for as
+ * long as a reference is held. An idle connection owns no receive buffer:
+ * one is attached from the size classes below only while a partial frame is
+ * waiting for the rest of its bytes, and returned once it completes. Classes
+ * double from RECV_BUFFER_MIN; larger frames get an exact allocation that is
+ * not cached.
+ */
 typedef struct {
-  ClientData clients[MAX_CLIENTS];
-  int available[MAX_CLIENTS];
-  int available_indices[MAX_CLIENTS];
-  int available_count;
+  ClientData *slabs[MAX_CLIENTS / CLIENT_SLAB_SIZE];
+  size_t slab_count;
+  ClientData *free_list;
   pthread_mutex_t lock;
+  char *buffer_free[RECV_BUFFER_CLASSES];
+  size_t buffer_cached[RECV_BUFFER_CLASSES];
+  size_t buffer_bytes;
+  pthread_mutex_t buffer_lock;
 } ClientPool;
 
+typedef void (*ThreadPoolJobFn)(void *arg);
+
+/*
+ * Request execution pool. Jobs wait in a bounded lock-free FIFO; idle
+ * workers park on a condition variable behind an epoch counter, as the
+ * executor's do. Workers record how long each job waited and keep a moving
+ * average of how long jobs run, from which thread_pool_admit predicts the
+ * wait a new request would see; before any run time is known, the last
+ * job's actual wait stands in. Past QUEUE_WAIT_TARGET_MS, or once the
+ * queue is half full, new requests are turned away so the ones already
+ * admitted still finish on time; the other half of the queue stays free
+ * for work already in progress, such as resumed asynchronous calls.
+ */
 typedef struct {
   pthread_t threads[THREAD_POOL_SIZE];
-  pthread_mutex_t queue_lock;
-  pthread_cond_t queue_cond;
-  ClientData *queue[QUEUE_CAPACITY];
-  size_t queue_size;
-  bool running;
+  JobQueue queue;
+  atomic_bool running;
+  atomic_uint epoch;
+  atomic_int sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  atomic_uint_fast64_t service_ns;
+  atomic_uint_fast64_t last_wait_ns;
+  Histogram queue_wait;
 } ThreadPool;
 
 void client_pool_init(ClientPool *pool);
+void client_pool_destroy(ClientPool *pool);
 ClientData *allocate_client(ClientPool *pool);
 void release_client(ClientPool *pool, ClientData *client);
+char *client_buffer_acquire(ClientPool *pool, size_t min_capacity,
+                            size_t *capacity);
+void client_buffer_release(ClientPool *pool, char *buffer, size_t capacity);
+size_t client_pool_buffer_bytes(ClientPool *pool);
+void client_ref(ClientData *client);
+void client_unref(ClientData *client);
 
 void thread_pool_init(ThreadPool *pool);
 void thread_pool_shutdown(ThreadPool *pool);
-void enqueue_client(ThreadPool *pool, ClientData *client);
+bool thread_pool_submit(ThreadPool *pool, ThreadPoolJobFn fn, void *arg);
+bool thread_pool_admit(ThreadPool *pool, uint64_t *retry_after_ms);
+uint64_t thread_pool_predicted_wait_ns(ThreadPool *pool);
+size_t thread_pool_queue_depth(ThreadPool *pool);
 
 #endif
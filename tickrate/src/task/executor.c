@@ -0,0 +1,229 @@
+#include "executor.h"
+#include "task_manager.h"
+#include "../logging/logging.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static _Thread_local ExecutorWorker *current_worker;
+
+static unsigned int next_random(ExecutorWorker *worker) {
+  unsigned int x = worker->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  worker->seed = x;
+  return x;
+}
+
+static Task *find_task(ExecutorWorker *self) {
+  Executor *executor = self->executor;
+  Task *task = ws_deque_pop(&self->deque);
+  if (task)
+    return task;
+
+  task = ws_deque_steal(&executor->injector);
+  if (task)
+    return task;
+
+  size_t count = executor->worker_count;
+  size_t start = next_random(self) % count;
+  for (size_t i = 0; i < count; i++) {
+    ExecutorWorker *victim = &executor->workers[(start + i) % count];
+    if (victim == self)
+      continue;
+    task = ws_deque_steal(&victim->deque);
+    if (task) {
+      atomic_fetch_add_explicit(&self->stolen, 1, memory_order_relaxed);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+static void park(Executor *executor, unsigned int seen) {
+  pthread_mutex_lock(&executor->lock);
+  atomic_fetch_add(&executor->sleepers, 1);
+  while (atomic_load_explicit(&executor->running, memory_order_acquire) &&
+         atomic_load(&executor->epoch) == seen)
+    pthread_cond_wait(&executor->cond, &executor->lock);
+  atomic_fetch_sub(&executor->sleepers, 1);
+  pthread_mutex_unlock(&executor->lock);
+}
+
+static void run_task(ExecutorWorker *self, Task *task) {
+  task_record_start(self->executor->task_manager, task);
+  if (task->task_function)
+    task->task_function(task->arg);
+  free(task);
+  atomic_fetch_add_explicit(&self->executed, 1, memory_order_relaxed);
+}
+
+static void *worker_main(void *arg) {
+  ExecutorWorker *self = arg;
+  Executor *executor = self->executor;
+  current_worker = self;
+
+  while (atomic_load_explicit(&executor->running, memory_order_acquire)) {
+    Task *task = find_task(self);
+    if (!task) {
+      /* Re-scan after sampling the epoch so a push racing with us is seen
+       * either here or by the epoch check in park(). */
+      unsigned int seen = atomic_load(&executor->epoch);
+      task = find_task(self);
+      if (!task) {
+        park(executor, seen);
+        continue;
+      }
+    }
+    run_task(self, task);
+  }
+
+  current_worker = NULL;
+  return NULL;
+}
+
+static size_t release_tasks(WsDeque *deque) {
+  size_t released = 0;
+  Task *task;
+  while ((task = ws_deque_pop(deque)) != NULL) {
+    free(task);
+    released++;
+  }
+  return released;
+}
+
+static void stop_workers(Executor *executor, size_t started) {
+  pthread_mutex_lock(&executor->lock);
+  atomic_store_explicit(&executor->running, false, memory_order_release);
+  pthread_cond_broadcast(&executor->cond);
+  pthread_mutex_unlock(&executor->lock);
+
+  for (size_t i = 0; i < started; i++)
+    pthread_join(executor->workers[i].thread, NULL);
+}
+
+static void free_executor(Executor *executor) {
+  size_t released = release_tasks(&executor->injector);
+  ws_deque_destroy(&executor->injector);
+  for (size_t i = 0; i < executor->worker_count; i++) {
+    released += release_tasks(&executor->workers[i].deque);
+    ws_deque_destroy(&executor->workers[i].deque);
+  }
+  if (released > 0)
+    log_warn("Dropped %zu queued parallel tasks", released);
+
+  pthread_mutex_destroy(&executor->lock);
+  pthread_cond_destroy(&executor->cond);
+  free(executor->workers);
+  free(executor);
+}
+
+Executor *executor_create(TaskManager *task_manager, size_t workers) {
+  if (workers == EXECUTOR_AUTO_WORKERS) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    /* Leave one core to the tick thread. */
+    workers = cpus > 1 ? (size_t)(cpus - 1) : 1;
+  }
+
+  Executor *executor = calloc(1, sizeof(Executor));
+  if (!executor) {
+    log_error("Executor allocation failed");
+    return NULL;
+  }
+  executor->workers = calloc(workers, sizeof(ExecutorWorker));
+  if (!executor->workers ||
+      ws_deque_init(&executor->injector, EXECUTOR_DEQUE_CAPACITY) != 0) {
+    log_error("Executor allocation failed");
+    free(executor->workers);
+    free(executor);
+    return NULL;
+  }
+
+  executor->task_manager = task_manager;
+  executor->worker_count = workers;
+  pthread_mutex_init(&executor->lock, NULL);
+  pthread_cond_init(&executor->cond, NULL);
+  atomic_store(&executor->epoch, 0);
+  atomic_store(&executor->sleepers, 0);
+  atomic_store(&executor->running, true);
+
+  for (size_t i = 0; i < workers; i++) {
+    ExecutorWorker *worker = &executor->workers[i];
+    worker->executor = executor;
+    worker->index = i;
+    worker->seed = (unsigned int)(i * 2654435761u) | 1;
+    atomic_store(&worker->executed, 0);
+    atomic_store(&worker->stolen, 0);
+    if (ws_deque_init(&worker->deque, EXECUTOR_DEQUE_CAPACITY) != 0) {
+      executor->worker_count = i;
+      stop_workers(executor, 0);
+      free_executor(executor);
+      return NULL;
+    }
+  }
+
+  for (size_t i = 0; i < workers; i++) {
+    int rc = pthread_create(&executor->workers[i].thread, NULL, worker_main,
+                            &executor->workers[i]);
+    if (rc != 0) {
+      log_error("Executor worker creation failed: %s", strerror(rc));
+      stop_workers(executor, i);
+      free_executor(executor);
+      return NULL;
+    }
+  }
+
+  log_info("Started executor with %zu workers", workers);
+  return executor;
+}
+
+void executor_destroy(Executor *executor) {
+  if (!executor)
+    return;
+  stop_workers(executor, executor->worker_count);
+
+  size_t stolen = 0;
+  for (size_t i = 0; i < executor->worker_count; i++)
+    stolen += atomic_load(&executor->workers[i].stolen);
+  log_info("Stopped executor: %zu tasks run, %zu stolen between workers",
+           executor_executed(executor), stolen);
+  free_executor(executor);
+}
+
+int executor_dispatch(Executor *executor, Task *task) {
+  return ws_deque_push(&executor->injector, task);
+}
+
+bool executor_submit_local(Executor *executor, Task *task) {
+  ExecutorWorker *self = current_worker;
+  if (!self || self->executor != executor)
+    return false;
+  if (ws_deque_push(&self->deque, task) != 0)
+    return false;
+  executor_notify(executor, 1);
+  return true;
+}
+
+void executor_notify(Executor *executor, size_t count) {
+  if (count == 0)
+    return;
+  atomic_fetch_add(&executor->epoch, 1);
+  if (atomic_load(&executor->sleepers) == 0)
+    return;
+
+  pthread_mutex_lock(&executor->lock);
+  if (count == 1)
+    pthread_cond_signal(&executor->cond);
+  else
+    pthread_cond_broadcast(&executor->cond);
+  pthread_mutex_unlock(&executor->lock);
+}
+
+size_t executor_executed(Executor *executor) {
+  size_t executed = 0;
+  for (size_t i = 0; i < executor->worker_count; i++)
+    executed += atomic_load_explicit(&executor->workers[i].executed,
+                                     memory_order_relaxed);
+  return executed;
+}
@@ -0,0 +1,55 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include "task.h"
+#include "ws_deque.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Off by default: without it, tasks run on the tick thread as they always have */
+#define EXECUTOR_ENABLED 0
+#define EXECUTOR_AUTO_WORKERS 0
+#define EXECUTOR_DEQUE_CAPACITY 1024
+
+typedef struct Executor Executor;
+
+typedef struct ExecutorWorker {
+    Executor *executor;
+    pthread_t thread;
+    WsDeque deque;
+    size_t index;
+    unsigned int seed;
+    atomic_size_t executed;
+    atomic_size_t stolen;
+} ExecutorWorker;
+
+/*
+ * Parallel lane for the TaskManager. The tick thread owns the injector deque
+ * and pushes ready tasks onto it; workers steal from it in FIFO order, and
+ * from each other's deques once it runs dry. Tasks submitted from a worker
+ * go straight onto that worker's own deque. Idle workers park on a condition
+ * variable guarded by an epoch counter, so notifiers only take the lock when
+ * someone is actually asleep.
+ */
+struct Executor {
+    TaskManager *task_manager;
+    WsDeque injector;
+    ExecutorWorker *workers;
+    size_t worker_count;
+    atomic_bool running;
+    atomic_uint epoch;
+    atomic_int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+Executor *executor_create(TaskManager *task_manager, size_t workers);
+void executor_destroy(Executor *executor);
+int executor_dispatch(Executor *executor, Task *task);
+bool executor_submit_local(Executor *executor, Task *task);
+void executor_notify(Executor *executor, size_t count);
+size_t executor_executed(Executor *executor);
+
+#endif
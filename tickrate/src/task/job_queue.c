@@ -0,0 +1,82 @@
+#include "job_queue.h"
+#include "../logging/logging.h"
+#include <stdlib.h>
+
+int job_queue_init(JobQueue *queue, size_t capacity) {
+  size_t rounded = 2;
+  while (rounded < capacity)
+    rounded <<= 1;
+
+  queue->cells = malloc(rounded * sizeof(JobQueueCell));
+  if (!queue->cells) {
+    log_error("Job queue allocation failed");
+    return -1;
+  }
+  for (size_t i = 0; i < rounded; i++)
+    atomic_store_explicit(&queue->cells[i].sequence, i, memory_order_relaxed);
+  queue->mask = rounded - 1;
+  atomic_store_explicit(&queue->enqueue_pos, 0, memory_order_relaxed);
+  atomic_store_explicit(&queue->dequeue_pos, 0, memory_order_relaxed);
+  return 0;
+}
+
+void job_queue_destroy(JobQueue *queue) {
+  free(queue->cells);
+  queue->cells = NULL;
+}
+
+bool job_queue_push(JobQueue *queue, const QueuedJob *job) {
+  size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+  for (;;) {
+    JobQueueCell *cell = &queue->cells[pos & queue->mask];
+    size_t sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos,
+                                                pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        cell->job = *job;
+        atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      /* The consumer one lap behind has not freed this cell: full */
+      return false;
+    } else {
+      pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+bool job_queue_pop(JobQueue *queue, QueuedJob *job) {
+  size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+  for (;;) {
+    JobQueueCell *cell = &queue->cells[pos & queue->mask];
+    size_t sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos,
+                                                pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        *job = cell->job;
+        atomic_store_explicit(&cell->sequence, pos + queue->mask + 1,
+                              memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+size_t job_queue_depth(JobQueue *queue) {
+  size_t dequeued =
+      atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+  size_t enqueued =
+      atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+  return enqueued > dequeued ? enqueued - dequeued : 0;
+}
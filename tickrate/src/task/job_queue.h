@@ -0,0 +1,40 @@
+#ifndef JOB_QUEUE_H
+#define JOB_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct QueuedJob {
+    void (*fn)(void *arg);
+    void *arg;
+    uint64_t enqueued_ns;
+} QueuedJob;
+
+typedef struct JobQueueCell {
+    atomic_size_t sequence;
+    QueuedJob job;
+} JobQueueCell;
+
+/*
+ * Bounded multi-producer/multi-consumer FIFO (Vyukov). Each cell carries a
+ * sequence number that tells producers and consumers whose turn it is, so
+ * a push or pop is one compare-and-swap on its cursor plus a release store
+ * on the cell, with no lock. A full queue fails the push instead of
+ * blocking. The capacity is rounded up to a power of two.
+ */
+typedef struct JobQueue {
+    JobQueueCell *cells;
+    size_t mask;
+    atomic_size_t enqueue_pos;
+    atomic_size_t dequeue_pos;
+} JobQueue;
+
+int job_queue_init(JobQueue *queue, size_t capacity);
+void job_queue_destroy(JobQueue *queue);
+bool job_queue_push(JobQueue *queue, const QueuedJob *job);
+bool job_queue_pop(JobQueue *queue, QueuedJob *job);
+size_t job_queue_depth(JobQueue *queue);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Intrusive multi-producer/single-consumer queue (Vyukov). Producers never
+ * block or retry: a push is one atomic exchange plus one store. The single
+ * consumer pops in arrival order without locks. A pop can briefly return
+ * NULL while a producer is between its exchange and its store; the node
+ * becomes visible on the next pop.
+ */
+typedef struct MpscNode {
+    _Atomic(struct MpscNode *) next;
+} MpscNode;
+
+typedef struct MpscQueue {
+    _Atomic(MpscNode *) head;
+    MpscNode *tail;
+    MpscNode stub;
+} MpscQueue;
+
+void mpsc_queue_init(MpscQueue *queue);
+void mpsc_queue_push(MpscQueue *queue, MpscNode *node);
+MpscNode *mpsc_queue_pop(MpscQueue *queue);
+
+#define mpsc_container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#endif
@@ -1,25 +1,52 @@
 #ifndef TASK_H
 #define TASK_H
 
+#include "mpsc_queue.h"
+#include "timer_wheel.h"
+#include "../tickrate/histogram.h"
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 
+struct Executor;
+
+typedef enum {
+    TASK_LANE_PARALLEL,
+    TASK_LANE_SERIAL
+} TaskLane;
 
 typedef struct Task {
     int id;
     char name[256];
-    void (*task_function)(void);
+    void (*task_function)(void *arg);
+    void *arg;
+    TaskLane lane;
+    uint64_t submitted_ns;
     struct Task *next;
-    pthread_mutex_t lock;
+    MpscNode node;
 } Task;
 
+/*
+ * Producers push onto the lock-free submissions queue and poke wake_fd (an
+ * eventfd) at most once until the tick thread re-arms it. Everything else is
+ * owned by the tick thread. With an executor attached, the tick thread hands
+ * parallel-lane tasks to its workers as they are drained and only keeps the
+ * serial lane, which it runs in submission order within the tick budget.
+ * Without one, both lanes run inline on the tick thread. queue_wait records
+ * submit-to-start latency in nanoseconds from whichever thread runs the task.
+ */
 typedef struct TaskManager {
+    MpscQueue submissions;
     Task *tasks;
-    Task *new_tasks;
-    Task *scheduled_tasks;
+    Task *tasks_tail;
+    TimerWheel timers;
+    struct Executor *executor;
     size_t task_count;
     size_t tasks_processed;
-    pthread_mutex_t lock;
-    pthread_cond_t task_available;
+    size_t tasks_dispatched;
+    Histogram queue_wait;
+    int wake_fd;
+    atomic_bool wake_pending;
 } TaskManager;
 
 #endif
@@ -1,85 +1,211 @@
 #include "task_manager.h"
+#include "executor.h"
 #include "../logging/logging.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <pthread.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 int initialize_task_manager(TaskManager * tm) {
   if (!tm) return -1;
-  tm -> tasks = tm -> new_tasks = tm -> scheduled_tasks = NULL;
-  tm -> task_count = tm -> tasks_processed = 0;
-
-  if (pthread_mutex_init( & tm -> lock, NULL) != 0) {
-    log_error("Mutex init failed");
+  mpsc_queue_init( & tm -> submissions);
+  tm -> tasks = tm -> tasks_tail = NULL;
+  tm -> executor = NULL;
+  tm -> task_count = tm -> tasks_processed = tm -> tasks_dispatched = 0;
+  histogram_init( & tm -> queue_wait);
+  atomic_store( & tm -> wake_pending, false);
+
+  tm -> wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (tm -> wake_fd < 0) {
+    log_error("Task wakeup eventfd creation failed: %s", strerror(errno));
     return -1;
   }
 
-  if (pthread_cond_init( & tm -> task_available, NULL) != 0) {
-    pthread_mutex_destroy( & tm -> lock);
-    log_error("Condition variable initialization failed");
+  if (timer_wheel_init( & tm -> timers) != 0) {
+    close(tm -> wake_fd);
     return -1;
   }
 
   return 0;
 }
 
-void destroy_task_manager(TaskManager * tm) {
+void destroy_task_manager(TaskManager * tm, void( * release_timer)(void * arg)) {
   if (!tm) return;
-  pthread_mutex_destroy( & tm -> lock);
-  pthread_cond_destroy( & tm -> task_available);
+  task_manager_stop_executor(tm);
+  update_tasks(tm);
+  while (tm -> tasks) {
+    Task * next = tm -> tasks -> next;
+    free(tm -> tasks);
+    tm -> tasks = next;
+  }
+  timer_wheel_destroy( & tm -> timers, release_timer);
+  close(tm -> wake_fd);
   log_info("Destroyed TaskManager");
 }
 
 int update_tasks(TaskManager * tm) {
   if (!tm) return -1;
 
-  pthread_mutex_lock( & tm -> lock);
-  size_t initial_count = tm -> task_count;
+  size_t added = 0, dispatched = 0;
+  MpscNode * node;
+  while ((node = mpsc_queue_pop( & tm -> submissions)) != NULL) {
+    Task * task = mpsc_container_of(node, Task, node);
+    if (task -> lane == TASK_LANE_PARALLEL && tm -> executor &&
+      executor_dispatch(tm -> executor, task) == 0) {
+      dispatched++;
+      continue;
+    }
+    task -> next = NULL;
+    if (tm -> tasks_tail) tm -> tasks_tail -> next = task;
+    else tm -> tasks = task;
+    tm -> tasks_tail = task;
+    added++;
+  }
+  tm -> task_count += added;
+  tm -> tasks_dispatched += dispatched;
+  if (dispatched > 0) executor_notify(tm -> executor, dispatched);
 
-  Task * current = tm -> new_tasks;
-  while (current) {
-    Task * next = current -> next;
-    current -> next = tm -> tasks;
-    tm -> tasks = current;
-    tm -> task_count++;
-    current = next;
+  if (added > 0 || dispatched > 0) {
+    log_debug("Added %zu new tasks, dispatched %zu to workers", added, dispatched);
   }
 
-  tm -> new_tasks = NULL;
-  size_t added = tm -> task_count - initial_count;
-  pthread_mutex_unlock( & tm -> lock);
+  return 0;
+}
+
+static int enqueue_task(TaskManager * tm, const char * name,
+  void( * fn)(void * arg), void * arg, TaskLane lane) {
+  if (!tm || !fn) return -1;
+
+  Task * task = calloc(1, sizeof(Task));
+  if (!task) {
+    log_error("Failed to allocate task");
+    return -1;
+  }
+  task -> task_function = fn;
+  task -> arg = arg;
+  task -> lane = lane;
+  task -> submitted_ns = task_clock_ns();
+  if (name) {
+    strncpy(task -> name, name, sizeof(task -> name) - 1);
+  }
 
-  if (added > 0) {
-    log_debug("Added %zu new tasks", added);
+  /* Tasks spawned by a worker stay on that worker's deque. */
+  if (lane == TASK_LANE_PARALLEL && tm -> executor &&
+    executor_submit_local(tm -> executor, task)) {
+    return 0;
   }
 
+  mpsc_queue_push( & tm -> submissions, & task -> node);
+
+  if (!atomic_exchange_explicit( & tm -> wake_pending, true, memory_order_seq_cst)) {
+    uint64_t one = 1;
+    if (write(tm -> wake_fd, & one, sizeof(one)) < 0 && errno != EAGAIN) {
+      log_warn("Task wakeup failed: %s", strerror(errno));
+    }
+  }
   return 0;
 }
 
-int process_task(TaskManager * tm) {
-  if (!tm) return -1;
+int submit_task(TaskManager * tm, const char * name, void( * fn)(void * arg),
+  void * arg) {
+  return enqueue_task(tm, name, fn, arg, TASK_LANE_PARALLEL);
+}
+
+int submit_serial_task(TaskManager * tm, const char * name,
+  void( * fn)(void * arg), void * arg) {
+  return enqueue_task(tm, name, fn, arg, TASK_LANE_SERIAL);
+}
+
+/* Call before the tick thread starts; workers are optional. */
+int task_manager_start_executor(TaskManager * tm, size_t workers) {
+  if (!tm || tm -> executor) return -1;
+  tm -> executor = executor_create(tm, workers);
+  return tm -> executor ? 0 : -1;
+}
+
+/* Call once the tick thread has stopped dispatching. */
+void task_manager_stop_executor(TaskManager * tm) {
+  if (!tm || !tm -> executor) return;
+  executor_destroy(tm -> executor);
+  tm -> executor = NULL;
+}
+
+void task_manager_clear_wakeup(TaskManager * tm) {
+  uint64_t count;
+  while (read(tm -> wake_fd, & count, sizeof(count)) > 0) {
+  }
+  /* The flag must be clear before the caller looks at the queue again, or a
+   * push that still saw it set would skip the eventfd and go unnoticed. */
+  atomic_store_explicit( & tm -> wake_pending, false, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+uint64_t task_clock_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, & now);
+  return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
 
-  pthread_mutex_lock( & tm -> lock);
+void task_record_start(TaskManager * tm, const Task * task) {
+  uint64_t now = task_clock_ns();
+  histogram_record( & tm -> queue_wait,
+    now > task -> submitted_ns ? now - task -> submitted_ns : 0);
+}
 
-  while (tm -> task_count == 0) {
-    pthread_cond_wait( & tm -> task_available, & tm -> lock);
+static void run_task(TaskManager * tm, Task * task) {
+  task_record_start(tm, task);
+  if (task -> task_function) {
+    task -> task_function(task -> arg);
   }
+  free(task);
+  tm -> tasks_processed++;
+}
 
+static Task * pop_ready(TaskManager * tm) {
   Task * task = tm -> tasks;
   if (task) {
     tm -> tasks = task -> next;
+    if (!tm -> tasks) tm -> tasks_tail = NULL;
     tm -> task_count--;
   }
+  return task;
+}
 
-  pthread_mutex_unlock( & tm -> lock);
+int process_task(TaskManager * tm) {
+  if (!tm) return -1;
 
-  if (task && task -> task_function) {
-    task -> task_function();
-    free(task);
-    tm -> tasks_processed++;
-    log_info("Processed task (total: %zu)", tm -> tasks_processed);
+  Task * task = pop_ready(tm);
+  if (task) {
+    run_task(tm, task);
+    log_debug("Processed task (total: %zu)", tm -> tasks_processed);
   }
 
   return 0;
 }
+
+static bool deadline_passed(const struct timespec * deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, & now);
+  return now.tv_sec > deadline -> tv_sec ||
+    (now.tv_sec == deadline -> tv_sec && now.tv_nsec >= deadline -> tv_nsec);
+}
+
+size_t process_tasks(TaskManager * tm, const struct timespec * deadline) {
+  if (!tm) return 0;
+
+  size_t processed = 0;
+  Task * task;
+  while ((task = pop_ready(tm)) != NULL) {
+    run_task(tm, task);
+    processed++;
+    if (tm -> tasks && deadline_passed(deadline)) break;
+  }
+
+  if (processed > 0) {
+    log_debug("Processed %zu tasks (total: %zu)", processed, tm -> tasks_processed);
+  }
+  return processed;
+}
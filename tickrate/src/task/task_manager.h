@@ -2,10 +2,21 @@
 #define TASK_MANAGER_H
 
 #include "task.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
 int initialize_task_manager(TaskManager *tm);
-void destroy_task_manager(TaskManager *tm);
+void destroy_task_manager(TaskManager *tm, void (*release_timer)(void *arg));
+int submit_task(TaskManager *tm, const char *name, void (*fn)(void *arg), void *arg);
+int submit_serial_task(TaskManager *tm, const char *name, void (*fn)(void *arg), void *arg);
+int task_manager_start_executor(TaskManager *tm, size_t workers);
+void task_manager_stop_executor(TaskManager *tm);
 int update_tasks(TaskManager *tm);
 int process_task(TaskManager *tm);
+size_t process_tasks(TaskManager *tm, const struct timespec *deadline);
+void task_manager_clear_wakeup(TaskManager *tm);
+uint64_t task_clock_ns(void);
+void task_record_start(TaskManager *tm, const Task *task);
 
 #endif
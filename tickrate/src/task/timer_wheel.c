@@ -0,0 +1,221 @@
+#include "timer_wheel.h"
+#include "../logging/logging.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TIMER_INITIAL_CAPACITY 1024
+
+static uint32_t *slot_head(TimerWheel *wheel, uint16_t slot) {
+  return &wheel->slots[slot];
+}
+
+static void link_entry(TimerWheel *wheel, uint32_t index) {
+  TimerEntry *entry = &wheel->entries[index];
+  uint64_t delta = entry->expires - wheel->now;
+  int level = 0;
+  if ((int64_t)delta < 0) {
+    entry->expires = wheel->now;
+    delta = 0;
+  }
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= ((uint64_t)1 << ((level + 1) * TIMER_WHEEL_BITS)))
+    level++;
+
+  uint16_t slot =
+      level * TIMER_WHEEL_SLOTS +
+      ((entry->expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+  uint32_t *head = slot_head(wheel, slot);
+  entry->slot = slot;
+  entry->prev = TIMER_NONE;
+  entry->next = *head;
+  if (*head != TIMER_NONE)
+    wheel->entries[*head].prev = index;
+  *head = index;
+}
+
+static void unlink_entry(TimerWheel *wheel, uint32_t index) {
+  TimerEntry *entry = &wheel->entries[index];
+  if (entry->prev != TIMER_NONE)
+    wheel->entries[entry->prev].next = entry->next;
+  else
+    *slot_head(wheel, entry->slot) = entry->next;
+  if (entry->next != TIMER_NONE)
+    wheel->entries[entry->next].prev = entry->prev;
+}
+
+static void release_entry(TimerWheel *wheel, uint32_t index) {
+  TimerEntry *entry = &wheel->entries[index];
+  entry->active = false;
+  entry->generation++;
+  entry->next = wheel->free_head;
+  wheel->free_head = index;
+  wheel->pending--;
+}
+
+static bool grow_entries(TimerWheel *wheel) {
+  uint32_t capacity =
+      wheel->capacity ? wheel->capacity * 2 : TIMER_INITIAL_CAPACITY;
+  if (capacity <= wheel->capacity || capacity == TIMER_NONE)
+    return false;
+  TimerEntry *entries = realloc(wheel->entries, capacity * sizeof(TimerEntry));
+  if (!entries)
+    return false;
+
+  for (uint32_t i = wheel->capacity; i < capacity; i++) {
+    entries[i].active = false;
+    entries[i].generation = 1;
+    entries[i].next = i + 1 < capacity ? i + 1 : wheel->free_head;
+  }
+  wheel->free_head = wheel->capacity;
+  wheel->entries = entries;
+  wheel->capacity = capacity;
+  return true;
+}
+
+int timer_wheel_init(TimerWheel *wheel) {
+  memset(wheel, 0, sizeof(TimerWheel));
+  for (size_t i = 0; i < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; i++)
+    wheel->slots[i] = TIMER_NONE;
+  wheel->free_head = TIMER_NONE;
+
+  if (!grow_entries(wheel)) {
+    log_error("Timer wheel allocation failed");
+    return -1;
+  }
+  if (pthread_mutex_init(&wheel->lock, NULL) != 0) {
+    log_error("Timer wheel mutex init failed");
+    free(wheel->entries);
+    return -1;
+  }
+  return 0;
+}
+
+void timer_wheel_destroy(TimerWheel *wheel, void (*release)(void *arg)) {
+  if (release) {
+    for (uint32_t i = 0; i < wheel->capacity; i++) {
+      if (wheel->entries[i].active)
+        release(wheel->entries[i].arg);
+    }
+  }
+  free(wheel->entries);
+  free(wheel->firing);
+  pthread_mutex_destroy(&wheel->lock);
+}
+
+TimerHandle timer_wheel_schedule(TimerWheel *wheel, uint64_t delay_ticks,
+                                 TimerCallback callback, void *arg) {
+  if (delay_ticks == 0)
+    delay_ticks = 1;
+  if (delay_ticks >= TIMER_WHEEL_MAX_DELAY)
+    delay_ticks = TIMER_WHEEL_MAX_DELAY - 1;
+
+  pthread_mutex_lock(&wheel->lock);
+  if (wheel->free_head == TIMER_NONE && !grow_entries(wheel)) {
+    pthread_mutex_unlock(&wheel->lock);
+    log_error("Timer wheel is full");
+    return 0;
+  }
+
+  uint32_t index = wheel->free_head;
+  TimerEntry *entry = &wheel->entries[index];
+  wheel->free_head = entry->next;
+  entry->expires = wheel->now + delay_ticks - 1;
+  entry->callback = callback;
+  entry->arg = arg;
+  entry->active = true;
+  link_entry(wheel, index);
+  wheel->pending++;
+  TimerHandle handle = ((TimerHandle)entry->generation << 32) | index;
+  pthread_mutex_unlock(&wheel->lock);
+  return handle;
+}
+
+bool timer_wheel_cancel(TimerWheel *wheel, TimerHandle handle, void **arg) {
+  uint32_t index = (uint32_t)handle;
+  uint32_t generation = (uint32_t)(handle >> 32);
+  bool cancelled = false;
+
+  pthread_mutex_lock(&wheel->lock);
+  if (index < wheel->capacity) {
+    TimerEntry *entry = &wheel->entries[index];
+    if (entry->active && entry->generation == generation) {
+      unlink_entry(wheel, index);
+      if (arg)
+        *arg = entry->arg;
+      release_entry(wheel, index);
+      cancelled = true;
+    }
+  }
+  pthread_mutex_unlock(&wheel->lock);
+  return cancelled;
+}
+
+static void cascade(TimerWheel *wheel, int level) {
+  uint16_t slot =
+      level * TIMER_WHEEL_SLOTS +
+      ((wheel->now >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+  uint32_t index = wheel->slots[slot];
+  wheel->slots[slot] = TIMER_NONE;
+  while (index != TIMER_NONE) {
+    uint32_t next = wheel->entries[index].next;
+    link_entry(wheel, index);
+    index = next;
+  }
+}
+
+static bool reserve_firing(TimerWheel *wheel, size_t count) {
+  if (count <= wheel->firing_capacity)
+    return true;
+  size_t capacity = wheel->firing_capacity ? wheel->firing_capacity : 64;
+  while (capacity < count)
+    capacity *= 2;
+  TimerFiring *firing = realloc(wheel->firing, capacity * sizeof(TimerFiring));
+  if (!firing)
+    return false;
+  wheel->firing = firing;
+  wheel->firing_capacity = capacity;
+  return true;
+}
+
+size_t timer_wheel_advance(TimerWheel *wheel) {
+  size_t count = 0;
+
+  pthread_mutex_lock(&wheel->lock);
+  for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    if ((wheel->now >> ((level - 1) * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK)
+      break;
+    cascade(wheel, level);
+  }
+
+  uint32_t *head = slot_head(wheel, wheel->now & TIMER_WHEEL_MASK);
+  uint32_t index = *head;
+  *head = TIMER_NONE;
+  while (index != TIMER_NONE) {
+    TimerEntry *entry = &wheel->entries[index];
+    uint32_t next = entry->next;
+    if (!reserve_firing(wheel, count + 1)) {
+      /* Out of memory: put the rest back and retry them next tick. */
+      entry->expires = wheel->now + 1;
+      link_entry(wheel, index);
+      index = next;
+      continue;
+    }
+    wheel->firing[count++] =
+        (TimerFiring){.callback = entry->callback, .arg = entry->arg};
+    release_entry(wheel, index);
+    index = next;
+  }
+  wheel->now++;
+  pthread_mutex_unlock(&wheel->lock);
+
+  for (size_t i = 0; i < count; i++)
+    wheel->firing[i].callback(wheel->firing[i].arg);
+  return count;
+}
+
+size_t timer_wheel_pending(TimerWheel *wheel) {
+  pthread_mutex_lock(&wheel->lock);
+  size_t pending = wheel->pending;
+  pthread_mutex_unlock(&wheel->lock);
+  return pending;
+}
@@ -0,0 +1,62 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_MAX_DELAY ((uint64_t)1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS))
+#define TIMER_NONE UINT32_MAX
+
+typedef uint64_t TimerHandle;
+typedef void (*TimerCallback)(void *arg);
+
+typedef struct TimerEntry {
+    uint64_t expires;
+    TimerCallback callback;
+    void *arg;
+    uint32_t generation;
+    uint32_t prev;
+    uint32_t next;
+    uint16_t slot;
+    bool active;
+} TimerEntry;
+
+typedef struct TimerFiring {
+    TimerCallback callback;
+    void *arg;
+} TimerFiring;
+
+/*
+ * Hierarchical timing wheel keyed by tick number: four levels of 256 slots
+ * cover 2^32 ticks. Entries live in a slab and are addressed by index, with
+ * a generation so stale handles never cancel a reused slot. Schedule and
+ * cancel are O(1); each advance touches only the expiring slot plus one
+ * cascade every 256 ticks.
+ */
+typedef struct TimerWheel {
+    uint64_t now;
+    uint32_t slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+    TimerEntry *entries;
+    uint32_t capacity;
+    uint32_t free_head;
+    size_t pending;
+    TimerFiring *firing;
+    size_t firing_capacity;
+    pthread_mutex_t lock;
+} TimerWheel;
+
+int timer_wheel_init(TimerWheel *wheel);
+void timer_wheel_destroy(TimerWheel *wheel, void (*release)(void *arg));
+TimerHandle timer_wheel_schedule(TimerWheel *wheel, uint64_t delay_ticks,
+                                 TimerCallback callback, void *arg);
+bool timer_wheel_cancel(TimerWheel *wheel, TimerHandle handle, void **arg);
+size_t timer_wheel_advance(TimerWheel *wheel);
+size_t timer_wheel_pending(TimerWheel *wheel);
+
+#endif
@@ -0,0 +1,121 @@
+#include "ws_deque.h"
+#include "../logging/logging.h"
+#include <stdlib.h>
+
+static WsDequeArray *array_create(size_t capacity, WsDequeArray *previous) {
+  WsDequeArray *array =
+      malloc(sizeof(WsDequeArray) + capacity * sizeof(_Atomic(void *)));
+  if (!array) {
+    log_error("Work deque allocation failed");
+    return NULL;
+  }
+  array->capacity = capacity;
+  array->previous = previous;
+  return array;
+}
+
+static void *array_get(WsDequeArray *array, long index) {
+  return atomic_load_explicit(&array->items[(size_t)index & (array->capacity - 1)],
+                              memory_order_relaxed);
+}
+
+static void array_put(WsDequeArray *array, long index, void *item) {
+  atomic_store_explicit(&array->items[(size_t)index & (array->capacity - 1)],
+                        item, memory_order_relaxed);
+}
+
+int ws_deque_init(WsDeque *deque, size_t capacity) {
+  size_t rounded = 1;
+  while (rounded < capacity)
+    rounded <<= 1;
+
+  WsDequeArray *array = array_create(rounded, NULL);
+  if (!array)
+    return -1;
+  atomic_store_explicit(&deque->top, 0, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, 0, memory_order_relaxed);
+  atomic_store_explicit(&deque->array, array, memory_order_relaxed);
+  return 0;
+}
+
+void ws_deque_destroy(WsDeque *deque) {
+  WsDequeArray *array =
+      atomic_load_explicit(&deque->array, memory_order_relaxed);
+  while (array) {
+    WsDequeArray *previous = array->previous;
+    free(array);
+    array = previous;
+  }
+  atomic_store_explicit(&deque->array, NULL, memory_order_relaxed);
+}
+
+int ws_deque_push(WsDeque *deque, void *item) {
+  long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+  WsDequeArray *array =
+      atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+  if ((size_t)(b - t) >= array->capacity) {
+    WsDequeArray *grown = array_create(array->capacity * 2, array);
+    if (!grown)
+      return -1;
+    for (long i = t; i < b; i++)
+      array_put(grown, i, array_get(array, i));
+    atomic_store_explicit(&deque->array, grown, memory_order_release);
+    array = grown;
+  }
+
+  array_put(array, b, item);
+  atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+  return 0;
+}
+
+void *ws_deque_pop(WsDeque *deque) {
+  long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  WsDequeArray *array =
+      atomic_load_explicit(&deque->array, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (t > b) {
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  void *item = array_get(array, b);
+  if (t == b) {
+    /* Last item: race any thief for it through top. */
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+      item = NULL;
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+  }
+  return item;
+}
+
+void *ws_deque_steal(WsDeque *deque) {
+  for (;;) {
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b)
+      return NULL;
+
+    WsDequeArray *array =
+        atomic_load_explicit(&deque->array, memory_order_acquire);
+    void *item = array_get(array, t);
+    if (atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                memory_order_seq_cst,
+                                                memory_order_relaxed))
+      return item;
+    /* Lost the race to another thief or the owner; someone made progress. */
+  }
+}
+
+size_t ws_deque_size(WsDeque *deque) {
+  long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+  return b > t ? (size_t)(b - t) : 0;
+}
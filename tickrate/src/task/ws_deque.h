@@ -0,0 +1,33 @@
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+typedef struct WsDequeArray {
+    size_t capacity;
+    struct WsDequeArray *previous;
+    _Atomic(void *) items[];
+} WsDequeArray;
+
+/*
+ * Chase-Lev work-stealing deque (Le et al. C11 formulation). The owning
+ * thread pushes and pops at the bottom without read-modify-write atomics
+ * except when racing for the last item; any thread may steal from the top.
+ * Growth keeps retired arrays alive until destroy since a thief may still be
+ * reading them.
+ */
+typedef struct WsDeque {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(WsDequeArray *) array;
+} WsDeque;
+
+int ws_deque_init(WsDeque *deque, size_t capacity);
+void ws_deque_destroy(WsDeque *deque);
+int ws_deque_push(WsDeque *deque, void *item);
+void *ws_deque_pop(WsDeque *deque);
+void *ws_deque_steal(WsDeque *deque);
+size_t ws_deque_size(WsDeque *deque);
+
+#endif
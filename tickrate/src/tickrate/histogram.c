@@ -0,0 +1,99 @@
+#include "histogram.h"
+#include <math.h>
+#include <string.h>
+
+static size_t bucket_index(uint64_t value) {
+    if (value >= HISTOGRAM_MAX_VALUE) {
+        value = HISTOGRAM_MAX_VALUE - 1;
+    }
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return (size_t)value;
+    }
+    unsigned int exponent = 63 - __builtin_clzll(value);
+    unsigned int shift = exponent - HISTOGRAM_SUB_BITS;
+    size_t group = shift + 1;
+    return group * HISTOGRAM_SUB_COUNT + (size_t)((value >> shift) - HISTOGRAM_SUB_COUNT);
+}
+
+/* Highest value that maps to the bucket, as HdrHistogram reports it. */
+static uint64_t bucket_value(size_t index) {
+    size_t group = index / HISTOGRAM_SUB_COUNT;
+    uint64_t sub = index % HISTOGRAM_SUB_COUNT;
+    if (group == 0) {
+        return sub;
+    }
+    unsigned int shift = (unsigned int)group - 1;
+    return ((HISTOGRAM_SUB_COUNT + sub) << shift) + (((uint64_t)1 << shift) - 1);
+}
+
+void histogram_init(Histogram *histogram) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        atomic_init(&histogram->counts[i], 0);
+    }
+    atomic_init(&histogram->sum, 0);
+    atomic_init(&histogram->min, UINT64_MAX);
+    atomic_init(&histogram->max, 0);
+}
+
+void histogram_record(Histogram *histogram, uint64_t value) {
+    atomic_fetch_add_explicit(&histogram->counts[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+
+    uint64_t current = atomic_load_explicit(&histogram->min, memory_order_relaxed);
+    while (value < current &&
+           !atomic_compare_exchange_weak_explicit(&histogram->min, &current, value,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+    current = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (value > current &&
+           !atomic_compare_exchange_weak_explicit(&histogram->max, &current, value,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void histogram_load(const Histogram *histogram, HistogramSnapshot *snapshot) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        snapshot->counts[i] = atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    }
+    snapshot->sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    snapshot->min = atomic_load_explicit(&histogram->min, memory_order_relaxed);
+    snapshot->max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
+
+uint64_t histogram_percentile(const HistogramSnapshot *snapshot, uint64_t count, double percentile) {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)ceil(percentile / 100.0 * (double)count);
+    if (target < 1) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += snapshot->counts[i];
+        if (seen >= target) {
+            uint64_t value = bucket_value(i);
+            return value < snapshot->max ? value : snapshot->max;
+        }
+    }
+    return snapshot->max;
+}
+
+void histogram_summarize(const HistogramSnapshot *snapshot, HistogramSummary *summary) {
+    memset(summary, 0, sizeof(*summary));
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        summary->count += snapshot->counts[i];
+    }
+    if (summary->count == 0) {
+        return;
+    }
+
+    summary->mean = (double)snapshot->sum / (double)summary->count;
+    summary->min = snapshot->min;
+    summary->max = snapshot->max;
+    summary->p50 = histogram_percentile(snapshot, summary->count, 50.0);
+    summary->p90 = histogram_percentile(snapshot, summary->count, 90.0);
+    summary->p99 = histogram_percentile(snapshot, summary->count, 99.0);
+    summary->p999 = histogram_percentile(snapshot, summary->count, 99.9);
+}
@@ -0,0 +1,52 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_MAX_VALUE ((uint64_t)1 << HISTOGRAM_MAX_BITS)
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+/*
+ * HDR-style log-bucketed histogram: values below 32 are exact, above that
+ * every power of two is split into 32 linear sub-buckets, so any recorded
+ * value is reported within ~3%. Values are clamped to 2^40 (about 18 minutes
+ * in nanoseconds). Recording is a relaxed atomic add and is safe from any
+ * number of threads; readers copy the counters into a snapshot.
+ */
+typedef struct Histogram {
+    atomic_uint_fast64_t counts[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t min;
+    atomic_uint_fast64_t max;
+} Histogram;
+
+typedef struct HistogramSnapshot {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} HistogramSnapshot;
+
+typedef struct HistogramSummary {
+    uint64_t count;
+    double mean;
+    uint64_t min;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} HistogramSummary;
+
+void histogram_init(Histogram *histogram);
+void histogram_record(Histogram *histogram, uint64_t value);
+void histogram_load(const Histogram *histogram, HistogramSnapshot *snapshot);
+uint64_t histogram_percentile(const HistogramSnapshot *snapshot, uint64_t count, double percentile);
+void histogram_summarize(const HistogramSnapshot *snapshot, HistogramSummary *summary);
+
+#endif
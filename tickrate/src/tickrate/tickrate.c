@@ -2,18 +2,34 @@
 #include "../logging/logging.h"
 #include "../task/task_manager.h"
 #include "sync.h"
+#include <errno.h>
 #include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
 
-#define TICK_HISTORY_SIZE 10
 #define NS_PER_SEC 1000000000L
 
 static double timespec_to_seconds(const struct timespec *ts) {
     return (double)ts->tv_sec + (double)ts->tv_nsec / NS_PER_SEC;
 }
 
+static void timespec_add(struct timespec *ts, long ns) {
+    ts->tv_nsec += ns;
+    while (ts->tv_nsec >= NS_PER_SEC) {
+        ts->tv_nsec -= NS_PER_SEC;
+        ts->tv_sec++;
+    }
+}
+
+static long timespec_diff_ns(const struct timespec *a, const struct timespec *b) {
+    return (a->tv_sec - b->tv_sec) * NS_PER_SEC + (a->tv_nsec - b->tv_nsec);
+}
+
 static void calculate_metrics(Tickrate *tickrate, const struct timespec *start, const struct timespec *end) {
     double elapsed = timespec_to_seconds(end) - timespec_to_seconds(start);
     tickrate->elapsed_time = elapsed;
@@ -25,16 +41,66 @@ static void calculate_metrics(Tickrate *tickrate, const struct timespec *start,
         log_warn("Zero or negative elapsed time detected");
     }
 
-    int index = tickrate->tick_count % TICK_HISTORY_SIZE;
-    if (tickrate->tick_count >= TICK_HISTORY_SIZE) {
-        tickrate->sum_tick_rates -= tickrate->tick_history[index];
+    if (tickrate->tick_count == 0) {
+        tickrate->average_rate = tickrate->current_rate;
+    } else {
+        tickrate->average_rate += TICK_AVERAGE_WEIGHT * (tickrate->current_rate - tickrate->average_rate);
     }
-    tickrate->tick_history[index] = tickrate->current_rate;
-    tickrate->sum_tick_rates += tickrate->current_rate;
     tickrate->tick_count++;
+}
+
+static uint64_t clamp_ns(long ns) {
+    return ns > 0 ? (uint64_t)ns : 0;
+}
 
-    int count = (tickrate->tick_count < TICK_HISTORY_SIZE) ? tickrate->tick_count : TICK_HISTORY_SIZE;
-    tickrate->average_rate = tickrate->sum_tick_rates / count;
+static void publish_stats(Tickrate *tickrate, long duration_ns, long jitter_ns) {
+    TickStats *stats = &tickrate->stats;
+    unsigned int sequence = atomic_load_explicit(&stats->sequence, memory_order_relaxed);
+    atomic_store_explicit(&stats->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&stats->current_rate, tickrate->current_rate, memory_order_relaxed);
+    atomic_store_explicit(&stats->average_rate, tickrate->average_rate, memory_order_relaxed);
+    atomic_store_explicit(&stats->tick_count, tickrate->tick_count, memory_order_relaxed);
+    atomic_store_explicit(&stats->tasks_last_tick, tickrate->tasks_last_tick, memory_order_relaxed);
+    atomic_store_explicit(&stats->task_backlog, tickrate->task_manager.task_count, memory_order_relaxed);
+    atomic_store_explicit(&stats->budget_overruns, tickrate->budget_overruns, memory_order_relaxed);
+    atomic_store_explicit(&stats->tick_overruns, tickrate->tick_overruns, memory_order_relaxed);
+    histogram_record(&stats->tick_duration, clamp_ns(duration_ns));
+    histogram_record(&stats->tick_jitter, clamp_ns(jitter_ns));
+    histogram_record(&stats->tasks_per_tick, tickrate->tasks_last_tick);
+
+    atomic_store_explicit(&stats->sequence, sequence + 2, memory_order_release);
+}
+
+/*
+ * queue_wait is recorded by whichever thread runs a task, outside the
+ * seqlock, so it is only as consistent with the tick figures as the moment
+ * it was copied.
+ */
+void tickrate_read_stats(const Tickrate *tickrate, TickStatsSnapshot *snapshot) {
+    const TickStats *stats = &tickrate->stats;
+    unsigned int before, after;
+    do {
+        before = atomic_load_explicit(&stats->sequence, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        snapshot->current_rate = atomic_load_explicit(&stats->current_rate, memory_order_relaxed);
+        snapshot->average_rate = atomic_load_explicit(&stats->average_rate, memory_order_relaxed);
+        snapshot->tick_count = atomic_load_explicit(&stats->tick_count, memory_order_relaxed);
+        snapshot->tasks_last_tick = atomic_load_explicit(&stats->tasks_last_tick, memory_order_relaxed);
+        snapshot->task_backlog = atomic_load_explicit(&stats->task_backlog, memory_order_relaxed);
+        snapshot->budget_overruns = atomic_load_explicit(&stats->budget_overruns, memory_order_relaxed);
+        snapshot->tick_overruns = atomic_load_explicit(&stats->tick_overruns, memory_order_relaxed);
+        histogram_load(&stats->tick_duration, &snapshot->tick_duration);
+        histogram_load(&stats->tick_jitter, &snapshot->tick_jitter);
+        histogram_load(&stats->tasks_per_tick, &snapshot->tasks_per_tick);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&stats->sequence, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+
+    histogram_load(&tickrate->task_manager.queue_wait, &snapshot->queue_wait);
 }
 
 bool tickrate_init(Tickrate *tickrate, double target_hz) {
@@ -46,7 +112,11 @@ bool tickrate_init(Tickrate *tickrate, double target_hz) {
     memset(tickrate, 0, sizeof(Tickrate));
     tickrate->target_rate = target_hz;
     tickrate->tick_interval = 1.0 / target_hz;
-    tickrate->sum_tick_rates = 0.0;
+    tickrate->task_budget = tickrate->tick_interval * TICK_DEFAULT_BUDGET_RATIO;
+    atomic_init(&tickrate->stats.sequence, 0);
+    histogram_init(&tickrate->stats.tick_duration);
+    histogram_init(&tickrate->stats.tick_jitter);
+    histogram_init(&tickrate->stats.tasks_per_tick);
 
     if (initialize_task_manager(&tickrate->task_manager) != 0) {
         log_error("Failed to initialize TaskManager");
@@ -60,28 +130,110 @@ bool tickrate_init(Tickrate *tickrate, double target_hz) {
     return true;
 }
 
+void tickrate_set_task_budget(Tickrate *tickrate, double seconds) {
+    if (seconds <= 0 || isnan(seconds)) {
+        log_warn("Ignoring invalid task budget: %.6f seconds", seconds);
+        return;
+    }
+    tickrate->task_budget = seconds;
+}
+
 void tickrate_monitor(const Tickrate *tickrate) {
-    log_info("Tick %lu: Real=%.2fHz, Avg=%.2fHz, Tasks=%zu",
-             tickrate->tick_count,
-             tickrate->current_rate,
-             tickrate->average_rate,
-             tickrate->task_manager.task_count);
+    TickStatsSnapshot *snapshot = malloc(sizeof(TickStatsSnapshot));
+    if (!snapshot) {
+        log_error("Failed to allocate tick stats snapshot");
+        return;
+    }
+    tickrate_read_stats(tickrate, snapshot);
+
+    HistogramSummary duration, jitter, tasks, wait;
+    histogram_summarize(&snapshot->tick_duration, &duration);
+    histogram_summarize(&snapshot->tick_jitter, &jitter);
+    histogram_summarize(&snapshot->tasks_per_tick, &tasks);
+    histogram_summarize(&snapshot->queue_wait, &wait);
+
+    log_info("Tick %zu: Real=%.2fHz, Avg=%.2fHz, Tasks=%zu",
+             snapshot->tick_count,
+             snapshot->current_rate,
+             snapshot->average_rate,
+             snapshot->task_backlog);
+    log_info("Tick duration p50=%.3fms p99=%.3fms p999=%.3fms max=%.3fms, jitter p99=%.3fms p999=%.3fms",
+             duration.p50 / 1e6, duration.p99 / 1e6, duration.p999 / 1e6, duration.max / 1e6,
+             jitter.p99 / 1e6, jitter.p999 / 1e6);
+    log_info("Tasks per tick p50=%llu p99=%llu max=%llu, queue wait p50=%.3fms p99=%.3fms p999=%.3fms",
+             (unsigned long long)tasks.p50, (unsigned long long)tasks.p99,
+             (unsigned long long)tasks.max,
+             wait.p50 / 1e6, wait.p99 / 1e6, wait.p999 / 1e6);
+    free(snapshot);
 }
 
-static void precise_sleep(double interval) {
-    struct timespec req = {
-        .tv_sec = (time_t)interval,
-        .tv_nsec = (long)((interval - (time_t)interval) * 1e9)
+/*
+ * Sleep until the absolute deadline on the tick timerfd. Submissions that
+ * arrive meanwhile wake the thread through the task eventfd and run straight
+ * away, bounded by the task budget and never past the deadline, so idle
+ * time between ticks is not wasted.
+ */
+static void wait_for_tick(Tickrate *tickrate, int timer_fd, const struct timespec *deadline) {
+    TaskManager *tm = &tickrate->task_manager;
+    struct itimerspec spec = {.it_value = *deadline};
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        log_error("timerfd_settime failed: %s", strerror(errno));
+        return;
+    }
+
+    struct pollfd fds[2] = {
+        {.fd = timer_fd, .events = POLLIN},
+        {.fd = tm->wake_fd, .events = POLLIN}
     };
-    struct timespec rem;
+    while (tickrate->is_running) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Tick poll failed: %s", strerror(errno));
+            return;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            task_manager_clear_wakeup(tm);
+            update_tasks(tm);
+            struct timespec budget_end;
+            clock_gettime(CLOCK_MONOTONIC, &budget_end);
+            timespec_add(&budget_end, (long)(tickrate->task_budget * NS_PER_SEC));
+            if (timespec_diff_ns(&budget_end, deadline) > 0) {
+                budget_end = *deadline;
+            }
+            process_tasks(tm, &budget_end);
+        }
 
-    while (nanosleep(&req, &rem) != 0) {
-        log_warn("Sleep interrupted, remaining: %ld.%09lds",
-                 rem.tv_sec, rem.tv_nsec);
-        req = rem;
+        if (fds[0].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                log_error("timerfd read failed: %s", strerror(errno));
+            }
+            return;
+        }
     }
 }
 
+static void report_overruns(Tickrate *tickrate, const struct timespec *now,
+                            struct timespec *last_report, size_t *reported_budget,
+                            size_t *reported_ticks) {
+    if (now->tv_sec == last_report->tv_sec) {
+        return;
+    }
+    size_t budget = tickrate->budget_overruns - *reported_budget;
+    size_t ticks = tickrate->tick_overruns - *reported_ticks;
+    if (budget > 0 || ticks > 0) {
+        log_warn("Tick overruns in last %lds: %zu over task budget, %zu over interval, %zu tasks carried over",
+                 (long)(now->tv_sec - last_report->tv_sec), budget, ticks,
+                 tickrate->task_manager.task_count);
+    }
+    *last_report = *now;
+    *reported_budget = tickrate->budget_overruns;
+    *reported_ticks = tickrate->tick_overruns;
+}
+
 void *tickrate_thread(void *arg) {
     Tickrate *tickrate = (Tickrate *)arg;
 
@@ -89,36 +241,80 @@ void *tickrate_thread(void *arg) {
     pthread_cond_signal(&tickrate_cond);
     pthread_mutex_unlock(&tickrate_mutex);
 
-    log_info("Starting tickrate thread (%.2f Hz)", tickrate->target_rate);
+    log_info("Starting tickrate thread (%.2f Hz, %.3f ms task budget)",
+             tickrate->target_rate, tickrate->task_budget * 1e3);
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        log_error("Tick timerfd creation failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    long interval_ns = (long)(tickrate->tick_interval * NS_PER_SEC);
+    struct timespec deadline, start, previous, end, last_report;
+    size_t reported_budget = 0, reported_ticks = 0, last_handled = 0;
+    bool have_previous = false;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    previous = last_report = deadline;
 
-    struct timespec start, end;
     while (tickrate->is_running) {
         clock_gettime(CLOCK_MONOTONIC, &start);
+        long jitter_ns = timespec_diff_ns(&start, &deadline);
 
+        task_manager_clear_wakeup(&tickrate->task_manager);
         if (update_tasks(&tickrate->task_manager) != 0) {
             log_error("Task update failed");
         }
 
-        if (process_task(&tickrate->task_manager) != 0) {
-            log_error("Task processing failed");
+        timer_wheel_advance(&tickrate->task_manager.timers);
+
+        struct timespec budget_end = start;
+        timespec_add(&budget_end, (long)(tickrate->task_budget * NS_PER_SEC));
+        process_tasks(&tickrate->task_manager, &budget_end);
+        if (tickrate->task_manager.task_count > 0) {
+            tickrate->budget_overruns++;
         }
 
-        clock_gettime(CLOCK_MONOTONIC, &end);
-        calculate_metrics(tickrate, &start, &end);
+        if (have_previous) {
+            calculate_metrics(tickrate, &previous, &start);
+        }
+        previous = start;
+        have_previous = true;
+
+        size_t handled = tickrate->task_manager.tasks_processed + tickrate->task_manager.tasks_dispatched;
+        tickrate->tasks_last_tick = handled - last_handled;
+        last_handled = handled;
 
-        double tick_time = timespec_to_seconds(&end) - timespec_to_seconds(&start);
-        double sleep_time = tickrate->tick_interval - tick_time;
-        if (sleep_time > 0) {
-            precise_sleep(sleep_time);
+        timespec_add(&deadline, interval_ns);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        publish_stats(tickrate, timespec_diff_ns(&end, &start), jitter_ns);
+        long behind_ns = timespec_diff_ns(&end, &deadline);
+        if (behind_ns >= 0) {
+            tickrate->tick_overruns++;
+            if (behind_ns >= interval_ns) {
+                /* Too far behind to catch up; drop the missed ticks. */
+                deadline = end;
+            }
         } else {
-            log_warn("Tick took longer than interval: %.6f seconds", -sleep_time);
+            wait_for_tick(tickrate, timer_fd, &deadline);
         }
+
+        report_overruns(tickrate, &end, &last_report, &reported_budget, &reported_ticks);
     }
 
+    close(timer_fd);
     log_info("Stopping tickrate thread");
     return NULL;
 }
 
+double tickrate_get_average(const Tickrate *tr) {
+    return atomic_load_explicit(&tr->stats.average_rate, memory_order_relaxed);
+}
+
+double tickrate_get_current(const Tickrate *tr) {
+    return atomic_load_explicit(&tr->stats.current_rate, memory_order_relaxed);
+}
+
 bool tickrate_is_running(const Tickrate *tr) {
     return tr->is_running;
 }
@@ -2,29 +2,74 @@
 #define TICKRATE_H
 
 #include "../task/task.h"
+#include "histogram.h"
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <time.h>
 
+/*
+ * Published by the tick thread once per tick under a seqlock: the sequence is
+ * odd while an update is in progress and readers retry until they copy a
+ * stable even value. Durations are in nanoseconds; jitter is actual tick
+ * start minus scheduled start.
+ */
+typedef struct TickStats {
+    atomic_uint sequence;
+    _Atomic double current_rate;
+    _Atomic double average_rate;
+    atomic_size_t tick_count;
+    atomic_size_t tasks_last_tick;
+    atomic_size_t task_backlog;
+    atomic_size_t budget_overruns;
+    atomic_size_t tick_overruns;
+    Histogram tick_duration;
+    Histogram tick_jitter;
+    Histogram tasks_per_tick;
+} TickStats;
+
+typedef struct TickStatsSnapshot {
+    double current_rate;
+    double average_rate;
+    size_t tick_count;
+    size_t tasks_last_tick;
+    size_t task_backlog;
+    size_t budget_overruns;
+    size_t tick_overruns;
+    HistogramSnapshot tick_duration;
+    HistogramSnapshot tick_jitter;
+    HistogramSnapshot tasks_per_tick;
+    HistogramSnapshot queue_wait;
+} TickStatsSnapshot;
+
+/* Everything except stats is private to the tick thread once it starts. */
 typedef struct Tickrate {
     double target_rate;
     double current_rate;
-    double sum_tick_rates;
     double average_rate;
     double tick_interval;
     size_t tick_count;
-    double tick_history[10];
     double elapsed_time;
+    double task_budget;
+    size_t tasks_last_tick;
+    size_t budget_overruns;
+    size_t tick_overruns;
     bool is_running;
     TaskManager task_manager;
+    TickStats stats;
 } Tickrate;
 
 
+#define TICK_DEFAULT_BUDGET_RATIO 0.5
+#define TICK_AVERAGE_WEIGHT 0.1
+
 bool tickrate_init(Tickrate* tr, double target_hz);
+void tickrate_set_task_budget(Tickrate* tr, double seconds);
 bool tickrate_is_running(const Tickrate* tr);
 void tickrate_stop(Tickrate* tr);
 void* tickrate_thread(void* arg);
 
 
+void tickrate_read_stats(const Tickrate* tr, TickStatsSnapshot* snapshot);
 void tickrate_monitor(const Tickrate* tr);
 double tickrate_get_average(const Tickrate* tr);
 double tickrate_get_current(const Tickrate* tr);
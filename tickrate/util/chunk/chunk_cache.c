@@ -0,0 +1,240 @@
+#include "chunk_cache.h"
+#include "../../src/logging/logging.h"
+#include <lauxlib.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/*
+ * A cached chunk is a factory for the task body: every call makes a new
+ * closure with its own _ENV upvalue, so the environment can be bound per load
+ * without touching the closures handed out before. The prefix stays on the
+ * body's first line so error line numbers are unchanged.
+ */
+static const char chunk_prefix[] = "local _ENV; return function(...) ";
+static const char chunk_suffix[] = "\nend";
+
+static atomic_ullong cache_hits;
+static atomic_ullong cache_misses;
+static atomic_ullong cache_evictions;
+
+typedef struct {
+  const char *parts[3];
+  size_t lengths[3];
+  int index;
+} ChunkReader;
+
+static uint64_t fnv1a(uint64_t hash, const char *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+static const char *chunk_reader(lua_State *L, void *ud, size_t *size) {
+  (void)L;
+  ChunkReader *reader = (ChunkReader *)ud;
+  if (reader->index >= 3) {
+    *size = 0;
+    return NULL;
+  }
+  *size = reader->lengths[reader->index];
+  return reader->parts[reader->index++];
+}
+
+static void lru_unlink(ChunkCache *cache, ChunkCacheEntry *entry) {
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache->lru_head = entry->lru_next;
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache->lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(ChunkCache *cache, ChunkCacheEntry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head)
+    cache->lru_head->lru_prev = entry;
+  cache->lru_head = entry;
+  if (!cache->lru_tail)
+    cache->lru_tail = entry;
+}
+
+static void free_entry(ChunkCacheEntry *entry) {
+  free(entry->name);
+  free(entry->body);
+  free(entry);
+}
+
+static void evict_tail(ChunkCache *cache, lua_State *L) {
+  ChunkCacheEntry *victim = cache->lru_tail;
+  if (!victim)
+    return;
+
+  ChunkCacheEntry **link = &cache->buckets[victim->hash % CHUNK_CACHE_BUCKETS];
+  while (*link && *link != victim)
+    link = &(*link)->bucket_next;
+  if (*link)
+    *link = victim->bucket_next;
+
+  lru_unlink(cache, victim);
+  luaL_unref(L, LUA_REGISTRYINDEX, victim->ref);
+  free_entry(victim);
+  cache->count--;
+  atomic_fetch_add_explicit(&cache_evictions, 1, memory_order_relaxed);
+}
+
+static ChunkCacheEntry *find_entry(ChunkCache *cache, uint64_t hash,
+                                   const char *name, const char *body,
+                                   size_t body_len) {
+  ChunkCacheEntry *entry = cache->buckets[hash % CHUNK_CACHE_BUCKETS];
+  while (entry) {
+    if (entry->hash == hash && entry->body_len == body_len &&
+        strcmp(entry->name, name) == 0 &&
+        memcmp(entry->body, body, body_len) == 0)
+      return entry;
+    entry = entry->bucket_next;
+  }
+  return NULL;
+}
+
+static int insert_entry(ChunkCache *cache, lua_State *L, uint64_t hash,
+                        const char *name, const char *body, size_t body_len) {
+  ChunkCacheEntry *entry = calloc(1, sizeof(ChunkCacheEntry));
+  if (!entry)
+    return -1;
+
+  entry->name = strdup(name);
+  entry->body = malloc(body_len);
+  if (!entry->name || !entry->body) {
+    free_entry(entry);
+    return -1;
+  }
+  memcpy(entry->body, body, body_len);
+  entry->body_len = body_len;
+  entry->hash = hash;
+
+  if (cache->count >= CHUNK_CACHE_CAPACITY)
+    evict_tail(cache, L);
+
+  lua_pushvalue(L, -1);
+  entry->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  size_t bucket = hash % CHUNK_CACHE_BUCKETS;
+  entry->bucket_next = cache->buckets[bucket];
+  cache->buckets[bucket] = entry;
+  lru_push_front(cache, entry);
+  cache->count++;
+  return 0;
+}
+
+int lua_load_task(lua_State *L) {
+  ChunkCache *cache = (ChunkCache *)lua_touserdata(L, lua_upvalueindex(1));
+  size_t body_len;
+  const char *body = luaL_checklstring(L, 1, &body_len);
+  const char *name = luaL_optstring(L, 2, "task");
+
+  if (lua_istable(L, 3))
+    lua_pushvalue(L, 3);
+  else
+    lua_pushglobaltable(L);
+  int env_index = lua_gettop(L);
+
+  uint64_t hash = fnv1a(FNV_OFFSET_BASIS, name, strlen(name) + 1);
+  hash = fnv1a(hash, body, body_len);
+
+  ChunkCacheEntry *entry = find_entry(cache, hash, name, body, body_len);
+  if (entry) {
+    atomic_fetch_add_explicit(&cache_hits, 1, memory_order_relaxed);
+    lru_unlink(cache, entry);
+    lru_push_front(cache, entry);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, entry->ref);
+  } else {
+    atomic_fetch_add_explicit(&cache_misses, 1, memory_order_relaxed);
+    ChunkReader reader = {
+        .parts = {chunk_prefix, body, chunk_suffix},
+        .lengths = {sizeof(chunk_prefix) - 1, body_len,
+                    sizeof(chunk_suffix) - 1},
+        .index = 0,
+    };
+    if (lua_load(L, chunk_reader, &reader, name, "t") != LUA_OK) {
+      lua_pushnil(L);
+      lua_insert(L, -2);
+      return 2;
+    }
+    if (insert_entry(cache, L, hash, name, body, body_len) != 0)
+      log_warn("Failed to cache compiled chunk %s", name);
+  }
+
+  lua_call(L, 0, 1);
+  lua_pushvalue(L, env_index);
+  /* A body that touches no globals has no _ENV to bind */
+  if (!lua_setupvalue(L, -2, 1))
+    lua_pop(L, 1);
+  return 1;
+}
+
+int lua_chunk_cache_stats(lua_State *L) {
+  ChunkCache *cache = (ChunkCache *)lua_touserdata(L, lua_upvalueindex(1));
+  ChunkCacheStats stats = chunk_cache_stats();
+
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, (lua_Integer)stats.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, (lua_Integer)stats.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, (lua_Integer)stats.evictions);
+  lua_setfield(L, -2, "evictions");
+  lua_pushinteger(L, (lua_Integer)cache->count);
+  lua_setfield(L, -2, "entries");
+  return 1;
+}
+
+ChunkCache *chunk_cache_create(void) {
+  ChunkCache *cache = calloc(1, sizeof(ChunkCache));
+  if (!cache)
+    log_error("Failed to allocate chunk cache");
+  return cache;
+}
+
+void chunk_cache_destroy(ChunkCache *cache, lua_State *L) {
+  if (!cache)
+    return;
+  ChunkCacheEntry *entry = cache->lru_head;
+  while (entry) {
+    ChunkCacheEntry *next = entry->lru_next;
+    if (L)
+      luaL_unref(L, LUA_REGISTRYINDEX, entry->ref);
+    free_entry(entry);
+    entry = next;
+  }
+  free(cache);
+}
+
+void chunk_cache_register(ChunkCache *cache, lua_State *L) {
+  lua_pushlightuserdata(L, cache);
+  lua_pushcclosure(L, lua_load_task, 1);
+  lua_setglobal(L, "load_task");
+
+  lua_pushlightuserdata(L, cache);
+  lua_pushcclosure(L, lua_chunk_cache_stats, 1);
+  lua_setglobal(L, "chunk_cache_stats");
+}
+
+ChunkCacheStats chunk_cache_stats(void) {
+  ChunkCacheStats stats = {
+      .hits = atomic_load_explicit(&cache_hits, memory_order_relaxed),
+      .misses = atomic_load_explicit(&cache_misses, memory_order_relaxed),
+      .evictions = atomic_load_explicit(&cache_evictions, memory_order_relaxed),
+  };
+  return stats;
+}
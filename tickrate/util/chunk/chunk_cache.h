@@ -0,0 +1,43 @@
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <lua.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHUNK_CACHE_CAPACITY 128
+#define CHUNK_CACHE_BUCKETS 256
+
+typedef struct ChunkCacheEntry {
+    uint64_t hash;
+    char *name;
+    char *body;
+    size_t body_len;
+    int ref;
+    struct ChunkCacheEntry *lru_prev;
+    struct ChunkCacheEntry *lru_next;
+    struct ChunkCacheEntry *bucket_next;
+} ChunkCacheEntry;
+
+typedef struct ChunkCache {
+    ChunkCacheEntry *buckets[CHUNK_CACHE_BUCKETS];
+    ChunkCacheEntry *lru_head;
+    ChunkCacheEntry *lru_tail;
+    size_t count;
+} ChunkCache;
+
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+} ChunkCacheStats;
+
+ChunkCache* chunk_cache_create(void);
+void chunk_cache_destroy(ChunkCache *cache, lua_State *L);
+void chunk_cache_register(ChunkCache *cache, lua_State *L);
+ChunkCacheStats chunk_cache_stats(void);
+
+int lua_load_task(lua_State *L);
+int lua_chunk_cache_stats(lua_State *L);
+
+#endif
@@ -1,22 +1,97 @@
 #include "commands_lua.h"
+#include "../lua/lua_init.h"
+#include "../../src/socket/framing.h"
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
+/*
+ * reload_scripts() recompiles the commands directory now rather than waiting
+ * for the watcher. Returns the script generation new commands will run on,
+ * or nil and a message when the directory could not be compiled.
+ */
 int lua_reload_scripts(lua_State * L) {
-  lua_pushstring(L, "Script reloading temporarily disabled");
+  LuaEnvironment * env = (LuaEnvironment * ) lua_touserdata(L, lua_upvalueindex(1));
+  if (!env || !env -> pool)
+    return luaL_error(L, "reload_scripts: no VM pool to reload");
+  uint64_t generation = lua_vm_pool_reload(env -> pool);
+  if (generation == 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, "Script reload failed");
+    return 2;
+  }
+  lua_pushinteger(L, (lua_Integer) generation);
   return 1;
 }
 
 int lua_send_response(lua_State * L) {
-  const char * response = luaL_checkstring(L, 1);
+  size_t length;
+  const char * response = luaL_checklstring(L, 1, & length);
   int client_fd = luaL_checkinteger(L, 2);
-  send_response(client_fd, response);
+
+  /* Raw writes would interleave with the connection's queued output */
+  LuaTask * task = lua_task_current(L);
+  if (!task || !task -> client || task -> client -> socket != client_fd)
+    return luaL_error(L, "send_response: socket %d is not this command's connection",
+      client_fd);
+  client_send_message(task -> client, response, length);
   return 0;
 }
 
+static void push_summary(lua_State * L, const HistogramSnapshot * snapshot,
+  double scale) {
+  HistogramSummary summary;
+  histogram_summarize(snapshot, & summary);
+
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, (lua_Integer) summary.count);
+  lua_setfield(L, -2, "count");
+  lua_pushnumber(L, summary.mean / scale);
+  lua_setfield(L, -2, "mean");
+  lua_pushnumber(L, summary.min / scale);
+  lua_setfield(L, -2, "min");
+  lua_pushnumber(L, summary.p50 / scale);
+  lua_setfield(L, -2, "p50");
+  lua_pushnumber(L, summary.p90 / scale);
+  lua_setfield(L, -2, "p90");
+  lua_pushnumber(L, summary.p99 / scale);
+  lua_setfield(L, -2, "p99");
+  lua_pushnumber(L, summary.p999 / scale);
+  lua_setfield(L, -2, "p999");
+  lua_pushnumber(L, summary.max / scale);
+  lua_setfield(L, -2, "max");
+}
+
+/*
+ * Returns the current tick rate and a table of tick statistics. Durations
+ * (tick_duration, tick_jitter, queue_wait) are in milliseconds.
+ */
 int lua_tickrate_get(lua_State * L) {
   Tickrate * t = (Tickrate * ) lua_touserdata(L, lua_upvalueindex(1));
-  lua_pushnumber(L, t -> current_rate);
-  return 1;
+  TickStatsSnapshot * snapshot = lua_newuserdatauv(L, sizeof(TickStatsSnapshot), 0);
+  tickrate_read_stats(t, snapshot);
+
+  lua_pushnumber(L, snapshot -> current_rate);
+  lua_createtable(L, 0, 11);
+  lua_pushnumber(L, snapshot -> current_rate);
+  lua_setfield(L, -2, "current_rate");
+  lua_pushnumber(L, snapshot -> average_rate);
+  lua_setfield(L, -2, "average_rate");
+  lua_pushinteger(L, (lua_Integer) snapshot -> tick_count);
+  lua_setfield(L, -2, "tick_count");
+  lua_pushinteger(L, (lua_Integer) snapshot -> task_backlog);
+  lua_setfield(L, -2, "task_backlog");
+  lua_pushinteger(L, (lua_Integer) snapshot -> budget_overruns);
+  lua_setfield(L, -2, "budget_overruns");
+  lua_pushinteger(L, (lua_Integer) snapshot -> tick_overruns);
+  lua_setfield(L, -2, "tick_overruns");
+  push_summary(L, & snapshot -> tick_duration, 1e6);
+  lua_setfield(L, -2, "tick_duration");
+  push_summary(L, & snapshot -> tick_jitter, 1e6);
+  lua_setfield(L, -2, "tick_jitter");
+  push_summary(L, & snapshot -> tasks_per_tick, 1);
+  lua_setfield(L, -2, "tasks_per_tick");
+  push_summary(L, & snapshot -> queue_wait, 1e6);
+  lua_setfield(L, -2, "queue_wait");
+  return 2;
 }
@@ -1,9 +1,34 @@
 #include "http_lua.h"
+#include "../lua/lua_init.h"
 #include "../../src/logging/logging.h"
 #include "../../src/http_request/http_request.h"
+#include "../../src/http_request/http_engine.h"
 #include <curl/curl.h>
 #include <stdlib.h>
 
+static void resume_request(LuaEnvironment * env, void * arg) {
+  (void) env;
+  HttpTransfer * transfer = (HttpTransfer * ) arg;
+  LuaTask * task = (LuaTask * ) transfer -> userdata;
+
+  if (transfer -> result == CURLE_OK) {
+    lua_pushlstring(task -> co, transfer -> response.data ? transfer -> response.data : "",
+      transfer -> response.size);
+  } else {
+    lua_pushstring(task -> co, curl_easy_strerror(transfer -> result));
+  }
+  http_transfer_free(transfer);
+  lua_task_resume(task, 1);
+}
+
+static void request_completed(HttpTransfer * transfer) {
+  LuaTask * task = (LuaTask * ) transfer -> userdata;
+  if (!lua_vm_post(task -> env, resume_request, transfer)) {
+    log_error("Dropping HTTP response for suspended task");
+    http_transfer_free(transfer);
+  }
+}
+
 int l_http_request(lua_State * L) {
   const char * method = luaL_checkstring(L, 1);
   const char * url = luaL_checkstring(L, 2);
@@ -21,6 +46,20 @@ int l_http_request(lua_State * L) {
     }
   }
 
+  LuaTask * task = lua_task_current(L);
+  if (task && lua_isyieldable(L) && http_engine_running()) {
+    HttpTransfer * transfer = http_transfer_create(method, url, data, headers,
+      request_completed, task);
+    if (transfer && http_engine_submit(transfer)) {
+      task -> waiting = true;
+      return lua_yield(L, 0);
+    }
+    http_transfer_free(transfer);
+    lua_pushnil(L);
+    lua_pushstring(L, "HTTP engine unavailable");
+    return 2;
+  }
+
   char * response = http_request(method, url, data, headers);
   curl_slist_free_all(headers);
 
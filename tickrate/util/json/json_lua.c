@@ -1,6 +1,9 @@
 #include "json_lua.h"
 #include "../../src/json/json.h"
 #include "../../src/logging/logging.h"
+#include "../../src/metrics/metrics.h"
+#include <math.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -9,12 +12,158 @@
 #include <lauxlib.h>
 
 
-int lua_json_encode(lua_State * L) {
-  JSONObject * obj = NULL;
+static _Thread_local JsonBuffer encode_buffer;
+
+static bool encode_value(lua_State * L, int index, JsonBuffer * buf, int depth);
+
+static bool encode_number(lua_State * L, int index, JsonBuffer * buf) {
+  char number[JSON_NUMBER_MAX_LEN];
+  int length;
+
+  if (lua_isinteger(L, index)) {
+    length = snprintf(number, sizeof(number), "%lld",
+      (long long) lua_tointeger(L, index));
+  } else {
+    double value = (double) lua_tonumber(L, index);
+    if (!isfinite(value)) return json_buffer_append(buf, "null", 4);
+    length = snprintf(number, sizeof(number), "%.15g", value);
+    if (strtod(number, NULL) != value) {
+      length = snprintf(number, sizeof(number), "%.17g", value);
+    }
+  }
+  return json_buffer_append(buf, number, (size_t) length);
+}
+
+static bool encode_key(lua_State * L, int index, JsonBuffer * buf) {
+  size_t length;
+  const char * key;
+
+  switch (lua_type(L, index)) {
+  case LUA_TSTRING:
+    key = lua_tolstring(L, index, & length);
+    return json_buffer_append_string(buf, key, length);
+  case LUA_TNUMBER: {
+    /* lua_tolstring would convert the key in place and break lua_next */
+    lua_pushvalue(L, index);
+    key = lua_tolstring(L, -1, & length);
+    bool ok = json_buffer_append_string(buf, key, length);
+    lua_pop(L, 1);
+    return ok;
+  }
+  default:
+    log_error("Cannot encode %s key as JSON", luaL_typename(L, index));
+    return false;
+  }
+}
+
+lua_Integer lua_json_array_length(lua_State * L, int index) {
+  lua_Integer length = (lua_Integer) lua_rawlen(L, index);
+  if (length == 0) return 0;
+
+  lua_Integer count = 0;
+  lua_pushnil(L);
+  while (lua_next(L, index) != 0) {
+    lua_pop(L, 1);
+    if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 1 ||
+      lua_tointeger(L, -1) > length || ++count > length) {
+      lua_pop(L, 1);
+      return 0;
+    }
+  }
+  return count == length ? length : 0;
+}
+
+static bool encode_table(lua_State * L, int index, JsonBuffer * buf, int depth) {
+  if (depth > LUA_JSON_MAX_DEPTH || !lua_checkstack(L, 4)) {
+    log_error("Table nesting too deep or cyclic while encoding JSON");
+    return false;
+  }
+
+  lua_Integer length = lua_json_array_length(L, index);
+  if (length > 0) {
+    if (!json_buffer_append(buf, "[", 1)) return false;
+    for (lua_Integer i = 1; i <= length; i++) {
+      lua_rawgeti(L, index, i);
+      bool ok = (i == 1 || json_buffer_append(buf, ",", 1)) &&
+        encode_value(L, lua_gettop(L), buf, depth + 1);
+      lua_pop(L, 1);
+      if (!ok) return false;
+    }
+    return json_buffer_append(buf, "]", 1);
+  }
 
-  if (lua_isstring(L, 1)) {
-    const char * str = lua_tostring(L, 1);
-    lua_pushstring(L, str);
+  if (!json_buffer_append(buf, "{", 1)) return false;
+  bool first = true;
+  lua_pushnil(L);
+  while (lua_next(L, index) != 0) {
+    int type = lua_type(L, -1);
+    if (type == LUA_TFUNCTION || type == LUA_TUSERDATA ||
+      type == LUA_TLIGHTUSERDATA || type == LUA_TTHREAD) {
+      lua_pop(L, 1);
+      continue;
+    }
+
+    bool ok = (first || json_buffer_append(buf, ",", 1)) &&
+      encode_key(L, -2, buf) && json_buffer_append(buf, ":", 1) &&
+      encode_value(L, lua_gettop(L), buf, depth + 1);
+    lua_pop(L, 1);
+    if (!ok) {
+      lua_pop(L, 1);
+      return false;
+    }
+    first = false;
+  }
+  return json_buffer_append(buf, "}", 1);
+}
+
+static bool encode_value(lua_State * L, int index, JsonBuffer * buf, int depth) {
+  switch (lua_type(L, index)) {
+  case LUA_TSTRING: {
+    size_t length;
+    const char * str = lua_tolstring(L, index, & length);
+    return json_buffer_append_string(buf, str, length);
+  }
+  case LUA_TNUMBER:
+    return encode_number(L, index, buf);
+  case LUA_TBOOLEAN:
+    return lua_toboolean(L, index) ?
+      json_buffer_append(buf, "true", 4) :
+      json_buffer_append(buf, "false", 5);
+  case LUA_TTABLE:
+    return encode_table(L, index, buf, depth);
+  default:
+    return json_buffer_append(buf, "null", 4);
+  }
+}
+
+const char * lua_json_encode_value(lua_State * L, int index, size_t * length) {
+  JsonBuffer * buf = & encode_buffer;
+  if (buf -> capacity > LUA_JSON_BUFFER_RETAIN) {
+    free(buf -> data);
+    buf -> data = NULL;
+    buf -> capacity = 0;
+  }
+  if (!buf -> data) {
+    json_buffer_init(buf, LUA_JSON_BUFFER_INITIAL);
+    if (!buf -> data) return NULL;
+  }
+  buf -> length = 0;
+
+  uint64_t started = metrics_now_ns();
+  bool encoded = encode_value(L, lua_absindex(L, index), buf, 0);
+  metrics_add(METRIC_JSON_ENCODE_NS, metrics_now_ns() - started);
+  metrics_add(METRIC_JSON_ENCODE_COUNT, 1);
+  if (!encoded) {
+    metrics_add(METRIC_JSON_ENCODE_ERRORS, 1);
+    return NULL;
+  }
+  * length = buf -> length;
+  return buf -> data;
+}
+
+int lua_json_encode(lua_State * L) {
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    lua_settop(L, 1);
     return 1;
   }
 
@@ -24,124 +173,229 @@ int lua_json_encode(lua_State * L) {
     return 2;
   }
 
-  obj = lua_table_to_json(L, 1);
-  if (!obj) {
-    lua_pushnil(L);
-    lua_pushstring(L, "Failed to convert table to JSON");
-    return 2;
-  }
-
-  char * json_str = json_encode(obj);
-  if (!json_str) {
-    free_json_object(obj);
+  size_t length;
+  const char * json = lua_json_encode_value(L, 1, & length);
+  if (!json) {
     lua_pushnil(L);
     lua_pushstring(L, "JSON encoding failed");
     return 2;
   }
 
-  lua_pushstring(L, json_str);
-  free(json_str);
-  free_json_object(obj);
+  lua_pushlstring(L, json, length);
   return 1;
 }
 
-JSONObject * lua_table_to_json(lua_State * L, int index) {
-  JSONObject * obj = create_json_object();
-  if (!obj) return NULL;
+typedef struct {
+  const char * cur;
+  const char * end;
+  const char * error;
+  int depth;
+} LuaJsonDecoder;
 
-  lua_pushvalue(L, index);
-  lua_pushnil(L);
+static bool decode_value(lua_State * L, LuaJsonDecoder * d);
 
-  while (lua_next(L, -2) != 0) {
-    const char * key = luaL_checkstring(L, -2);
-
-    if (lua_isstring(L, -1)) {
-      const char * value = lua_tostring(L, -1);
-      add_json_pair(obj, key, value, false);
-    } else if (lua_isnumber(L, -1)) {
-      double num = lua_tonumber(L, -1);
-      char buf[64];
-      snprintf(buf, sizeof(buf), "%.16g", num);
-      add_json_pair(obj, key, buf, false);
-    } else if (lua_isboolean(L, -1)) {
-      const char * value = lua_toboolean(L, -1) ? "true" : "false";
-      add_json_pair(obj, key, value, false);
-    } else if (lua_istable(L, -1)) {
-      JSONObject * nested = lua_table_to_json(L, lua_gettop(L));
-      if (nested) {
-        char * nested_str = json_encode(nested);
-        if (nested_str) {
-          add_json_pair(obj, key, nested_str, true);
-          free(nested_str);
-        }
-        free_json_object(nested);
-      }
-    }
+static void decoder_skip_whitespace(LuaJsonDecoder * d) {
+  while (d -> cur < d -> end && (* d -> cur == ' ' || * d -> cur == '\n' ||
+      * d -> cur == '\r' || * d -> cur == '\t')) {
+    d -> cur++;
+  }
+}
 
-    lua_pop(L, 1);
+static bool decoder_expect(LuaJsonDecoder * d, char c, const char * error) {
+  decoder_skip_whitespace(d);
+  if (d -> cur >= d -> end || * d -> cur != c) {
+    d -> error = error;
+    return false;
   }
+  d -> cur++;
+  return true;
+}
 
-  lua_pop(L, 1);
-  return obj;
+static bool decode_string(lua_State * L, LuaJsonDecoder * d) {
+  const char * start = ++d -> cur;
+  bool has_escape;
+  if (!json_scan_string( & d -> cur, d -> end, & has_escape)) {
+    d -> error = "unterminated string";
+    return false;
+  }
+  size_t raw_len = d -> cur - start;
+  d -> cur++;
+
+  if (!has_escape) {
+    lua_pushlstring(L, start, raw_len);
+    return true;
+  }
+
+  luaL_Buffer b;
+  char * dest = luaL_buffinitsize(L, & b, raw_len);
+  size_t length;
+  if (!json_unescape(dest, start, raw_len, & length)) {
+    luaL_pushresultsize( & b, 0);
+    lua_pop(L, 1);
+    d -> error = "invalid escape sequence";
+    return false;
+  }
+  luaL_pushresultsize( & b, length);
+  return true;
 }
 
-int lua_json_decode(lua_State * L) {
-  const char * json_str = luaL_checkstring(L, 1);
+static bool decode_object(lua_State * L, LuaJsonDecoder * d) {
+  d -> cur++;
+  lua_newtable(L);
 
-  JSONObject * obj = json_decode(json_str);
-  if (!obj) {
-    log_error("Failed to parse JSON: %s", json_str);
-    lua_pushnil(L);
-    lua_pushstring(L, "Failed to parse JSON");
-    return 2;
+  decoder_skip_whitespace(d);
+  if (d -> cur < d -> end && * d -> cur == '}') {
+    d -> cur++;
+    return true;
+  }
+
+  for (;;) {
+    decoder_skip_whitespace(d);
+    if (d -> cur >= d -> end || * d -> cur != '"') {
+      d -> error = "expected object key";
+      return false;
+    }
+    if (!decode_string(L, d)) return false;
+    if (!decoder_expect(d, ':', "expected ':' after object key")) return false;
+    if (!decode_value(L, d)) return false;
+    lua_rawset(L, -3);
+
+    decoder_skip_whitespace(d);
+    if (d -> cur < d -> end && * d -> cur == ',') {
+      d -> cur++;
+      continue;
+    }
+    return decoder_expect(d, '}', "expected ',' or '}' in object");
   }
+}
 
+static bool decode_array(lua_State * L, LuaJsonDecoder * d) {
+  d -> cur++;
   lua_newtable(L);
-  JSONPair * pair = obj -> head;
-  while (pair) {
-    if (pair -> is_nested) {
-      JSONObject * nested = json_decode(pair -> value);
-      if (nested) {
-        lua_newtable(L);
-        JSONPair * nested_pair = nested -> head;
-        while (nested_pair) {
-          lua_pushstring(L, nested_pair -> value);
-          lua_setfield(L, -2, nested_pair -> key);
-          nested_pair = nested_pair -> next;
-        }
-        lua_setfield(L, -2, pair -> key);
-        free_json_object(nested);
-      }
-    } else {
-      lua_pushstring(L, pair -> value);
-      lua_setfield(L, -2, pair -> key);
+
+  decoder_skip_whitespace(d);
+  if (d -> cur < d -> end && * d -> cur == ']') {
+    d -> cur++;
+    return true;
+  }
+
+  for (lua_Integer index = 1;; index++) {
+    if (!decode_value(L, d)) return false;
+    lua_rawseti(L, -2, index);
+
+    decoder_skip_whitespace(d);
+    if (d -> cur < d -> end && * d -> cur == ',') {
+      d -> cur++;
+      continue;
+    }
+    return decoder_expect(d, ']', "expected ',' or ']' in array");
+  }
+}
+
+static bool decode_literal(LuaJsonDecoder * d, const char * literal, size_t len) {
+  if ((size_t)(d -> end - d -> cur) < len || memcmp(d -> cur, literal, len) != 0) {
+    d -> error = "invalid literal";
+    return false;
+  }
+  d -> cur += len;
+  return true;
+}
+
+static bool decode_value(lua_State * L, LuaJsonDecoder * d) {
+  decoder_skip_whitespace(d);
+  if (d -> cur >= d -> end) {
+    d -> error = "unexpected end of input";
+    return false;
+  }
+
+  switch ( * d -> cur) {
+  case '{':
+  case '[': {
+    if (++d -> depth > LUA_JSON_MAX_DEPTH || !lua_checkstack(L, 4)) {
+      d -> error = "nesting too deep";
+      return false;
+    }
+    bool ok = * d -> cur == '{' ? decode_object(L, d) : decode_array(L, d);
+    d -> depth--;
+    return ok;
+  }
+  case '"':
+    return decode_string(L, d);
+  case 't':
+    lua_pushboolean(L, 1);
+    return decode_literal(d, "true", 4);
+  case 'f':
+    lua_pushboolean(L, 0);
+    return decode_literal(d, "false", 5);
+  case 'n':
+    lua_pushnil(L);
+    return decode_literal(d, "null", 4);
+  default: {
+    double number;
+    long long integer;
+    bool is_integer;
+    if (!json_parse_number( & d -> cur, d -> end, & number, & integer, & is_integer)) {
+      d -> error = "invalid value";
+      return false;
     }
-    pair = pair -> next;
+    if (is_integer) lua_pushinteger(L, integer);
+    else lua_pushnumber(L, number);
+    return true;
+  }
   }
+}
 
-  free_json_object(obj);
+int lua_push_json_text(lua_State * L, const char * json, size_t length) {
+  int base = lua_gettop(L);
+  LuaJsonDecoder d = {
+    .cur = json, .end = json + length, .error = NULL, .depth = 0
+  };
+
+  uint64_t started = metrics_now_ns();
+  bool decoded = decode_value(L, & d);
+  if (decoded) {
+    decoder_skip_whitespace( & d);
+    decoded = d.cur == d.end;
+    if (!decoded) d.error = "trailing characters";
+  }
+  metrics_add(METRIC_JSON_PARSE_NS, metrics_now_ns() - started);
+  metrics_add(METRIC_JSON_PARSE_COUNT, 1);
+  if (decoded) return 0;
+
+  metrics_add(METRIC_JSON_PARSE_ERRORS, 1);
+  lua_settop(L, base);
+  lua_pushnil(L);
+  lua_pushfstring(L, "Failed to parse JSON: %s at offset %d", d.error,
+    (int)(d.cur - json));
+  return -1;
+}
+
+int lua_json_decode(lua_State * L) {
+  size_t length;
+  const char * json_str = luaL_checklstring(L, 1, & length);
+
+  if (lua_push_json_text(L, json_str, length) != 0) {
+    log_error("%s", lua_tostring(L, -1));
+    return 2;
+  }
   return 1;
 }
 
 int lua_get_json_value(lua_State * L) {
-
-  const char * json_str = luaL_checkstring(L, 1);
+  size_t length;
+  const char * json_str = luaL_checklstring(L, 1, & length);
   const char * key = luaL_checkstring(L, 2);
 
-  JSONObject * obj = json_decode(json_str);
-  if (!obj) {
+  if (lua_push_json_text(L, json_str, length) != 0) {
     lua_pushnil(L);
     lua_pushstring(L, "Invalid JSON input");
     return 2;
   }
 
-  const char * value = get_json_value(obj, key);
-  if (value) {
-    lua_pushstring(L, value);
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, key);
   } else {
     lua_pushnil(L);
   }
-
-  free_json_object(obj);
   return 1;
 }
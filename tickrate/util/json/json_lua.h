@@ -3,10 +3,17 @@
 
 #include <lua.h>
 #include "../../src/json/json.h"
+#include <stddef.h>
+
+#define LUA_JSON_MAX_DEPTH 256
+#define LUA_JSON_BUFFER_INITIAL 4096
+#define LUA_JSON_BUFFER_RETAIN (1024 * 1024)
 
 int lua_json_encode(lua_State *L);
 int lua_json_decode(lua_State *L);
 int lua_get_json_value(lua_State *L);
-JSONObject* lua_table_to_json(lua_State *L, int index);
+const char* lua_json_encode_value(lua_State *L, int index, size_t *length);
+int lua_push_json_text(lua_State *L, const char *json, size_t length);
+lua_Integer lua_json_array_length(lua_State *L, int index);
 
 #endif
@@ -0,0 +1,129 @@
+#include "msgpack_lua.h"
+#include "json_lua.h"
+#include "../../src/json/msgpack.h"
+#include "../../src/logging/logging.h"
+#include "../../src/metrics/metrics.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+static _Thread_local JsonBuffer encode_buffer;
+
+static bool encode_value(lua_State * L, int index, JsonBuffer * buf, int depth);
+
+static bool is_encodable(int type) {
+  return type != LUA_TFUNCTION && type != LUA_TUSERDATA &&
+    type != LUA_TLIGHTUSERDATA && type != LUA_TTHREAD;
+}
+
+static bool encode_key(lua_State * L, int index, JsonBuffer * buf) {
+  size_t length;
+  const char * key;
+
+  switch (lua_type(L, index)) {
+  case LUA_TSTRING:
+    key = lua_tolstring(L, index, & length);
+    return msgpack_write_string(buf, key, length);
+  case LUA_TNUMBER: {
+    /* Keys stay strings so both encodings decode to the same shape */
+    lua_pushvalue(L, index);
+    key = lua_tolstring(L, -1, & length);
+    bool ok = msgpack_write_string(buf, key, length);
+    lua_pop(L, 1);
+    return ok;
+  }
+  default:
+    log_error("Cannot encode %s key as MessagePack", luaL_typename(L, index));
+    return false;
+  }
+}
+
+static bool encode_table(lua_State * L, int index, JsonBuffer * buf, int depth) {
+  if (depth > LUA_JSON_MAX_DEPTH || !lua_checkstack(L, 4)) {
+    log_error("Table nesting too deep or cyclic while encoding MessagePack");
+    return false;
+  }
+
+  lua_Integer length = lua_json_array_length(L, index);
+  if (length > 0) {
+    if (!msgpack_write_array(buf, (size_t) length)) return false;
+    for (lua_Integer i = 1; i <= length; i++) {
+      lua_rawgeti(L, index, i);
+      bool ok = encode_value(L, lua_gettop(L), buf, depth + 1);
+      lua_pop(L, 1);
+      if (!ok) return false;
+    }
+    return true;
+  }
+
+  size_t count = 0;
+  lua_pushnil(L);
+  while (lua_next(L, index) != 0) {
+    if (is_encodable(lua_type(L, -1))) count++;
+    lua_pop(L, 1);
+  }
+
+  if (!msgpack_write_map(buf, count)) return false;
+  lua_pushnil(L);
+  while (lua_next(L, index) != 0) {
+    if (!is_encodable(lua_type(L, -1))) {
+      lua_pop(L, 1);
+      continue;
+    }
+
+    bool ok = encode_key(L, -2, buf) &&
+      encode_value(L, lua_gettop(L), buf, depth + 1);
+    lua_pop(L, 1);
+    if (!ok) {
+      lua_pop(L, 1);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool encode_value(lua_State * L, int index, JsonBuffer * buf, int depth) {
+  switch (lua_type(L, index)) {
+  case LUA_TSTRING: {
+    size_t length;
+    const char * str = lua_tolstring(L, index, & length);
+    return msgpack_write_string(buf, str, length);
+  }
+  case LUA_TNUMBER:
+    if (lua_isinteger(L, index))
+      return msgpack_write_int(buf, (int64_t) lua_tointeger(L, index));
+    return msgpack_write_double(buf, (double) lua_tonumber(L, index));
+  case LUA_TBOOLEAN:
+    return msgpack_write_bool(buf, lua_toboolean(L, index));
+  case LUA_TTABLE:
+    return encode_table(L, index, buf, depth);
+  default:
+    return msgpack_write_nil(buf);
+  }
+}
+
+const char * lua_msgpack_encode_value(lua_State * L, int index, size_t * length) {
+  JsonBuffer * buf = & encode_buffer;
+  if (buf -> capacity > LUA_JSON_BUFFER_RETAIN) {
+    free(buf -> data);
+    buf -> data = NULL;
+    buf -> capacity = 0;
+  }
+  if (!buf -> data) {
+    json_buffer_init(buf, LUA_JSON_BUFFER_INITIAL);
+    if (!buf -> data) return NULL;
+  }
+  buf -> length = 0;
+
+  uint64_t started = metrics_now_ns();
+  bool encoded = encode_value(L, lua_absindex(L, index), buf, 0);
+  metrics_add(METRIC_JSON_ENCODE_NS, metrics_now_ns() - started);
+  metrics_add(METRIC_JSON_ENCODE_COUNT, 1);
+  if (!encoded) {
+    metrics_add(METRIC_JSON_ENCODE_ERRORS, 1);
+    return NULL;
+  }
+  * length = buf -> length;
+  return buf -> data;
+}
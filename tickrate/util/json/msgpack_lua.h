@@ -0,0 +1,14 @@
+#ifndef MSGPACK_LUA_H
+#define MSGPACK_LUA_H
+
+#include <lua.h>
+#include <stddef.h>
+
+/*
+ * Encodes the Lua value at index as MessagePack, following the same table
+ * rules as the JSON encoder. The result lives in a per-thread buffer that is
+ * reused by the next call on that thread.
+ */
+const char* lua_msgpack_encode_value(lua_State *L, int index, size_t *length);
+
+#endif
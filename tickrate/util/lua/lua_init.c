@@ -3,6 +3,9 @@
 #include "../print/print_utils.h"
 #include "../http/http_lua.h"
 #include "../json/json_lua.h"
+#include "../timer/timer_lua.h"
+#include "../metrics/metrics_lua.h"
+#include "../../src/metrics/metrics.h"
 #include "../../src/logging/logging.h"
 #include <stdlib.h>
 #include <lua.h>
@@ -49,6 +52,12 @@ LuaEnvironment * lua_environment_create(Tickrate * t) {
 
   env -> L = luaL_newstate();
   env -> tickrate = t;
+  env -> chunk_cache = NULL;
+  env -> id = 0;
+  env -> pool = NULL;
+  env -> busy = false;
+  env -> inbox_head = env -> inbox_tail = NULL;
+  env -> scripts = NULL;
 
   if (!env -> L) {
     free(env);
@@ -56,6 +65,8 @@ LuaEnvironment * lua_environment_create(Tickrate * t) {
     return NULL;
   }
 
+  * (LuaTask ** ) lua_getextraspace(env -> L) = NULL;
+
   luaL_requiref(env -> L, "package", luaopen_package, 1);
   luaL_requiref(env -> L, "table", luaopen_table, 1);
   luaL_requiref(env -> L, "string", luaopen_string, 1);
@@ -68,7 +79,8 @@ LuaEnvironment * lua_environment_create(Tickrate * t) {
   print_redirect_std(env -> L);
 
   lua_pushlightuserdata(env -> L, env -> tickrate);
-  lua_pop(env -> L, 1);
+  lua_pushcclosure(env -> L, lua_tickrate_get, 1);
+  lua_setglobal(env -> L, "tickrate_get");
 
   lua_register(env -> L, "request", l_http_request);
   lua_register(env -> L, "json_encode", lua_json_encode);
@@ -76,6 +88,13 @@ LuaEnvironment * lua_environment_create(Tickrate * t) {
   lua_register(env -> L, "get_json_value", lua_get_json_value);
 
   lua_register(env -> L, "custom_log", lua_custom_log);
+  timer_lua_register(env);
+  metrics_lua_register(env);
+
+  env -> chunk_cache = chunk_cache_create();
+  if (env -> chunk_cache) {
+    chunk_cache_register(env -> chunk_cache, env -> L);
+  }
 
   log_info("Lua environment created");
   return env;
@@ -87,13 +106,286 @@ void lua_environment_destroy(LuaEnvironment * env) {
       lua_close(env -> L);
       log_debug("Lua L closed");
     }
+    chunk_cache_destroy(env -> chunk_cache, NULL);
+    script_generation_unref(env -> scripts);
     free(env);
     log_info("Lua environment destroyed");
   }
 }
 
 void lua_register_core_functions(LuaEnvironment * env) {
-  lua_register(env -> L, "reload_scripts", lua_reload_scripts);
+  lua_pushlightuserdata(env -> L, env);
+  lua_pushcclosure(env -> L, lua_reload_scripts, 1);
+  lua_setglobal(env -> L, "reload_scripts");
   lua_register(env -> L, "send_response", lua_send_response);
   log_debug("Core Lua functions registered");
 }
+
+LuaVMPool * lua_vm_pool_create(Tickrate * t, size_t count,
+  const char * commands_dir) {
+  LuaVMPool * pool = calloc(1, sizeof(LuaVMPool));
+  if (!pool) {
+    log_error("Failed to allocate Lua VM pool");
+    return NULL;
+  }
+
+  pool -> vms = calloc(count, sizeof(LuaEnvironment * ));
+  pool -> free_vms = calloc(count, sizeof(LuaEnvironment * ));
+  if (!pool -> vms || !pool -> free_vms) {
+    log_error("Failed to allocate Lua VM slots");
+    lua_vm_pool_destroy(pool);
+    return NULL;
+  }
+  pthread_mutex_init( & pool -> lock, NULL);
+  pthread_cond_init( & pool -> available, NULL);
+  pthread_mutex_init( & pool -> reload_lock, NULL);
+
+  pool -> commands_dir = strdup(commands_dir);
+  pool -> scripts = pool -> commands_dir ?
+    script_generation_load(commands_dir, NULL) : NULL;
+  if (!pool -> scripts) {
+    lua_vm_pool_destroy(pool);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    LuaEnvironment * env = lua_environment_create(t);
+    if (!env) {
+      lua_vm_pool_destroy(pool);
+      return NULL;
+    }
+    env -> id = i;
+    env -> pool = pool;
+    pool -> vms[pool -> count++] = env;
+
+    lua_register_core_functions(env);
+    luaL_openlibs(env -> L);
+    script_generation_install(pool -> scripts, NULL, env -> L);
+    script_generation_ref(pool -> scripts);
+    env -> scripts = pool -> scripts;
+    pool -> free_vms[pool -> free_count++] = env;
+  }
+
+  log_info("Created Lua VM pool with %zu interpreters, %zu command scripts",
+    pool -> count, pool -> scripts -> count);
+  return pool;
+}
+
+void lua_vm_pool_destroy(LuaVMPool * pool) {
+  if (!pool) return;
+  for (size_t i = 0; i < pool -> count; i++) {
+    lua_environment_destroy(pool -> vms[i]);
+  }
+  if (pool -> vms && pool -> free_vms) {
+    pthread_mutex_destroy( & pool -> lock);
+    pthread_cond_destroy( & pool -> available);
+    pthread_mutex_destroy( & pool -> reload_lock);
+  }
+  script_generation_unref(pool -> scripts);
+  free(pool -> commands_dir);
+  free(pool -> vms);
+  free(pool -> free_vms);
+  free(pool);
+}
+
+/*
+ * Callers are pool workers holding no other VM, and the pool has one VM per
+ * worker, so a VM is always free or about to be handed back: no claimed VM
+ * waits on a queued job (see lua_vm_drain).
+ */
+LuaEnvironment * lua_vm_acquire(LuaVMPool * pool) {
+  pthread_mutex_lock( & pool -> lock);
+  while (pool -> free_count == 0) {
+    pthread_cond_wait( & pool -> available, & pool -> lock);
+  }
+  LuaEnvironment * env = pool -> free_vms[--pool -> free_count];
+  env -> busy = true;
+  ScriptGeneration * scripts = NULL;
+  if (env -> scripts != pool -> scripts) {
+    scripts = pool -> scripts;
+    script_generation_ref(scripts);
+  }
+  pthread_mutex_unlock( & pool -> lock);
+
+  /* The VM is ours alone now, so redefining its commands races nothing */
+  if (scripts) {
+    script_generation_install(scripts, env -> scripts, env -> L);
+    script_generation_unref(env -> scripts);
+    env -> scripts = scripts;
+    log_debug("Lua VM %zu moved to script generation %llu", env -> id,
+      (unsigned long long) scripts -> id);
+  }
+  return env;
+}
+
+void lua_vm_release(LuaVMPool * pool, LuaEnvironment * env) {
+  for (;;) {
+    pthread_mutex_lock( & pool -> lock);
+    LuaVMJob * job = env -> inbox_head;
+    env -> inbox_head = env -> inbox_tail = NULL;
+    if (!job) {
+      env -> busy = false;
+      pool -> free_vms[pool -> free_count++] = env;
+      pthread_cond_signal( & pool -> available);
+      pthread_mutex_unlock( & pool -> lock);
+      return;
+    }
+    pthread_mutex_unlock( & pool -> lock);
+
+    while (job) {
+      LuaVMJob * next = job -> next;
+      job -> fn(env, job -> arg);
+      free(job);
+      job = next;
+    }
+  }
+}
+
+uint64_t lua_vm_pool_reload(LuaVMPool * pool) {
+  /* Only reloads replace pool -> scripts, and they take turns here */
+  pthread_mutex_lock( & pool -> reload_lock);
+  ScriptGeneration * current = pool -> scripts;
+  ScriptGeneration * next = script_generation_load(pool -> commands_dir, current);
+  if (!next) {
+    pthread_mutex_unlock( & pool -> reload_lock);
+    log_error("Script reload failed, keeping generation %llu",
+      (unsigned long long) current -> id);
+    return 0;
+  }
+  if (script_generation_same(next, current)) {
+    script_generation_unref(next);
+    pthread_mutex_unlock( & pool -> reload_lock);
+    log_debug("Command scripts unchanged");
+    return current -> id;
+  }
+
+  pthread_mutex_lock( & pool -> lock);
+  pool -> scripts = next;
+  pthread_mutex_unlock( & pool -> lock);
+  script_generation_unref(current);
+  uint64_t id = next -> id;
+  size_t count = next -> count;
+  pthread_mutex_unlock( & pool -> reload_lock);
+
+  metrics_add(METRIC_SCRIPT_RELOADS, 1);
+  log_info("Published script generation %llu with %zu command scripts",
+    (unsigned long long) id, count);
+  return id;
+}
+
+uint64_t lua_vm_pool_generation(LuaVMPool * pool) {
+  pthread_mutex_lock( & pool -> lock);
+  uint64_t id = pool -> scripts -> id;
+  pthread_mutex_unlock( & pool -> lock);
+  return id;
+}
+
+/*
+ * Claims the VM only now that a worker is free to run its inbox. A VM is
+ * never held by a job still waiting in the pool's queue, so every claimed
+ * VM belongs to a running thread and, with at least one VM per worker,
+ * lua_vm_acquire always finds one free.
+ */
+static void lua_vm_drain(void * arg) {
+  LuaEnvironment * env = (LuaEnvironment * ) arg;
+  LuaVMPool * pool = env -> pool;
+  bool claimed = false;
+  pthread_mutex_lock( & pool -> lock);
+  if (!env -> busy && env -> inbox_head) {
+    for (size_t i = 0; i < pool -> free_count; i++) {
+      if (pool -> free_vms[i] == env) {
+        pool -> free_vms[i] = pool -> free_vms[--pool -> free_count];
+        env -> busy = true;
+        claimed = true;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock( & pool -> lock);
+
+  /* Otherwise the holder runs the inbox when it releases the VM */
+  if (claimed) lua_vm_release(pool, env);
+}
+
+void lua_vm_pool_set_scheduler(LuaVMPool * pool, LuaVMSchedulerFn schedule,
+  void * ctx) {
+  pool -> schedule = schedule;
+  pool -> schedule_ctx = ctx;
+}
+
+LuaVMJob * lua_vm_job_create(LuaVMJobFn fn, void * arg) {
+  LuaVMJob * job = malloc(sizeof(LuaVMJob));
+  if (!job) {
+    log_error("Failed to allocate Lua VM job");
+    return NULL;
+  }
+  job -> fn = fn;
+  job -> arg = arg;
+  job -> next = NULL;
+  return job;
+}
+
+void lua_vm_post_job(LuaEnvironment * env, LuaVMJob * job) {
+  LuaVMPool * pool = env -> pool;
+  pthread_mutex_lock( & pool -> lock);
+  if (env -> inbox_tail) env -> inbox_tail -> next = job;
+  else env -> inbox_head = job;
+  env -> inbox_tail = job;
+  bool schedule = !env -> busy && pool -> schedule;
+  pthread_mutex_unlock( & pool -> lock);
+
+  /* Left queued on failure; the next release of this VM runs it */
+  if (schedule && !pool -> schedule(pool -> schedule_ctx, lua_vm_drain, env))
+    log_warn("Failed to schedule Lua VM %zu, deferring job", env -> id);
+}
+
+bool lua_vm_post(LuaEnvironment * env, LuaVMJobFn fn, void * arg) {
+  LuaVMJob * job = lua_vm_job_create(fn, arg);
+  if (!job) return false;
+  lua_vm_post_job(env, job);
+  return true;
+}
+
+LuaTask * lua_task_current(lua_State * L) {
+  return * (LuaTask ** ) lua_getextraspace(L);
+}
+
+bool lua_task_start(LuaTask * task, LuaEnvironment * env, int nargs) {
+  lua_State * L = env -> L;
+  task -> env = env;
+  task -> waiting = false;
+  task -> run_ns = 0;
+  task -> co = lua_newthread(L);
+  task -> ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (task -> ref == LUA_REFNIL) {
+    log_error("Failed to anchor Lua task coroutine");
+    return false;
+  }
+  * (LuaTask ** ) lua_getextraspace(task -> co) = task;
+
+  lua_xmove(L, task -> co, nargs + 1);
+  lua_task_resume(task, nargs);
+  return true;
+}
+
+int lua_task_resume(LuaTask * task, int nargs) {
+  int nres = 0;
+  task -> waiting = false;
+  uint64_t started = metrics_now_ns();
+  int status = lua_resume(task -> co, task -> env -> L, nargs, & nres);
+  task -> run_ns += metrics_now_ns() - started;
+
+  if (status == LUA_YIELD) {
+    lua_pop(task -> co, nres);
+    if (task -> waiting) return status;
+    lua_pushstring(task -> co, "attempt to yield outside of an asynchronous call");
+    status = LUA_ERRRUN;
+    nres = 1;
+  }
+
+  lua_State * L = task -> env -> L;
+  int ref = task -> ref;
+  task -> on_finish(task, status, nres);
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  return status;
+}
@@ -4,20 +4,101 @@
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include "../../src/tickrate/tickrate.h"
+#include "../chunk/chunk_cache.h"
+#include "../../src/commands/scripts.h"
 
 // Forward declarations for Lua callbacks
 int lua_tickrate_get(lua_State *L);
 int lua_reload_scripts(lua_State *L);
 int lua_send_response(lua_State *L);
 
-typedef struct LuaEnvironment {
+struct LuaVMPool;
+struct ClientData;
+typedef struct LuaEnvironment LuaEnvironment;
+
+typedef void (*LuaVMJobFn)(LuaEnvironment *env, void *arg);
+typedef bool (*LuaVMSchedulerFn)(void *ctx, void (*job)(void *arg), void *arg);
+
+typedef struct LuaVMJob {
+    LuaVMJobFn fn;
+    void *arg;
+    struct LuaVMJob *next;
+} LuaVMJob;
+
+struct LuaEnvironment {
     lua_State *L;
     Tickrate* tickrate;
-} LuaEnvironment;
+    ChunkCache* chunk_cache;
+    size_t id;
+    struct LuaVMPool *pool;
+    bool busy;
+    LuaVMJob *inbox_head;
+    LuaVMJob *inbox_tail;
+    ScriptGeneration *scripts;
+};
+
+typedef struct LuaVMPool {
+    LuaEnvironment **vms;
+    LuaEnvironment **free_vms;
+    size_t count;
+    size_t free_count;
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    LuaVMSchedulerFn schedule;
+    void *schedule_ctx;
+    char *commands_dir;
+    ScriptGeneration *scripts;
+    pthread_mutex_t reload_lock;
+} LuaVMPool;
+
+/*
+ * A command running as a coroutine on one VM. The coroutine's extra space
+ * points back at its task so bindings such as request() can suspend it;
+ * on_finish runs once the coroutine returns or errors, with its results on
+ * top of co. run_ns accumulates the time spent inside lua_resume. client is
+ * the connection the task answers to, or NULL for server-initiated work.
+ */
+typedef struct LuaTask {
+    LuaEnvironment *env;
+    struct ClientData *client;
+    lua_State *co;
+    int ref;
+    bool waiting;
+    uint64_t run_ns;
+    void (*on_finish)(struct LuaTask *task, int status, int nres);
+} LuaTask;
 
 LuaEnvironment* lua_environment_create(Tickrate *t);
 void lua_environment_destroy(LuaEnvironment *env);
 void lua_register_core_functions(LuaEnvironment *env);
 
+LuaVMPool* lua_vm_pool_create(Tickrate *t, size_t count, const char *commands_dir);
+void lua_vm_pool_destroy(LuaVMPool *pool);
+LuaEnvironment* lua_vm_acquire(LuaVMPool *pool);
+void lua_vm_release(LuaVMPool *pool, LuaEnvironment *env);
+void lua_vm_pool_set_scheduler(LuaVMPool *pool, LuaVMSchedulerFn schedule, void *ctx);
+bool lua_vm_post(LuaEnvironment *env, LuaVMJobFn fn, void *arg);
+/* For callers that cannot handle a failed post: the job is allocated up
+ * front, and posting it always succeeds. The drain frees it after it runs. */
+LuaVMJob* lua_vm_job_create(LuaVMJobFn fn, void *arg);
+void lua_vm_post_job(LuaEnvironment *env, LuaVMJob *job);
+
+/*
+ * Recompiles the commands directory and, if anything changed, publishes the
+ * result as the pool's current script generation. Each VM installs it the
+ * next time it is acquired, so commands already running are untouched.
+ * Returns the current generation's id, or 0 when the directory could not
+ * be compiled.
+ */
+uint64_t lua_vm_pool_reload(LuaVMPool *pool);
+uint64_t lua_vm_pool_generation(LuaVMPool *pool);
+
+bool lua_task_start(LuaTask *task, LuaEnvironment *env, int nargs);
+int lua_task_resume(LuaTask *task, int nargs);
+LuaTask* lua_task_current(lua_State *L);
+
 #endif
@@ -0,0 +1,96 @@
+#include "metrics_lua.h"
+#include "../lua/lua_init.h"
+#include "../../src/metrics/metrics.h"
+
+static void set_number(lua_State * L, const char * key, double value) {
+  lua_pushnumber(L, value);
+  lua_setfield(L, -2, key);
+}
+
+static void set_integer(lua_State * L, const char * key, uint64_t value) {
+  lua_pushinteger(L, (lua_Integer) value);
+  lua_setfield(L, -2, key);
+}
+
+static void push_timing(lua_State * L, uint64_t count, uint64_t errors,
+  uint64_t total_ns) {
+  lua_createtable(L, 0, 4);
+  set_integer(L, "count", count);
+  set_integer(L, "errors", errors);
+  set_number(L, "total_ms", total_ns / 1e6);
+  set_number(L, "mean_ms", count ? total_ns / 1e6 / count : 0.0);
+}
+
+static void push_family(lua_State * L, const MetricsSnapshot * snapshot,
+  MetricFamily family) {
+  size_t count = snapshot -> label_count[family];
+  lua_createtable(L, 0, (int) count);
+  for (size_t i = 0; i < count; i++) {
+    const MetricsLabelStats * stats = & snapshot -> labels[family][i];
+    push_timing(L, stats -> calls, stats -> errors, stats -> total_ns);
+    lua_setfield(L, -2, stats -> name);
+  }
+}
+
+/*
+ * metrics_snapshot() returns every counter, per-command and per-host timing
+ * (milliseconds), gauges and per-second I/O rates since the last sample.
+ */
+int lua_metrics_snapshot(lua_State * L) {
+  MetricsSnapshot * snapshot = lua_newuserdatauv(L, sizeof(MetricsSnapshot), 0);
+  metrics_snapshot(snapshot);
+  MetricsRates rates;
+  metrics_rates(snapshot, & rates);
+  const uint64_t * c = snapshot -> counters;
+
+  lua_createtable(L, 0, 8);
+  set_number(L, "uptime_seconds", snapshot -> uptime);
+  set_integer(L, "connections", c[METRIC_CONNECTIONS_ACCEPTED] - c[METRIC_CONNECTIONS_CLOSED]);
+
+  lua_createtable(L, 0, 12);
+  set_integer(L, "bytes_in", c[METRIC_BYTES_IN]);
+  set_integer(L, "bytes_out", c[METRIC_BYTES_OUT]);
+  set_integer(L, "frames_in", c[METRIC_FRAMES_IN]);
+  set_integer(L, "frames_out", c[METRIC_FRAMES_OUT]);
+  set_integer(L, "connections_accepted", c[METRIC_CONNECTIONS_ACCEPTED]);
+  set_integer(L, "commands_unknown", c[METRIC_COMMANDS_UNKNOWN]);
+  set_integer(L, "writes_deferred", c[METRIC_WRITES_DEFERRED]);
+  set_integer(L, "reads_paused", c[METRIC_READS_PAUSED]);
+  set_integer(L, "frames_compressed", c[METRIC_FRAMES_COMPRESSED]);
+  set_integer(L, "compression_saved_bytes",
+    c[METRIC_COMPRESSION_SAVED_BYTES]);
+  set_integer(L, "requests_shed", c[METRIC_REQUESTS_SHED]);
+  set_integer(L, "script_reloads", c[METRIC_SCRIPT_RELOADS]);
+  lua_setfield(L, -2, "counters");
+
+  lua_createtable(L, 0, 5);
+  set_number(L, "interval_seconds", rates.interval);
+  set_number(L, "bytes_in", rates.bytes_in);
+  set_number(L, "bytes_out", rates.bytes_out);
+  set_number(L, "frames_in", rates.frames_in);
+  set_number(L, "frames_out", rates.frames_out);
+  lua_setfield(L, -2, "per_second");
+
+  lua_createtable(L, 0, 2);
+  push_timing(L, c[METRIC_JSON_PARSE_COUNT], c[METRIC_JSON_PARSE_ERRORS], c[METRIC_JSON_PARSE_NS]);
+  lua_setfield(L, -2, "parse");
+  push_timing(L, c[METRIC_JSON_ENCODE_COUNT], c[METRIC_JSON_ENCODE_ERRORS], c[METRIC_JSON_ENCODE_NS]);
+  lua_setfield(L, -2, "encode");
+  lua_setfield(L, -2, "json");
+
+  push_family(L, snapshot, METRIC_FAMILY_COMMAND);
+  lua_setfield(L, -2, "commands");
+  push_family(L, snapshot, METRIC_FAMILY_HTTP_HOST);
+  lua_setfield(L, -2, "http_hosts");
+
+  lua_createtable(L, 0, (int) snapshot -> gauge_count);
+  for (size_t i = 0; i < snapshot -> gauge_count; i++) {
+    set_number(L, snapshot -> gauges[i].name, snapshot -> gauges[i].value);
+  }
+  lua_setfield(L, -2, "gauges");
+  return 1;
+}
+
+void metrics_lua_register(LuaEnvironment * env) {
+  lua_register(env -> L, "metrics_snapshot", lua_metrics_snapshot);
+}
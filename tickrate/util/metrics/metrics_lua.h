@@ -0,0 +1,13 @@
+#ifndef METRICS_LUA_H
+#define METRICS_LUA_H
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+struct LuaEnvironment;
+
+int lua_metrics_snapshot(lua_State *L);
+void metrics_lua_register(struct LuaEnvironment *env);
+
+#endif // METRICS_LUA_H
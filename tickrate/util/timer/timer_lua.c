@@ -0,0 +1,132 @@
+#include "timer_lua.h"
+#include "../lua/lua_init.h"
+#include "../../src/logging/logging.h"
+#include "../../src/task/timer_wheel.h"
+#include <stdlib.h>
+
+typedef struct ScheduledCall {
+  LuaTask base;
+  LuaEnvironment * owner;
+  /* Posted to the owner when the timer fires or is cancelled elsewhere */
+  LuaVMJob * job;
+  int fn_ref;
+  int args_ref;
+} ScheduledCall;
+
+static TimerWheel * env_timers(LuaEnvironment * env) {
+  return & env -> tickrate -> task_manager.timers;
+}
+
+static void release_call(LuaEnvironment * env, void * arg) {
+  ScheduledCall * call = (ScheduledCall * ) arg;
+  luaL_unref(env -> L, LUA_REGISTRYINDEX, call -> fn_ref);
+  luaL_unref(env -> L, LUA_REGISTRYINDEX, call -> args_ref);
+  free(call -> job);
+  free(call);
+}
+
+void timer_lua_release_pending(void * arg) {
+  ScheduledCall * call = (ScheduledCall * ) arg;
+  release_call(call -> owner, call);
+}
+
+static void finish_call(LuaTask * task, int status, int nres) {
+  (void) nres;
+  if (status != LUA_OK) {
+    log_error("Scheduled task failed: %s", lua_tostring(task -> co, -1));
+  }
+  lua_settop(task -> co, 0);
+  free(task);
+}
+
+static void run_call(LuaEnvironment * env, void * arg) {
+  ScheduledCall * call = (ScheduledCall * ) arg;
+  lua_State * L = env -> L;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, call -> fn_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, call -> args_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, call -> fn_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, call -> args_ref);
+
+  call -> base.on_finish = finish_call;
+  call -> base.client = NULL;
+  if (!lua_task_start( & call -> base, env, 1)) {
+    lua_pop(L, 2);
+    free(call);
+  }
+}
+
+/* Hands the call's job to its owner, which frees it once it has run */
+static void post_call(ScheduledCall * call, LuaVMJobFn fn) {
+  LuaVMJob * job = call -> job;
+  call -> job = NULL;
+  job -> fn = fn;
+  lua_vm_post_job(call -> owner, job);
+}
+
+static void timer_fired(void * arg) {
+  post_call((ScheduledCall * ) arg, run_call);
+}
+
+int lua_schedule_task(lua_State * L) {
+  LuaEnvironment * env = (LuaEnvironment * ) lua_touserdata(L, lua_upvalueindex(1));
+  lua_Integer delay = luaL_checkinteger(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  luaL_argcheck(L, delay >= 0, 1, "delay must be non-negative");
+  lua_settop(L, 3);
+
+  ScheduledCall * call = malloc(sizeof(ScheduledCall));
+  if (!call) {
+    return luaL_error(L, "out of memory scheduling task");
+  }
+  call -> owner = env;
+  call -> args_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  call -> fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  /* Allocated now, on the owner, so that firing cannot fail to post */
+  call -> job = lua_vm_job_create(run_call, call);
+  if (!call -> job) {
+    release_call(env, call);
+    return luaL_error(L, "out of memory scheduling task");
+  }
+
+  TimerHandle handle = timer_wheel_schedule(env_timers(env), (uint64_t) delay,
+    timer_fired, call);
+  if (!handle) {
+    release_call(env, call);
+    lua_pushnil(L);
+    lua_pushstring(L, "timer wheel is full");
+    return 2;
+  }
+
+  lua_pushinteger(L, (lua_Integer) handle);
+  return 1;
+}
+
+int lua_cancel_task(lua_State * L) {
+  LuaEnvironment * env = (LuaEnvironment * ) lua_touserdata(L, lua_upvalueindex(1));
+  TimerHandle handle = (TimerHandle) luaL_checkinteger(L, 1);
+
+  void * arg = NULL;
+  bool cancelled = timer_wheel_cancel(env_timers(env), handle, & arg);
+  if (cancelled) {
+    ScheduledCall * call = (ScheduledCall * ) arg;
+    if (call -> owner == env) {
+      release_call(env, call);
+    } else {
+      post_call(call, release_call);
+    }
+  }
+
+  lua_pushboolean(L, cancelled);
+  return 1;
+}
+
+void timer_lua_register(LuaEnvironment * env) {
+  lua_pushlightuserdata(env -> L, env);
+  lua_pushcclosure(env -> L, lua_schedule_task, 1);
+  lua_setglobal(env -> L, "schedule_task");
+
+  lua_pushlightuserdata(env -> L, env);
+  lua_pushcclosure(env -> L, lua_cancel_task, 1);
+  lua_setglobal(env -> L, "cancel_task");
+}
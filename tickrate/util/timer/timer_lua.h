@@ -0,0 +1,17 @@
+#ifndef TIMER_LUA_H
+#define TIMER_LUA_H
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+struct LuaEnvironment;
+
+int lua_schedule_task(lua_State *L);
+int lua_cancel_task(lua_State *L);
+void timer_lua_register(struct LuaEnvironment *env);
+
+/* Releases a call still on the timer wheel at shutdown, once no VM runs. */
+void timer_lua_release_pending(void *arg);
+
+#endif // TIMER_LUA_H